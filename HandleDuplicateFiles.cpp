@@ -1,4 +1,7 @@
 #include <windows.h>
+#include <winioctl.h>
+#include <bcrypt.h>
+#include <winternl.h>
 #include <tchar.h>
 
 #include <fcntl.h>  
@@ -9,387 +12,7383 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
 #include <unordered_map>
 #include <cstring>
 #include <cstdint>
 #include <algorithm>
+#include <memory>
+#include <cstdio>
+#include <list>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <functional>
 
-constexpr ULONGLONG MIN_SIZE_TO_CONSIDER = 16 * 1024;
+#include "HandleDuplicateFiles.h"
+
+#pragma comment(lib, "bcrypt.lib")
 
 // Use a suitable buffer size for file comparisons.
 constexpr size_t BUFFER_SIZE = 4096;
 
 //------------------------------------------------------------------------------
-// RightFileState
-//   A simple structure to hold the per-right-file state.
-struct RightFileState {
-    std::wstring filePath;      // The file's full path.
-    std::ifstream stream;       // Opened binary stream for the file.
+// g_compareTuning
+//   The CompareTuning every comparison on this thread reads: the process-wide
+//   one, or during a DuplicateScanner call that call's, set from
+//   ScanOptions::tuning.
+CompareTuning g_processTuning;
+thread_local CompareTuning* g_compareTuning = &g_processTuning;
+
+//------------------------------------------------------------------------------
+// Metrics
+//   Process-wide instrumentation: per-phase timings and I/O counters (opens,
+//   metadata queries, read calls, seeks, bytes read), enumeration counts, the
+//   distribution of first-mismatch offsets and of recursion depths in
+//   GroupFilesByContentUsingMap(), and the bytes that were at least needed to
+//   decide every file. Counters are relaxed atomics, as the dedup phase is
+//   multi-threaded. Printed with --metrics, exported with --metrics-file.
+//   Stages count into g_metrics, which is the process-wide g_processMetrics
+//   unless a DuplicateScanner call has put in its own for the thread; those are
+//   added to the scanner's and the process-wide ones when the call returns.
+enum class Phase {
+    Enumerate,
+    Compare,
+    Dedup,
+    Count
+};
+
+struct PhaseCounters {
+    std::atomic<uint64_t> opens{ 0 };
+    std::atomic<uint64_t> statCalls{ 0 };
+    std::atomic<uint64_t> readCalls{ 0 };
+    std::atomic<uint64_t> seeks{ 0 };
+    std::atomic<uint64_t> bytesRead{ 0 };
+    std::atomic<uint64_t> nanoseconds{ 0 };
+};
+
+class Histogram
+{
+public:
+    explicit Histogram(std::vector<uint64_t> bounds)
+        : m_bounds(std::move(bounds)), m_buckets(m_bounds.size() + 1) {}
+
+    void Observe(uint64_t value)
+    {
+        size_t bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // Adds the observations of other, which has the same bounds.
+    void Add(const Histogram& other)
+    {
+        for (size_t i = 0; i < m_buckets.size(); ++i)
+            m_buckets[i].fetch_add(other.Bucket(i), std::memory_order_relaxed);
+        m_sum.fetch_add(other.Sum(), std::memory_order_relaxed);
+    }
+
+    const std::vector<uint64_t>& Bounds() const { return m_bounds; }
+    uint64_t Bucket(size_t i) const { return m_buckets[i].load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<uint64_t> m_bounds;     // Inclusive upper bounds; one more bucket for larger values.
+    std::vector<std::atomic<uint64_t>> m_buckets;
+    std::atomic<uint64_t> m_sum{ 0 };
+};
+
+struct Metrics {
+    std::atomic<Phase> phase{ Phase::Enumerate };
+    PhaseCounters phases[static_cast<size_t>(Phase::Count)];
+
+    std::atomic<uint64_t> filesEnumerated{ 0 };
+    std::atomic<uint64_t> directoriesEnumerated{ 0 };
+    std::atomic<uint64_t> directoriesPruned{ 0 };  // Excluded by a rule.
+    std::atomic<uint64_t> reparseDirectoriesSkipped{ 0 };  // Junctions, mount points, placeholders.
+    std::atomic<uint64_t> filesConsidered{ 0 };
+    std::atomic<uint64_t> decisiveBytes{ 0 };   // Bytes that had to be read to decide each file.
+
+    // Adds the counts of other, which must not be counting any more.
+    void Add(const Metrics& other)
+    {
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+        {
+            const PhaseCounters& from = other.phases[i];
+            PhaseCounters& to = phases[i];
+            to.opens += from.opens;
+            to.statCalls += from.statCalls;
+            to.readCalls += from.readCalls;
+            to.seeks += from.seeks;
+            to.bytesRead += from.bytesRead;
+            to.nanoseconds += from.nanoseconds;
+        }
+        filesEnumerated += other.filesEnumerated;
+        directoriesEnumerated += other.directoriesEnumerated;
+        directoriesPruned += other.directoriesPruned;
+        reparseDirectoriesSkipped += other.reparseDirectoriesSkipped;
+        filesConsidered += other.filesConsidered;
+        decisiveBytes += other.decisiveBytes;
+        mismatchOffset.Add(other.mismatchOffset);
+        recursionDepth.Add(other.recursionDepth);
+    }
+
+    Histogram mismatchOffset{ { 0, 4095, 65535, 1048575, 16777215, 268435455, 4294967295ULL } };
+    Histogram recursionDepth{ { 0, 1, 2, 4, 8, 16, 32, 64 } };
+
+    PhaseCounters& Current() { return phases[static_cast<size_t>(phase.load(std::memory_order_relaxed))]; }
+
+    void CountOpen() { Current().opens.fetch_add(1, std::memory_order_relaxed); }
+    void CountStat() { Current().statCalls.fetch_add(1, std::memory_order_relaxed); }
+    void CountSeek() { Current().seeks.fetch_add(1, std::memory_order_relaxed); }
+    void CountRead(std::streamsize bytes)
+    {
+        PhaseCounters& counters = Current();
+        counters.readCalls.fetch_add(1, std::memory_order_relaxed);
+        if (bytes > 0)
+            counters.bytesRead.fetch_add(static_cast<uint64_t>(bytes), std::memory_order_relaxed);
+    }
+};
+
+Metrics g_processMetrics;
+thread_local Metrics* g_metrics = &g_processMetrics;
+
+//------------------------------------------------------------------------------
+// PhaseScope
+//   Switches the current metrics phase and adds the time spent in it on exit.
+class PhaseScope
+{
+public:
+    explicit PhaseScope(Phase phase)
+        : m_phase(phase), m_start(std::chrono::steady_clock::now())
+    {
+        g_metrics->phase = phase;
+    }
+
+    ~PhaseScope()
+    {
+        End();
+    }
+
+    // End the phase before the scope closes.
+    void End()
+    {
+        if (m_ended)
+            return;
+        m_ended = true;
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start);
+        g_metrics->phases[static_cast<size_t>(m_phase)].nanoseconds += static_cast<uint64_t>(elapsed.count());
+    }
+
+private:
+    Phase m_phase;
+    std::chrono::steady_clock::time_point m_start;
+    bool m_ended = false;
+};
+
+//------------------------------------------------------------------------------
+// ReportError()
+//   Reports a problem that does not stop the running stage, such as a file that
+//   cannot be read or a cache that cannot be saved: to g_onError, which a
+//   DuplicateScanner call sets from ScanCallbacks::onError for its thread, or
+//   else to std::wcerr.
+thread_local std::function<void(const std::wstring& message)> g_onError;
+
+void ReportError(const std::wstring& message)
+{
+    if (g_onError)
+        g_onError(message);
+    else
+        std::wcerr << message << std::endl;
+}
+
+//------------------------------------------------------------------------------
+// ToUtf8() / FromUtf8()
+//   Convert between UTF-16 strings and UTF-8 bytes.
+std::string ToUtf8(const std::wstring& text)
+{
+    std::string utf8;
+    if (!text.empty())
+    {
+        int length = WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+            nullptr, 0, nullptr, nullptr);
+        utf8.resize(length);
+        WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()),
+            &utf8[0], length, nullptr, nullptr);
+    }
+    return utf8;
+}
+
+std::wstring FromUtf8(const std::string& utf8)
+{
+    std::wstring text;
+    if (!utf8.empty())
+    {
+        int length = MultiByteToWideChar(CP_UTF8, 0, utf8.data(), static_cast<int>(utf8.size()), nullptr, 0);
+        text.resize(length);
+        MultiByteToWideChar(CP_UTF8, 0, utf8.data(), static_cast<int>(utf8.size()), &text[0], length);
+    }
+    return text;
+}
+
+//------------------------------------------------------------------------------
+// AppendJsonString()
+//   Append text to out as a quoted, escaped UTF-8 JSON string. NTFS names may
+//   hold unpaired surrogates, which UTF-8 cannot encode; they are written as
+//   \uXXXX escapes so that distinct names stay distinct.
+void AppendJsonString(std::string& out, const std::wstring& text)
+{
+    auto appendUtf8 = [&out](const std::wstring& run) {
+        for (char ch : ToUtf8(run))
+        {
+            if (ch == '"' || ch == '\\')
+            {
+                out += '\\';
+                out += ch;
+            }
+            else if (static_cast<unsigned char>(ch) < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                out += escaped;
+            }
+            else
+            {
+                out += ch;
+            }
+        }
+    };
+
+    out += '"';
+    size_t runStart = 0;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        const wchar_t ch = text[i];
+        if (ch < 0xD800 || ch > 0xDFFF)
+            continue;
+        if (ch <= 0xDBFF && i + 1 < text.size() && text[i + 1] >= 0xDC00 && text[i + 1] <= 0xDFFF)
+        {
+            ++i;
+            continue;
+        }
+        appendUtf8(text.substr(runStart, i - runStart));
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(ch));
+        out += escaped;
+        runStart = i + 1;
+    }
+    appendUtf8(text.substr(runStart));
+    out += '"';
+}
+
+//------------------------------------------------------------------------------
+// Tracer
+//   Optional span tracing (--trace=<file>), written as Chrome trace JSON to load
+//   in Perfetto or chrome://tracing. Each thread appends finished spans to its
+//   own buffer, merged when the trace is written; while tracing is off a span
+//   costs one relaxed load.
+struct TraceEvent {
+    const char* category;
+    const char* name;
+    uint64_t startUs;
+    uint64_t durationUs;
+    DWORD threadId;
+    std::string args;   // JSON members, without the braces.
+};
+
+class Tracer
+{
+public:
+    void Enable()
+    {
+        m_start = std::chrono::steady_clock::now();
+        m_enabled.store(true, std::memory_order_relaxed);
+    }
+
+    bool Enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    uint64_t NowUs() const
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - m_start).count());
+    }
+
+    void Record(TraceEvent&& event) { Buffer().push_back(std::move(event)); }
+
+    // Call once every traced thread has finished.
+    bool Write(const std::wstring& path)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto& buffer : m_buffers)
+        {
+            for (const TraceEvent& event : *buffer)
+            {
+                out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+                    << "\",\"ph\":\"X\",\"ts\":" << event.startUs << ",\"dur\":" << event.durationUs
+                    << ",\"pid\":1,\"tid\":" << event.threadId << ",\"args\":{" << event.args << "}}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    std::vector<TraceEvent>& Buffer()
+    {
+        thread_local std::vector<TraceEvent>* buffer = nullptr;
+        if (!buffer)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_buffers.push_back(std::make_unique<std::vector<TraceEvent>>());
+            buffer = m_buffers.back().get();
+        }
+        return *buffer;
+    }
+
+    std::atomic<bool> m_enabled{ false };
+    std::chrono::steady_clock::time_point m_start;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<std::vector<TraceEvent>>> m_buffers;
+};
+
+Tracer g_tracer;
+
+//------------------------------------------------------------------------------
+// TraceSpan
+//   Records one span from construction to End() or destruction. Arguments are
+//   only kept while tracing; guard expensive ones with "if (span)".
+class TraceSpan
+{
+public:
+    TraceSpan(const char* category, const char* name)
+        : m_active(g_tracer.Enabled()), m_category(category), m_name(name),
+        m_start(m_active ? g_tracer.NowUs() : 0) {}
+
+    ~TraceSpan()
+    {
+        End();
+    }
+
+    explicit operator bool() const { return m_active; }
+
+    void Arg(const char* key, const std::wstring& value)
+    {
+        if (!m_active)
+            return;
+        AppendKey(key);
+        AppendJsonString(m_args, value);
+    }
+
+    void Arg(const char* key, uint64_t value)
+    {
+        if (!m_active)
+            return;
+        AppendKey(key);
+        m_args += std::to_string(value);
+    }
+
+    void End()
+    {
+        if (!m_active)
+            return;
+        m_active = false;
+        g_tracer.Record({ m_category, m_name, m_start, g_tracer.NowUs() - m_start,
+            GetCurrentThreadId(), std::move(m_args) });
+    }
+
+private:
+    void AppendKey(const char* key)
+    {
+        if (!m_args.empty())
+            m_args += ',';
+        m_args += '"';
+        m_args += key;
+        m_args += "\":";
+    }
+
+    bool m_active;
+    const char* m_category;
+    const char* m_name;
+    uint64_t m_start;
+    std::string m_args;
+};
+
+//------------------------------------------------------------------------------
+// FileReader
+//   Reads from a file opened through a FileSystem.
+class FileReader
+{
+public:
+    virtual ~FileReader() = default;
+
+    // Moves the read position to offset bytes from the start of the file.
+    virtual void Seek(LONGLONG offset) = 0;
+
+    // Returns the number of bytes read: fewer than count only at the end of the
+    // file or on a read error.
+    virtual std::streamsize Read(char* buffer, std::streamsize count) = 0;
+
+    // Whether a read stopped short because of an error rather than the end of
+    // the file.
+    virtual bool Failed() const { return false; }
+};
+
+//------------------------------------------------------------------------------
+// RightFileState
+//   A simple structure to hold the per-right-file state.
+struct RightFileState {
+    const FileRecord* file;                 // The file being compared.
+    std::unique_ptr<FileReader> reader;     // Opened reader for the file.
+};
+
+typedef std::pair<std::streamsize, char> GroupKey;
+
+//------------------------------------------------------------------------------
+// DataRange / DataMap
+//   Allocated (non-hole) ranges of a sparse file, sorted by offset, as reported
+//   by FSCTL_QUERY_ALLOCATED_RANGES. Everything outside these ranges reads as zeros.
+struct DataRange {
+    LONGLONG offset;
+    LONGLONG length;
+};
+
+typedef std::vector<DataRange> DataMap;
+
+//------------------------------------------------------------------------------
+// QueryFileDataMap()
+//   Retrieves the allocated ranges of a sparse file (the Windows counterpart of
+//   walking a file with SEEK_DATA/SEEK_HOLE). Also returns the file size.
+//   Returns false if the ranges cannot be obtained; callers then treat the whole
+//   file as data.
+bool QueryFileDataMap(const std::wstring& filePath, DataMap& dataMap, LONGLONG& fileSize)
+{
+    HANDLE hFile = CreateFileW(filePath.c_str(),
+        FILE_READ_DATA,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        0,
+        nullptr);
+    g_metrics->CountOpen();
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    g_metrics->CountStat();
+    if (!GetFileSizeEx(hFile, &size))
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+    fileSize = size.QuadPart;
+
+    dataMap.clear();
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = fileSize;
+
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    bool result = true;
+    while (query.Length.QuadPart > 0)
+    {
+        DWORD bytesReturned = 0;
+        g_metrics->CountStat();
+        BOOL ok = DeviceIoControl(hFile, FSCTL_QUERY_ALLOCATED_RANGES,
+            &query, sizeof(query), ranges, sizeof(ranges), &bytesReturned, nullptr);
+        DWORD err = ok ? ERROR_SUCCESS : GetLastError();
+        if (!ok && err != ERROR_MORE_DATA)
+        {
+            result = false;
+            break;
+        }
+
+        const DWORD count = bytesReturned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        for (DWORD i = 0; i < count; ++i)
+            dataMap.push_back({ ranges[i].FileOffset.QuadPart, ranges[i].Length.QuadPart });
+
+        if (ok || count == 0)
+            break;
+
+        // Continue after the last range returned.
+        const LONGLONG next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+        query.Length.QuadPart = fileSize - next;
+        query.FileOffset.QuadPart = next;
+    }
+
+    CloseHandle(hFile);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// FileSystem
+//   What enumeration, content comparison and deduplication need from the file
+//   system. The program goes through g_fileSystem, a Win32FileSystem unless a
+//   benchmark swaps in the in-memory VirtualFileSystem.
+struct DirectoryEntry {
+    std::wstring name;
+    ULONGLONG fileId = 0;
+    ULONGLONG size = 0;
+    ULONGLONG lastWriteTime = 0;
+    DWORD attributes = 0;
+};
+
+//------------------------------------------------------------------------------
+// CloneResult
+//   Outcome of cloning a master's extents into a duplicate. Changed means the
+//   duplicate is no longer the file that was scanned, or no longer equal to the
+//   master, and must be left alone; Failed means cloning is not possible and a
+//   hard link may be tried.
+enum class CloneResult { Cloned, Changed, Failed };
+
+//------------------------------------------------------------------------------
+// DedupMaster
+//   A file opened as the master of a duplicate group.
+class DedupMaster
+{
+public:
+    virtual ~DedupMaster() = default;
+
+    // The file's current state, read through the open file (as
+    // FileSystem::QueryFileState()).
+    virtual bool Query(FileRecord& file) = 0;
+
+    // Most links per file on the master's volume, or 0 if unknown.
+    virtual DWORD LinkLimit() = 0;
+
+    // Prepares cloning from the master; false if its volume cannot clone.
+    virtual bool PrepareClone() = 0;
+
+    // Makes dupFile share the master's extents once it is re-validated against
+    // its record and the master's bytes. Only after PrepareClone().
+    virtual CloneResult CloneInto(const FileRecord& dupFile) = 0;
+};
+
+//------------------------------------------------------------------------------
+// DedupSession
+//   The destructive steps of deduplication on one file system, for one worker
+//   thread; it may keep state such as open directory handles across groups.
+//   Failures leave the last error set.
+class DedupSession
+{
+public:
+    virtual ~DedupSession() = default;
+
+    // Opens a file to be linked and cloned to; nullptr on failure.
+    virtual std::unique_ptr<DedupMaster> OpenMaster(const std::wstring& path) = 0;
+
+    // Atomically replaces dupPath with a hard link to master.
+    virtual bool ReplaceWithLink(DedupMaster& master, const std::wstring& dupPath) = 0;
+
+    // Whether file still has the size and last write time of its record, checked
+    // without opening it, right before it is replaced.
+    virtual bool IsUnchanged(const FileRecord& file) = 0;
+};
+
+class FileSystem
+{
+public:
+    virtual ~FileSystem() = default;
+
+    // Lists the entries of a directory except "." and "..", and the serial number
+    // of its volume. Returns false if the directory cannot be opened.
+    virtual bool ListDirectory(const std::wstring& directory, DWORD& volumeSerial,
+        std::vector<DirectoryEntry>& entries) = 0;
+
+    // Opens a file for reading at offset 0; returns nullptr on failure.
+    virtual std::unique_ptr<FileReader> OpenForRead(const std::wstring& path) = 0;
+
+    // Allocated ranges of a sparse file, as QueryFileDataMap().
+    virtual bool QueryDataMap(const std::wstring& path, DataMap& dataMap, LONGLONG& fileSize) = 0;
+
+    // The form of a root folder that enumeration builds paths from, so that path
+    // globs see one spelling: backslashes only, no trailing separator except
+    // after a drive.
+    virtual std::wstring NormalizeRoot(const std::wstring& root)
+    {
+        std::wstring normalized = root;
+        std::replace(normalized.begin(), normalized.end(), L'/', L'\\');
+        while (normalized.size() > 1 && normalized.back() == L'\\'
+            && !(normalized.size() == 3 && normalized[1] == L':'))
+            normalized.pop_back();
+        return normalized;
+    }
+
+    // Refreshes the id, volume, size, last write time, attributes and link count
+    // of file from the file itself. A directory entry is only kept current for
+    // the name the file was last written through, so for a file with several
+    // hard links the listed values can be stale. Returns false if the file cannot
+    // be queried.
+    virtual bool QueryFileState(const std::wstring& path, FileRecord& file) = 0;
+
+    // A session for deduplicating files of this file system.
+    virtual std::unique_ptr<DedupSession> OpenDedupSession() = 0;
+
+    // Reads all size bytes of a file into buffer at once. Returns false if it
+    // cannot be opened, is shorter or has grown past size.
+    virtual bool ReadWhole(const std::wstring& path, char* buffer, ULONGLONG size)
+    {
+        std::unique_ptr<FileReader> reader = OpenForRead(path);
+        if (!reader || reader->Read(buffer, static_cast<std::streamsize>(size)) != static_cast<std::streamsize>(size))
+            return false;
+        char extra;
+        return reader->Read(&extra, 1) == 0 && !reader->Failed();
+    }
+};
+
+//------------------------------------------------------------------------------
+// Win32FileSystem
+//   The real file system. Its readers go straight to ReadFile rather than
+//   through a stream, on which a failed read looks like the end of the file,
+//   and keep the error of one for Failed().
+class Win32FileReader : public FileReader
+{
+public:
+    explicit Win32FileReader(const std::wstring& path)
+        : m_handle(CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr)) {}
+
+    ~Win32FileReader()
+    {
+        if (m_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(m_handle);
+    }
+
+    bool IsOpen() const { return m_handle != INVALID_HANDLE_VALUE; }
+
+    void Seek(LONGLONG offset) override
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = offset;
+        if (!SetFilePointerEx(m_handle, position, nullptr, FILE_BEGIN))
+            m_error = GetLastError();
+    }
+
+    std::streamsize Read(char* buffer, std::streamsize count) override
+    {
+        std::streamsize done = 0;
+        while (done < count && m_error == ERROR_SUCCESS)
+        {
+            DWORD bytes = 0;
+            const DWORD request = static_cast<DWORD>((std::min)(count - done, static_cast<std::streamsize>(1u << 30)));
+            if (!ReadFile(m_handle, buffer + done, request, &bytes, nullptr))
+            {
+                m_error = GetLastError();
+                break;
+            }
+            if (bytes == 0)
+                break;
+            done += bytes;
+        }
+        return done;
+    }
+
+    bool Failed() const override { return m_error != ERROR_SUCCESS; }
+
+private:
+    HANDLE m_handle;
+    DWORD m_error = ERROR_SUCCESS;
+};
+
+class Win32FileSystem : public FileSystem
+{
+public:
+    bool ListDirectory(const std::wstring& directory, DWORD& volumeSerial,
+        std::vector<DirectoryEntry>& entries) override
+    {
+        HANDLE hDirectory = CreateFileW(directory.c_str(),
+            FILE_LIST_DIRECTORY | SYNCHRONIZE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS,
+            nullptr);
+        g_metrics->CountOpen();
+        if (hDirectory == INVALID_HANDLE_VALUE)
+            return false;
+
+        BY_HANDLE_FILE_INFORMATION directoryInfo = { 0 };
+        g_metrics->CountStat();
+        if (!GetFileInformationByHandle(hDirectory, &directoryInfo))
+        {
+            CloseHandle(hDirectory);
+            return false;
+        }
+        volumeSerial = directoryInfo.dwVolumeSerialNumber;
+
+        // ULONGLONG elements keep the entries 8-byte aligned.
+        std::vector<ULONGLONG> buffer(64 * 1024 / sizeof(ULONGLONG));
+        FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+        while (GetFileInformationByHandleEx(hDirectory, infoClass, buffer.data(),
+            static_cast<DWORD>(buffer.size() * sizeof(ULONGLONG))))
+        {
+            infoClass = FileIdBothDirectoryInfo;
+            g_metrics->CountStat();
+
+            const BYTE* entryPtr = reinterpret_cast<const BYTE*>(buffer.data());
+            while (true)
+            {
+                const auto* info = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(entryPtr);
+                DirectoryEntry entry;
+                entry.name.assign(info->FileName, info->FileNameLength / sizeof(WCHAR));
+                if (entry.name != L"." && entry.name != L"..")
+                {
+                    entry.fileId = static_cast<ULONGLONG>(info->FileId.QuadPart);
+                    entry.size = static_cast<ULONGLONG>(info->EndOfFile.QuadPart);
+                    entry.lastWriteTime = static_cast<ULONGLONG>(info->LastWriteTime.QuadPart);
+                    entry.attributes = info->FileAttributes;
+                    entries.push_back(std::move(entry));
+                }
+
+                if (info->NextEntryOffset == 0)
+                    break;
+                entryPtr += info->NextEntryOffset;
+            }
+        }
+        // Anything but the end of the listing leaves it incomplete. File systems
+        // without id listings (FAT, some redirectors) reject the first call.
+        const DWORD error = GetLastError();
+        CloseHandle(hDirectory);
+        if (infoClass == FileIdBothDirectoryRestartInfo
+            && (error == ERROR_INVALID_PARAMETER || error == ERROR_NOT_SUPPORTED))
+            return ListDirectoryByName(directory, entries);
+        return error == ERROR_NO_MORE_FILES;
+    }
+
+    std::unique_ptr<FileReader> OpenForRead(const std::wstring& path) override
+    {
+        auto reader = std::make_unique<Win32FileReader>(path);
+        if (!reader->IsOpen())
+            return nullptr;
+        return reader;
+    }
+
+    bool QueryDataMap(const std::wstring& path, DataMap& dataMap, LONGLONG& fileSize) override
+    {
+        return QueryFileDataMap(path, dataMap, fileSize);
+    }
+
+    // An attribute-only open, which does not touch the data or break oplocks.
+    bool QueryFileState(const std::wstring& path, FileRecord& file) override
+    {
+        HANDLE hFile = CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+        g_metrics->CountOpen();
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        const bool queried = QueryOpenFile(hFile, file);
+        CloseHandle(hFile);
+        return queried;
+    }
+
+    // The state of an open file, as QueryFileState().
+    static bool QueryOpenFile(HANDLE hFile, FileRecord& file)
+    {
+        BY_HANDLE_FILE_INFORMATION info = { 0 };
+        g_metrics->CountStat();
+        if (!GetFileInformationByHandle(hFile, &info))
+            return false;
+
+        file.fileId = (static_cast<ULONGLONG>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+        file.volumeSerial = info.dwVolumeSerialNumber;
+        file.size = (static_cast<ULONGLONG>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+        file.lastWriteTime = (static_cast<ULONGLONG>(info.ftLastWriteTime.dwHighDateTime) << 32)
+            | info.ftLastWriteTime.dwLowDateTime;
+        file.attributes = info.dwFileAttributes;
+        file.linkCount = info.nNumberOfLinks;
+        return true;
+    }
+
+    std::unique_ptr<DedupSession> OpenDedupSession() override;
+
+    // Also made absolute, with "." and ".." resolved.
+    std::wstring NormalizeRoot(const std::wstring& root) override
+    {
+        std::wstring full = FileSystem::NormalizeRoot(root);
+        const DWORD length = GetFullPathNameW(full.c_str(), 0, nullptr, nullptr);
+        if (length != 0)
+        {
+            std::wstring buffer(length, L'\0');
+            const DWORD written = GetFullPathNameW(full.c_str(), length, &buffer[0], nullptr);
+            if (written != 0 && written < length)
+            {
+                buffer.resize(written);
+                full = FileSystem::NormalizeRoot(buffer);
+            }
+        }
+        return full;
+    }
+
+    // A plain handle rather than a stream: no stream buffer to set up. A last
+    // one-byte read has to find the end of the file.
+    bool ReadWhole(const std::wstring& path, char* buffer, ULONGLONG size) override
+    {
+        HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        ULONGLONG done = 0;
+        bool atEnd = false;
+        while (done < size)
+        {
+            DWORD bytes = 0;
+            const DWORD request = static_cast<DWORD>((std::min)(size - done, static_cast<ULONGLONG>(1u << 30)));
+            if (!ReadFile(hFile, buffer + done, request, &bytes, nullptr) || bytes == 0)
+                break;
+            done += bytes;
+        }
+        if (done == size)
+        {
+            char extra;
+            DWORD bytes = 0;
+            atEnd = ReadFile(hFile, &extra, 1, &bytes, nullptr) && bytes == 0;
+        }
+        CloseHandle(hFile);
+        return atEnd;
+    }
+
+private:
+    // Lists a directory by name only, for file systems that cannot return file
+    // ids with the entries. The ids stay 0; the snapshot taken before files are
+    // compared (FileSystem::QueryFileState()) supplies them.
+    static bool ListDirectoryByName(const std::wstring& directory, std::vector<DirectoryEntry>& entries)
+    {
+        WIN32_FIND_DATAW findData;
+        HANDLE hFind = FindFirstFileExW((directory + L"\\*").c_str(), FindExInfoBasic, &findData,
+            FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH);
+        g_metrics->CountOpen();
+        if (hFind == INVALID_HANDLE_VALUE)
+            return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+        do
+        {
+            DirectoryEntry entry;
+            entry.name = findData.cFileName;
+            if (entry.name == L"." || entry.name == L"..")
+                continue;
+            entry.size = (static_cast<ULONGLONG>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+            entry.lastWriteTime = (static_cast<ULONGLONG>(findData.ftLastWriteTime.dwHighDateTime) << 32)
+                | findData.ftLastWriteTime.dwLowDateTime;
+            entry.attributes = findData.dwFileAttributes;
+            entries.push_back(std::move(entry));
+        } while (FindNextFileW(hFind, &findData));
+        const DWORD error = GetLastError();
+        FindClose(hFind);
+        return error == ERROR_NO_MORE_FILES;
+    }
+};
+
+// Per thread, like g_metrics, so that a scanner reading through a checkpoint
+// (JournaledFileSystem) does not redirect other threads.
+Win32FileSystem g_win32FileSystem;
+thread_local FileSystem* g_fileSystem = &g_win32FileSystem;
+
+//------------------------------------------------------------------------------
+// DataMapCursor
+//   Walks a DataMap with monotonically increasing offsets. A default-constructed
+//   cursor (no map) treats the whole file as data.
+struct DataMapCursor {
+    const DataMap* dataMap = nullptr;
+    size_t index = 0;
+
+    // Returns whether the byte at pos is data and sets runEnd to the offset where
+    // that state changes (or fileSize).
+    bool RunAt(LONGLONG pos, LONGLONG fileSize, LONGLONG& runEnd)
+    {
+        if (!dataMap)
+        {
+            runEnd = fileSize;
+            return true;
+        }
+        while (index < dataMap->size() && (*dataMap)[index].offset + (*dataMap)[index].length <= pos)
+            ++index;
+        if (index == dataMap->size())
+        {
+            runEnd = fileSize;
+            return false;
+        }
+        const DataRange& range = (*dataMap)[index];
+        if (pos < range.offset)
+        {
+            runEnd = (std::min)(range.offset, fileSize);
+            return false;
+        }
+        runEnd = (std::min)(range.offset + range.length, fileSize);
+        return true;
+    }
+};
+
+//------------------------------------------------------------------------------
+// FindFirstNonZero()
+//   Zero-check kernel: returns the index of the first non-zero byte in buffer,
+//   or size if the buffer is all zeros. Scans eight bytes at a time.
+size_t FindFirstNonZero(const char* buffer, size_t size)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, buffer + i, sizeof(word));
+        if (word != 0)
+            break;
+    }
+    for (; i < size; ++i)
+    {
+        if (buffer[i] != 0)
+            break;
+    }
+    return i;
+}
+
+//------------------------------------------------------------------------------
+// CompareFilesHoleAware()
+//   Variant of the chunk loop of CompareFilesBufferedAdvanced used when sparse files
+//   take part in the comparison. Chunks never cross a data/hole boundary of any
+//   participating file, so each chunk is homogeneous per file:
+//     - hole vs hole: skipped without reading;
+//     - hole vs data: the data side is checked with FindFirstNonZero();
+//     - data vs data: compared as usual.
+//   Mismatch keys are the same as in the plain loop (first mismatch offset, right byte).
+void CompareFilesHoleAware(FileReader& master,
+    const DataMap* masterMap,
+    std::vector<RightFileState>& rightStates,
+    const std::vector<const DataMap*>& rightMaps,
+    LONGLONG fileSize,
+    std::streamsize totalBytesRead,
+    std::map<GroupKey, std::vector<FileRecord>>& keyGroups,
+    std::vector<FileRecord>& duplicateGroup)
+{
+    struct HoleAwareState {
+        RightFileState* state;
+        DataMapCursor cursor;
+        LONGLONG streamPos;
+    };
+
+    std::vector<HoleAwareState> states;
+    states.reserve(rightStates.size());
+    for (size_t i = 0; i < rightStates.size(); ++i)
+        states.push_back({ &rightStates[i], DataMapCursor{ rightMaps[i] }, totalBytesRead });
+
+    DataMapCursor masterCursor{ masterMap };
+    LONGLONG masterPos = totalBytesRead;
+    LONGLONG pos = totalBytesRead;
+
+    const size_t chunkSize = g_compareTuning->chunkSize;
+    std::vector<char> buffers(2 * chunkSize);
+    char* masterBuffer = buffers.data();
+    char* rightBuffer = masterBuffer + chunkSize;
+
+    while (pos < fileSize && !states.empty())
+    {
+        LONGLONG limit;
+        const bool masterData = masterCursor.RunAt(pos, fileSize, limit);
+        bool anyData = masterData;
+        for (auto& s : states)
+        {
+            LONGLONG runEnd;
+            anyData |= s.cursor.RunAt(pos, fileSize, runEnd);
+            limit = (std::min)(limit, runEnd);
+        }
+
+        if (!anyData)
+        {
+            // Matching holes in every file: nothing to read.
+            pos = limit;
+            continue;
+        }
+
+        const std::streamsize chunk = static_cast<std::streamsize>(
+            (std::min)(static_cast<LONGLONG>(chunkSize), limit - pos));
+
+        size_t masterNonZero = static_cast<size_t>(chunk);
+        if (masterData)
+        {
+            if (masterPos != pos)
+            {
+                master.Seek(pos);
+                g_metrics->CountSeek();
+            }
+            const std::streamsize masterBytes = master.Read(masterBuffer, chunk);
+            g_metrics->CountRead(masterBytes);
+            if (masterBytes != chunk)
+                break;
+            masterPos = pos + chunk;
+            masterNonZero = FindFirstNonZero(masterBuffer, static_cast<size_t>(chunk));
+        }
+
+        for (auto it = states.begin(); it != states.end(); )
+        {
+            LONGLONG runEnd;
+            const bool rightData = it->cursor.RunAt(pos, fileSize, runEnd);
+
+            std::streamsize mismatchIndex = chunk;
+            char rightByte = 0;
+            if (rightData)
+            {
+                FileReader& reader = *it->state->reader;
+                if (it->streamPos != pos)
+                {
+                    reader.Seek(pos);
+                    g_metrics->CountSeek();
+                }
+                const std::streamsize rightBytes = reader.Read(rightBuffer, chunk);
+                g_metrics->CountRead(rightBytes);
+                if (rightBytes != chunk) {
+                    it = states.erase(it);
+                    continue;
+                }
+                it->streamPos = pos + chunk;
+
+                if (masterData)
+                {
+                    if (std::memcmp(masterBuffer, rightBuffer, static_cast<size_t>(chunk)) != 0)
+                    {
+                        mismatchIndex = 0;
+                        while (masterBuffer[mismatchIndex] == rightBuffer[mismatchIndex])
+                            ++mismatchIndex;
+                    }
+                }
+                else
+                {
+                    mismatchIndex = static_cast<std::streamsize>(
+                        FindFirstNonZero(rightBuffer, static_cast<size_t>(chunk)));
+                }
+                if (mismatchIndex < chunk)
+                    rightByte = rightBuffer[mismatchIndex];
+            }
+            else if (masterData)
+            {
+                // The right file reads as zeros here.
+                mismatchIndex = static_cast<std::streamsize>(masterNonZero);
+            }
+
+            if (mismatchIndex < chunk)
+            {
+                GroupKey key{ pos + mismatchIndex, rightByte };
+                g_metrics->mismatchOffset.Observe(static_cast<uint64_t>(key.first));
+                keyGroups[key].push_back(*it->state->file);
+                it = states.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        pos += chunk;
+    }
+
+    // Files sharing the master's size that survived every chunk are duplicates.
+    if (pos >= fileSize)
+    {
+        for (const auto& s : states)
+            duplicateGroup.push_back(*s.state->file);
+    }
+}
+
+//------------------------------------------------------------------------------
+// CompareFilesBufferedAdvanced()
+//   Template function that compares a master (left) file against a collection
+//   of right files (via iterators over FileRecord). It reads the master file
+//   one chunk at a time. For each master chunk, it reads the same number of bytes
+//   from each right file. If a mismatch or size difference is detected, the 
+//   function computes a comparison key (for example, the first mismatch byte offset
+//   plus 1, multiplied by -1 if master < right, or by 1 if master > right), adds 
+//   the right file's path to the keyGroups map, and removes that file from further comparison.
+//   After processing the master file, any remaining right file is checked for extra data.
+template <typename T> // T is an iterator over FileRecord items.
+void CompareFilesBufferedAdvanced(const FileRecord& masterFile,
+    T rightFileBegin,
+    T rightFileEnd,
+    std::streamsize totalBytesRead,
+    std::map<GroupKey, std::vector<FileRecord>>& keyGroups,
+    std::vector<FileRecord>& duplicateGroup)
+{
+    TraceSpan span("compare", "pivot pass");
+    if (span)
+    {
+        span.Arg("pivot", masterFile.path);
+        span.Arg("files", static_cast<uint64_t>(std::distance(rightFileBegin, rightFileEnd)));
+        span.Arg("offset", static_cast<uint64_t>(totalBytesRead));
+    }
+
+    // Open the master (left) file.
+    std::unique_ptr<FileReader> master = g_fileSystem->OpenForRead(masterFile.path);
+    g_metrics->CountOpen();
+    if (!master) {
+        ReportError(L"Error opening master file: " + masterFile.path);
+        return;
+    }
+    master->Seek(totalBytesRead);
+    g_metrics->CountSeek();
+
+    // Build a vector of right file state objects.
+    std::vector<RightFileState> rightStates;
+    bool anySparse = (masterFile.attributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+    for (T it = rightFileBegin; it != rightFileEnd; ++it)
+    {
+        RightFileState state;
+        state.file = &*it;
+        state.reader = g_fileSystem->OpenForRead(state.file->path);
+        g_metrics->CountOpen();
+        if (!state.reader) {
+            ReportError(L"Error opening right file: " + state.file->path);
+            continue;
+        }
+        state.reader->Seek(totalBytesRead);
+        g_metrics->CountSeek();
+        rightStates.push_back(std::move(state));
+        anySparse |= (it->attributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+    }
+
+    // If any participant is sparse, switch to the hole-aware loop.
+    if (anySparse)
+    {
+        std::vector<DataMap> maps(rightStates.size() + 1);
+        std::vector<const DataMap*> rightMaps(rightStates.size(), nullptr);
+        const DataMap* masterMap = nullptr;
+        LONGLONG fileSize = -1;
+        bool anyMapped = false;
+
+        LONGLONG size = 0;
+        if ((masterFile.attributes & FILE_ATTRIBUTE_SPARSE_FILE) && g_fileSystem->QueryDataMap(masterFile.path, maps[0], size))
+        {
+            masterMap = &maps[0];
+            fileSize = size;
+            anyMapped = true;
+        }
+        for (size_t i = 0; i < rightStates.size(); ++i)
+        {
+            if ((rightStates[i].file->attributes & FILE_ATTRIBUTE_SPARSE_FILE)
+                && g_fileSystem->QueryDataMap(rightStates[i].file->path, maps[i + 1], size))
+            {
+                rightMaps[i] = &maps[i + 1];
+                fileSize = size;
+                anyMapped = true;
+            }
+        }
+
+        if (anyMapped)
+        {
+            // All files of a size group have the same size; take the master's if it was not queried.
+            if (!masterMap)
+                fileSize = static_cast<LONGLONG>(masterFile.size);
+            CompareFilesHoleAware(*master, masterMap, rightStates, rightMaps, fileSize,
+                totalBytesRead, keyGroups, duplicateGroup);
+            return;
+        }
+    }
+
+    const size_t chunkSize = g_compareTuning->chunkSize;
+    std::vector<char> buffers(2 * chunkSize);
+    char* masterBuffer = buffers.data();
+    char* rightBuffer = masterBuffer + chunkSize;
+
+    //std::streamsize totalBytesRead = 0;
+
+    // Process the master file one chunk at a time.
+    while (true)
+    {
+        std::streamsize masterBytes = master->Read(masterBuffer, chunkSize);
+        g_metrics->CountRead(masterBytes);
+        if (masterBytes <= 0) // End of master file.
+            break;
+
+        // Iterate over rightStates; if a right file fails comparison for this chunk,
+        // compute its key and remove it from the list.
+        for (auto it = rightStates.begin(); it != rightStates.end(); )
+        {
+            std::streamsize rightBytes = it->reader->Read(rightBuffer, masterBytes);
+            g_metrics->CountRead(rightBytes);
+
+            // If the right file didn't supply as many bytes as master, it's shorter or had a read error.
+            if (rightBytes != masterBytes) {
+                it = rightStates.erase(it);
+                continue;
+            }
+
+            // Compare the current chunk.
+            int cmp = std::memcmp(masterBuffer, rightBuffer, static_cast<size_t>(masterBytes));
+            if (cmp != 0)
+            {
+                // Find first mismatching byte.
+                std::streamsize mismatchIndex = 0;
+                for (; mismatchIndex < masterBytes; ++mismatchIndex) {
+                    if (masterBuffer[mismatchIndex] != rightBuffer[mismatchIndex])
+                        break;
+                }
+                //int64_t diffKey = (cmp < 0 ? -1LL : 1LL) * (totalBytesRead + mismatchIndex + 1);
+                GroupKey key{ totalBytesRead + mismatchIndex, rightBuffer[mismatchIndex] };
+                g_metrics->mismatchOffset.Observe(static_cast<uint64_t>(key.first));
+                keyGroups[key].push_back(*it->file);
+                it = rightStates.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+
+        totalBytesRead += masterBytes;
+
+        // If all right files have produced a difference, we're done.
+        if (rightStates.empty())
+            break;
+    }
+
+    // For any right file that is still in the state list (i.e. no mismatch was found in the master part),
+    // check if it might have extra data.
+    for (auto& state : rightStates)
+    {
+        // Nothing left to read past the master's end, and not for a read error.
+        char extra;
+        if (state.reader->Read(&extra, 1) == 0 && !state.reader->Failed() && !master->Failed()) {
+            // The file matches the master exactly.
+            duplicateGroup.push_back(*state.file);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// GroupFilesByContentUsingMap()
+//    Group files (all of same size) by content using a hash map keyed by an
+//    int64_t comparison key produced against a chosen pivot.
+//    Duplicate groups (with two or more files) are recorded in duplicateGroups.
+//    depth is the recursion level, for metrics.
+void GroupFilesByContentUsingMap(const std::vector<FileRecord>& files,
+    std::vector<std::vector<FileRecord>>& duplicateGroups, std::streamsize totalBytesRead,
+    int depth = 0)
+{
+    if (files.size() < 2)
+        return;
+
+    g_metrics->recursionDepth.Observe(static_cast<uint64_t>(depth));
+
+    TraceSpan span("compare", "recursion level");
+    span.Arg("depth", static_cast<uint64_t>(depth));
+    span.Arg("files", static_cast<uint64_t>(files.size()));
+    span.Arg("offset", static_cast<uint64_t>(totalBytesRead));
+
+    std::vector<FileRecord> duplicateGroup;
+
+    std::map<GroupKey, std::vector<FileRecord>> keyGroups;
+    // Use the first file as the pivot.
+    const FileRecord& pivot = files[0];
+    duplicateGroup.push_back(pivot); // the pivot is equal to itself.
+
+
+    // Limit batch size in the call to CompareFilesBufferedAdvanced.
+    const size_t MAX_BATCH = g_compareTuning->maxBatch;
+    auto rightBegin = std::next(files.begin());
+    auto rightEnd = files.end();
+    size_t totalRightFiles = std::distance(rightBegin, rightEnd);
+    size_t processed = 0;
+    while (processed < totalRightFiles)
+    {
+        // Calculate the iterators for the current batch.
+        auto batchBegin = rightBegin;
+        std::advance(batchBegin, processed);
+        size_t batchSize = (std::min)(totalRightFiles - processed, MAX_BATCH);
+        auto batchEnd = batchBegin;
+        std::advance(batchEnd, batchSize);
+
+        CompareFilesBufferedAdvanced(pivot, batchBegin, batchEnd, totalBytesRead, keyGroups, duplicateGroup);
+        processed += batchSize;
+    }
+
+    // Bytes needed to decide: duplicates must be read in full, a file split off
+    // alone up to its mismatch, and a pivot left alone up to the last mismatch.
+    uint64_t decisiveBytes = 0;
+    std::streamsize lastMismatch = totalBytesRead;
+    for (const auto& entry : keyGroups)
+    {
+        lastMismatch = (std::max)(lastMismatch, entry.first.first + 1);
+        if (entry.second.size() == 1)
+            decisiveBytes += static_cast<uint64_t>(entry.first.first + 1);
+    }
+    if (duplicateGroup.size() > 1)
+        decisiveBytes += pivot.size * duplicateGroup.size();
+    else
+        decisiveBytes += static_cast<uint64_t>(lastMismatch);
+    g_metrics->decisiveBytes += decisiveBytes;
+
+    // Group with key 0 are duplicates of pivot.
+    if (duplicateGroup.size() > 1)
+        duplicateGroups.push_back(duplicateGroup);
+
+    // Process nonzero key groups recursively.
+    for (const auto& entry : keyGroups)
+    {
+        //if (entry.first == 0)
+        //    continue;
+        if (entry.second.size() > 1)
+            GroupFilesByContentUsingMap(entry.second, duplicateGroups, entry.first.first, depth + 1);
+    }
+}
+
+//------------------------------------------------------------------------------
+// HashBytes()
+//   Fast 64-bit hash of a buffer, a word at a time. Only used to bucket
+//   contents that are then compared with memcmp.
+uint64_t HashBytes(const char* data, size_t length)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ length;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        h = (h ^ (word * 0xBF58476D1CE4E5B9ULL)) * 0x94D049BB133111EBULL;
+        h ^= h >> 29;
+    }
+    for (; i < length; ++i)
+        h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001B3ULL;
+    return h ^ (h >> 32);
+}
+
+//------------------------------------------------------------------------------
+// GroupSmallFiles()
+//   Groups files of one small size (up to CompareTuning::smallFileLimit) by
+//   reading each whole in one call, where opening, seeking and comparing chunk
+//   by chunk against pivots would cost more than the data. Contents are
+//   bucketed by HashBytes() and confirmed with memcmp. While the group fits in
+//   SMALL_FILE_ARENA the contents stay in memory from the one read; otherwise
+//   only those of buckets with two or more files are read again, and a bucket
+//   too large for the arena goes to GroupFilesByContentUsingMap(). Unreadable
+//   files, and those no longer of the group's size, are left out.
+constexpr size_t SMALL_FILE_ARENA = 64 * 1024 * 1024;
+
+void GroupSmallFiles(const std::vector<FileRecord>& files, std::vector<std::vector<FileRecord>>& duplicateGroups)
+{
+    if (files.size() < 2)
+        return;
+
+    const ULONGLONG size = files.front().size;
+    const size_t length = static_cast<size_t>(size);
+    auto readWhole = [&](const FileRecord& file, char* buffer) {
+        g_metrics->CountOpen();
+        const bool read = g_fileSystem->ReadWhole(file.path, buffer, size);
+        g_metrics->CountRead(read ? static_cast<std::streamsize>(size) : 0);
+        return read;
+    };
+
+    // One read per file, keeping the contents if they all fit.
+    const bool keep = size * files.size() <= SMALL_FILE_ARENA;
+    // Left uninitialized: every byte used is read first.
+    std::unique_ptr<char[]> arena(new char[keep ? length * files.size() : length]);
+    std::unordered_map<uint64_t, std::vector<size_t>> buckets;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        char* slot = arena.get() + (keep ? i * length : 0);
+        if (readWhole(files[i], slot))
+            buckets[HashBytes(slot, length)].push_back(i);
+    }
+
+    // Buckets in the order of their first file, for a stable output order.
+    std::vector<const std::vector<size_t>*> candidates;
+    for (const auto& entry : buckets)
+    {
+        if (entry.second.size() >= 2)
+            candidates.push_back(&entry.second);
+    }
+    std::sort(candidates.begin(), candidates.end(),
+        [](const std::vector<size_t>* a, const std::vector<size_t>* b) { return a->front() < b->front(); });
+
+    std::unique_ptr<char[]> bucketArena;
+    for (const std::vector<size_t>* bucket : candidates)
+    {
+        std::vector<const char*> contents;
+        std::vector<size_t> members;
+        if (keep)
+        {
+            for (size_t i : *bucket)
+            {
+                contents.push_back(arena.get() + i * length);
+                members.push_back(i);
+            }
+        }
+        else if (size * bucket->size() <= SMALL_FILE_ARENA)
+        {
+            bucketArena.reset(new char[length * bucket->size()]);
+            for (size_t i : *bucket)
+            {
+                char* slot = bucketArena.get() + members.size() * length;
+                if (readWhole(files[i], slot))
+                {
+                    contents.push_back(slot);
+                    members.push_back(i);
+                }
+            }
+        }
+        else
+        {
+            std::vector<FileRecord> bucketFiles;
+            for (size_t i : *bucket)
+                bucketFiles.push_back(files[i]);
+            GroupFilesByContentUsingMap(bucketFiles, duplicateGroups, 0);
+            continue;
+        }
+
+        // Within a bucket, nearly always one content; collisions split it.
+        std::vector<std::vector<size_t>> partitions;
+        for (size_t j = 0; j < members.size(); ++j)
+        {
+            auto partition = std::find_if(partitions.begin(), partitions.end(), [&](const std::vector<size_t>& p) {
+                return std::memcmp(contents[p.front()], contents[j], length) == 0;
+            });
+            if (partition == partitions.end())
+                partitions.push_back({ j });
+            else
+                partition->push_back(j);
+        }
+        for (const auto& partition : partitions)
+        {
+            if (partition.size() < 2)
+                continue;
+            std::vector<FileRecord> group;
+            for (size_t j : partition)
+                group.push_back(files[members[j]]);
+            g_metrics->decisiveBytes += size * group.size();
+            duplicateGroups.push_back(std::move(group));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// FileIdentity
+//   What a fingerprint cache entry is keyed by: the file's volume and index
+//   (the Windows counterpart of dev/inode), its size and last write time.
+struct FileIdentity {
+    DWORD volumeSerial = 0;
+    ULONGLONG fileIndex = 0;
+    ULONGLONG size = 0;
+    ULONGLONG lastWriteTime = 0;
+
+    FileIdentity() = default;
+    FileIdentity(DWORD volumeSerial_, ULONGLONG fileIndex_, ULONGLONG size_, ULONGLONG lastWriteTime_)
+        : volumeSerial(volumeSerial_), fileIndex(fileIndex_), size(size_), lastWriteTime(lastWriteTime_) {}
+    explicit FileIdentity(const FileRecord& file)
+        : volumeSerial(file.volumeSerial), fileIndex(file.fileId), size(file.size), lastWriteTime(file.lastWriteTime) {}
+
+    bool operator==(const FileIdentity& other) const
+    {
+        return volumeSerial == other.volumeSerial && fileIndex == other.fileIndex
+            && size == other.size && lastWriteTime == other.lastWriteTime;
+    }
+};
+
+struct FileIdentityHash {
+    size_t operator()(const FileIdentity& id) const
+    {
+        uint64_t h = id.fileIndex * 0x9E3779B97F4A7C15ULL;
+        h ^= (static_cast<uint64_t>(id.volumeSerial) << 32) ^ id.size;
+        h ^= id.lastWriteTime + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h);
+    }
+};
+
+//------------------------------------------------------------------------------
+// Fingerprint
+//   Cached content summary of a file: hashes of a few sample blocks, which are
+//   cheap to compute, and, once a file has had to be told apart from a file with
+//   the same samples, a SHA-256 of the whole content.
+constexpr size_t FINGERPRINT_SAMPLES = 4;
+constexpr size_t CONTENT_HASH_SIZE = 32;
+
+struct Fingerprint {
+    uint64_t samples[FINGERPRINT_SAMPLES] = {};
+    BYTE contentHash[CONTENT_HASH_SIZE] = {};
+    bool hasContentHash = false;
+};
+
+//------------------------------------------------------------------------------
+// ComputeSampleHashes()
+//   Hashes (FNV-1a) BUFFER_SIZE blocks at the head, at 1/3, at 2/3 and at the tail
+//   of the file.
+bool ComputeSampleHashes(const std::wstring& filePath, ULONGLONG size, Fingerprint& fingerprint)
+{
+    std::unique_ptr<FileReader> reader = g_fileSystem->OpenForRead(filePath);
+    g_metrics->CountOpen();
+    if (!reader)
+        return false;
+
+    char buffer[BUFFER_SIZE];
+    for (size_t i = 0; i < FINGERPRINT_SAMPLES; ++i)
+    {
+        ULONGLONG offset = (size > BUFFER_SIZE)
+            ? (size - BUFFER_SIZE) * i / (FINGERPRINT_SAMPLES - 1) : 0;
+        reader->Seek(static_cast<LONGLONG>(offset));
+        std::streamsize bytes = reader->Read(buffer, BUFFER_SIZE);
+        g_metrics->CountSeek();
+        g_metrics->CountRead(bytes);
+        if (bytes <= 0)
+            return false;
+
+        uint64_t h = 0xCBF29CE484222325ULL;
+        for (std::streamsize j = 0; j < bytes; ++j)
+        {
+            h ^= static_cast<unsigned char>(buffer[j]);
+            h *= 0x100000001B3ULL;
+        }
+        fingerprint.samples[i] = h;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// ComputeContentHash()
+//   Computes the SHA-256 of the whole file with BCrypt.
+bool ComputeContentHash(const std::wstring& filePath, Fingerprint& fingerprint)
+{
+    std::unique_ptr<FileReader> reader = g_fileSystem->OpenForRead(filePath);
+    g_metrics->CountOpen();
+    if (!reader)
+        return false;
+
+    BCRYPT_ALG_HANDLE hAlg = nullptr;
+    if (!BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, nullptr, 0)))
+        return false;
+
+    bool result = false;
+    BCRYPT_HASH_HANDLE hHash = nullptr;
+    if (BCRYPT_SUCCESS(BCryptCreateHash(hAlg, &hHash, nullptr, 0, nullptr, 0, 0)))
+    {
+        std::vector<char> buffer(1024 * 1024);
+        result = true;
+        while (true)
+        {
+            std::streamsize bytes = reader->Read(buffer.data(), buffer.size());
+            g_metrics->CountRead(bytes);
+            if (bytes <= 0)
+            {
+                result = !reader->Failed();
+                break;
+            }
+            if (!BCRYPT_SUCCESS(BCryptHashData(hHash, reinterpret_cast<PUCHAR>(buffer.data()),
+                static_cast<ULONG>(bytes), 0)))
+            {
+                result = false;
+                break;
+            }
+        }
+        if (result)
+            result = BCRYPT_SUCCESS(BCryptFinishHash(hHash, fingerprint.contentHash, CONTENT_HASH_SIZE, 0));
+        BCryptDestroyHash(hHash);
+    }
+    BCryptCloseAlgorithmProvider(hAlg, 0);
+
+    fingerprint.hasContentHash = result;
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// FingerprintCache
+//   Persistent map FileIdentity -> Fingerprint kept in a sidecar file. An entry is
+//   valid as long as the file keeps its identity, size and last write time; any
+//   write changes the last write time and thereby orphans the entry.
+//   (Alternate data streams are not used: writing one updates the host file's
+//   last write time.)
+class FingerprintCache
+{
+public:
+    explicit FingerprintCache(const std::wstring& cachePath) : m_cachePath(cachePath) {}
+
+    // Loads the sidecar file; a missing or unreadable file yields an empty cache.
+    void Load()
+    {
+        std::ifstream in(m_cachePath, std::ios::binary);
+        if (!in)
+            return;
+
+        uint32_t header[3] = {};
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || header[0] != MAGIC || header[1] != VERSION)
+            return;
+
+        for (uint32_t i = 0; i < header[2]; ++i)
+        {
+            Record record;
+            in.read(reinterpret_cast<char*>(&record), sizeof(record));
+            if (!in)
+                break;
+
+            Fingerprint fingerprint;
+            std::memcpy(fingerprint.samples, record.samples, sizeof(record.samples));
+            std::memcpy(fingerprint.contentHash, record.contentHash, sizeof(record.contentHash));
+            fingerprint.hasContentHash = record.hasContentHash != 0;
+            m_entries[FileIdentity{ record.volumeSerial, record.fileIndex, record.size, record.lastWriteTime }] = Entry{ fingerprint };
+        }
+    }
+
+    // Writes the cache next to its final location and swaps it in. Entries not
+    // looked up or stored since Load() are dropped first: their file is gone,
+    // changed, or no longer has a same-size partner.
+    bool Save()
+    {
+        for (auto it = m_entries.begin(); it != m_entries.end();)
+        {
+            if (it->second.touched)
+            {
+                ++it;
+                continue;
+            }
+            it = m_entries.erase(it);
+            m_dirty = true;
+        }
+        if (!m_dirty)
+            return true;
+
+        const std::wstring tempPath = m_cachePath + L".tmp";
+        {
+            std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return false;
+
+            uint32_t header[3] = { MAGIC, VERSION, static_cast<uint32_t>(m_entries.size()) };
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            for (const auto& entry : m_entries)
+            {
+                Record record = {};
+                record.volumeSerial = entry.first.volumeSerial;
+                record.fileIndex = entry.first.fileIndex;
+                record.size = entry.first.size;
+                record.lastWriteTime = entry.first.lastWriteTime;
+                record.hasContentHash = entry.second.fingerprint.hasContentHash ? 1 : 0;
+                std::memcpy(record.samples, entry.second.fingerprint.samples, sizeof(record.samples));
+                std::memcpy(record.contentHash, entry.second.fingerprint.contentHash, sizeof(record.contentHash));
+                out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+            }
+            if (!out)
+                return false;
+        }
+        if (!MoveFileExW(tempPath.c_str(), m_cachePath.c_str(), MOVEFILE_REPLACE_EXISTING))
+            return false;
+        m_dirty = false;
+        return true;
+    }
+
+    Fingerprint* Find(const FileIdentity& identity)
+    {
+        auto it = m_entries.find(identity);
+        if (it == m_entries.end())
+            return nullptr;
+        it->second.touched = true;
+        return &it->second.fingerprint;
+    }
+
+    void Store(const FileIdentity& identity, const Fingerprint& fingerprint)
+    {
+        m_entries[identity] = Entry{ fingerprint, true };
+        m_dirty = true;
+    }
+
+private:
+    static constexpr uint32_t MAGIC = 0x43464448; // "HDFC"
+    static constexpr uint32_t VERSION = 1;
+
+#pragma pack(push, 1)
+    struct Record {
+        uint32_t volumeSerial;
+        uint64_t fileIndex;
+        uint64_t size;
+        uint64_t lastWriteTime;
+        uint32_t hasContentHash;
+        uint64_t samples[FINGERPRINT_SAMPLES];
+        BYTE contentHash[CONTENT_HASH_SIZE];
+    };
+#pragma pack(pop)
+
+    struct Entry {
+        Fingerprint fingerprint;
+        bool touched = false;   // Looked up or stored since Load().
+    };
+
+    std::wstring m_cachePath;
+    std::unordered_map<FileIdentity, Entry, FileIdentityHash> m_entries;
+    bool m_dirty = false;
+};
+
+//------------------------------------------------------------------------------
+// GroupFilesUsingFingerprintCache()
+//   Pre-partitions a same-size group by cached fingerprints before any content
+//   comparison: first by sample hashes (files unique here are done), then by
+//   content hash. Missing fingerprints are computed and stored. Each hash-equal
+//   partition is either byte-verified with GroupFilesByContentUsingMap() or, with
+//   trustCache, taken as a duplicate group as is.
+void GroupFilesUsingFingerprintCache(const std::vector<FileRecord>& files,
+    ULONGLONG size,
+    FingerprintCache& cache,
+    bool trustCache,
+    std::vector<std::vector<FileRecord>>& duplicateGroups)
+{
+    struct Candidate {
+        const FileRecord* file;
+        FileIdentity identity;
+        Fingerprint fingerprint;
+        bool cacheable;
+    };
+
+    std::vector<Candidate> candidates;
+    std::vector<FileRecord> unfingerprinted;
+    for (const auto& file : files)
+    {
+        // The identity comes from enumeration; no file is opened to look it up.
+        Candidate candidate{ &file, FileIdentity(file), Fingerprint(), file.fileId != 0 };
+        if (const Fingerprint* cached = candidate.cacheable ? cache.Find(candidate.identity) : nullptr)
+        {
+            candidate.fingerprint = *cached;
+        }
+        else if (ComputeSampleHashes(file.path, size, candidate.fingerprint))
+        {
+            if (candidate.cacheable)
+                cache.Store(candidate.identity, candidate.fingerprint);
+        }
+        else
+        {
+            unfingerprinted.push_back(file);
+            continue;
+        }
+        candidates.push_back(candidate);
+    }
+
+    // Files that could not be fingerprinted go through the plain comparison.
+    GroupFilesByContentUsingMap(unfingerprinted, duplicateGroups, 0);
+
+    std::map<std::vector<uint64_t>, std::vector<Candidate*>> samplePartitions;
+    for (auto& candidate : candidates)
+    {
+        std::vector<uint64_t> key(candidate.fingerprint.samples, candidate.fingerprint.samples + FINGERPRINT_SAMPLES);
+        samplePartitions[key].push_back(&candidate);
+    }
+
+    // Bytes needed to decide, as the pivot path counts them: a file told apart
+    // by its samples needed the sample blocks, one told apart by its content
+    // hash or taken as a duplicate the whole file. Byte-verified partitions are
+    // counted by GroupFilesByContentUsingMap(). Fingerprints found in the cache
+    // count too, though nothing was read for them.
+    const ULONGLONG sampleBytes = (std::min)(size, static_cast<ULONGLONG>(FINGERPRINT_SAMPLES * BUFFER_SIZE));
+    uint64_t decisiveBytes = 0;
+
+    for (const auto& samplePartition : samplePartitions)
+    {
+        if (samplePartition.second.size() < 2)
+        {
+            decisiveBytes += sampleBytes;
+            continue;
+        }
+
+        std::map<std::string, std::vector<FileRecord>> hashPartitions;
+        std::vector<FileRecord> unhashed;
+        for (Candidate* candidate : samplePartition.second)
+        {
+            if (!candidate->fingerprint.hasContentHash)
+            {
+                if (!ComputeContentHash(candidate->file->path, candidate->fingerprint))
+                {
+                    unhashed.push_back(*candidate->file);
+                    continue;
+                }
+                if (candidate->cacheable)
+                    cache.Store(candidate->identity, candidate->fingerprint);
+            }
+            std::string key(reinterpret_cast<const char*>(candidate->fingerprint.contentHash), CONTENT_HASH_SIZE);
+            hashPartitions[key].push_back(*candidate->file);
+        }
+
+        GroupFilesByContentUsingMap(unhashed, duplicateGroups, 0);
+
+        for (const auto& hashPartition : hashPartitions)
+        {
+            if (hashPartition.second.size() < 2 || trustCache)
+                decisiveBytes += size * hashPartition.second.size();
+            if (hashPartition.second.size() < 2)
+                continue;
+            if (trustCache)
+                duplicateGroups.push_back(hashPartition.second);
+            else
+                GroupFilesByContentUsingMap(hashPartition.second, duplicateGroups, 0);
+        }
+    }
+    g_metrics->decisiveBytes += decisiveBytes;
+}
+
+//------------------------------------------------------------------------------
+// ToLower()
+//    Converts a std::wstring to lower-case.
+std::wstring ToLower(const std::wstring& str)
+{
+    std::wstring lower = str;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::towlower);
+    return lower;
+}
+
+//------------------------------------------------------------------------------
+// ParseNumber()
+//   Parses all of text as an unsigned decimal or, for double, a decimal number.
+//   Returns false on anything else, so that a mistyped option value is a usage
+//   error rather than an exception.
+bool ParseNumber(const std::wstring& text, ULONGLONG& value)
+{
+    if (text.empty() || !iswdigit(text[0]))
+        return false;
+    try
+    {
+        size_t used = 0;
+        value = std::stoull(text, &used);
+        return used == text.size();
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+bool ParseNumber(const std::wstring& text, double& value)
+{
+    if (text.empty() || !(iswdigit(text[0]) || text[0] == L'.'))
+        return false;
+    try
+    {
+        size_t used = 0;
+        value = std::stod(text, &used);
+        return used == text.size();
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+// MatchGlob()
+//   Whether text matches glob, with '*' and '?'. Characters of text are folded
+//   to lower case; glob must already be lower-case. On a mismatch after a '*',
+//   the match is retried one character further on, so nothing is allocated.
+bool MatchGlob(const std::wstring& glob, const std::wstring& text)
+{
+    size_t g = 0, n = 0;
+    size_t starGlob = std::wstring::npos, starText = 0;
+    while (n < text.size())
+    {
+        if (g < glob.size() && (glob[g] == L'?' || glob[g] == static_cast<wchar_t>(towlower(text[n]))))
+        {
+            ++g;
+            ++n;
+        }
+        else if (g < glob.size() && glob[g] == L'*')
+        {
+            starGlob = g++;
+            starText = n;
+        }
+        else if (starGlob != std::wstring::npos)
+        {
+            g = starGlob + 1;
+            n = ++starText;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (g < glob.size() && glob[g] == L'*')
+        ++g;
+    return g == glob.size();
+}
+
+//------------------------------------------------------------------------------
+// PathFilter
+//   Which files enumeration keeps, compiled once from the command line and then
+//   matched against the name of each directory entry without allocating:
+//     - a size range, by default from MIN_SIZE_TO_CONSIDER up;
+//     - a set of extensions ("txt,.log;.tar.gz"), case-insensitive, held in a
+//       trie walked backwards from the end of the name;
+//     - include globs, of which a name must match one if any are given, and
+//       exclude globs, of which it must match none ('*' and '?', case-insensitive).
+//   It also holds the directory exclusion rules, checked before a directory is
+//   opened so that a pruned subtree is never read: globs matched against the
+//   directory's name or, if they contain a backslash, its full path.
+class PathFilter
+{
+public:
+    PathFilter() = default;
+
+    explicit PathFilter(const ScanOptions& options)
+        : m_minSize(options.minSize), m_maxSize(options.maxSize)
+    {
+        const std::wstring& extensions = options.extensionFilter;
+        size_t begin = 0;
+        while (begin <= extensions.size())
+        {
+            size_t end = extensions.find_first_of(L",;", begin);
+            if (end == std::wstring::npos)
+                end = extensions.size();
+            std::wstring extension = ToLower(extensions.substr(begin, end - begin));
+            if (!extension.empty() && extension[0] == L'.')
+                extension.erase(0, 1);
+            if (!extension.empty())
+                AddExtension(extension);
+            begin = end + 1;
+        }
+        for (const auto& glob : options.includeGlobs)
+            m_include.push_back(ToLower(glob));
+        for (const auto& glob : options.excludeGlobs)
+            m_exclude.push_back(ToLower(glob));
+        for (const auto& glob : options.excludeDirectories)
+        {
+            std::wstring lower = ToLower(glob);
+            std::replace(lower.begin(), lower.end(), L'/', L'\\');
+            while (lower.size() > 1 && lower.back() == L'\\')
+                lower.pop_back();
+            (lower.find(L'\\') == std::wstring::npos ? m_excludeDirectoryNames : m_excludeDirectoryPaths).push_back(lower);
+        }
+    }
+
+    bool PrunesDirectory(const std::wstring& name, const std::wstring& path) const
+    {
+        auto matches = [](const std::vector<std::wstring>& globs, const std::wstring& text) {
+            return std::any_of(globs.begin(), globs.end(),
+                [&](const std::wstring& glob) { return MatchGlob(glob, text); });
+        };
+        return matches(m_excludeDirectoryNames, name) || matches(m_excludeDirectoryPaths, path);
+    }
+
+    bool Matches(const std::wstring& name, ULONGLONG size) const
+    {
+        if (size < m_minSize || size > m_maxSize)
+            return false;
+        if (m_trie.size() > 1 && !HasExtension(name))
+            return false;
+        if (!m_include.empty() && std::none_of(m_include.begin(), m_include.end(),
+            [&](const std::wstring& glob) { return MatchGlob(glob, name); }))
+            return false;
+        return std::none_of(m_exclude.begin(), m_exclude.end(),
+            [&](const std::wstring& glob) { return MatchGlob(glob, name); });
+    }
+
+private:
+    // Children are few per node, so a linear scan beats any lookup structure.
+    struct TrieNode {
+        std::vector<std::pair<wchar_t, uint32_t>> children;
+        bool terminal = false;
+    };
+
+    // Extensions are stored reversed, as names are matched from their end.
+    void AddExtension(const std::wstring& extension)
+    {
+        uint32_t node = 0;
+        for (auto it = extension.rbegin(); it != extension.rend(); ++it)
+        {
+            const uint32_t child = Child(node, *it);
+            if (child != 0)
+            {
+                node = child;
+                continue;
+            }
+            m_trie[node].children.emplace_back(*it, static_cast<uint32_t>(m_trie.size()));
+            node = static_cast<uint32_t>(m_trie.size());
+            m_trie.emplace_back();
+        }
+        m_trie[node].terminal = true;
+    }
+
+    // 0 (the root, never a child) if there is none.
+    uint32_t Child(uint32_t node, wchar_t ch) const
+    {
+        for (const auto& child : m_trie[node].children)
+        {
+            if (child.first == ch)
+                return child.second;
+        }
+        return 0;
+    }
+
+    bool HasExtension(const std::wstring& name) const
+    {
+        uint32_t node = 0;
+        for (size_t i = name.size(); i-- > 0;)
+        {
+            // A longer extension such as "tar.gz" may continue past a dot.
+            if (name[i] == L'.' && m_trie[node].terminal)
+                return true;
+            node = Child(node, static_cast<wchar_t>(towlower(name[i])));
+            if (node == 0)
+                return false;
+        }
+        return false;
+    }
+
+    ULONGLONG m_minSize = MIN_SIZE_TO_CONSIDER;
+    ULONGLONG m_maxSize = ~0ULL;
+    std::vector<TrieNode> m_trie = std::vector<TrieNode>(1);
+    std::vector<std::wstring> m_include;
+    std::vector<std::wstring> m_exclude;
+    std::vector<std::wstring> m_excludeDirectoryNames;
+    std::vector<std::wstring> m_excludeDirectoryPaths;
+};
+
+//------------------------------------------------------------------------------
+// EnumerationHooks
+//   Lets the caller of EnumerateFilesAndGroupBySize() stop it between
+//   directories, follow how many files it has considered so far, and take the
+//   records itself instead of having them collected in sizeGroups.
+struct EnumerationHooks {
+    const std::atomic<bool>* cancel = nullptr;
+    std::function<void(uint64_t filesConsidered)> onDirectory;
+    std::function<void(FileRecord&& record)> onFile;
+    // After each listing: the directories still to list, the next one last.
+    std::function<void(const std::vector<std::wstring>& pending)> onPending;
+    uint64_t filesConsidered = 0;
+};
+
+//------------------------------------------------------------------------------
+// EnumerateFilesAndGroupBySize()
+//   Enumerates all files under the given directories and, for each file
+//   that passes the optional extension filter, records its size, file id, last
+//   write time and attributes in a FileRecord inserted into a sizeGroups map.
+//   The directory is read through a handle with FileIdBothDirectoryInfo, which
+//   returns many entries per call including their file ids, so nothing is opened
+//   per file here; only the files of a size shared with others are later queried
+//   one by one (CompareSizeGroup()).
+//   Directories are listed depth first from a stack of those still pending,
+//   which a resumed scan can start from instead of the root.
+// Parameters:
+//   pending - The directories to search, the first to list last.
+//   sizeGroups - Out parameter; a hash map where key is file size and value is a
+//                vector of records of the files of that size.
+//   filter - Which files to record; by default all of at least MIN_SIZE_TO_CONSIDER bytes.
+//   hooks - Optional cancellation flag and progress callbacks.
+void EnumerateFilesAndGroupBySize(std::vector<std::wstring> pending,
+    std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    const PathFilter& filter,
+    EnumerationHooks* hooks)
+{
+    while (!pending.empty())
+    {
+        if (hooks && hooks->cancel && *hooks->cancel)
+            return;
+        const std::wstring directory = std::move(pending.back());
+        pending.pop_back();
+
+        TraceSpan span("enumerate", "list directory");
+        span.Arg("path", directory);
+
+        DWORD volumeSerial = 0;
+        std::vector<DirectoryEntry> entries;
+        if (!g_fileSystem->ListDirectory(directory, volumeSerial, entries))
+            continue;
+        ++g_metrics->directoriesEnumerated;
+
+        // Subdirectories are visited after this listing is done.
+        std::vector<std::wstring> subdirectories;
+        // Only a drive root keeps its trailing separator (FileSystem::NormalizeRoot()).
+        const std::wstring prefix = !directory.empty() && directory.back() == L'\\' ? directory : directory + L"\\";
+
+        for (const DirectoryEntry& entry : entries)
+        {
+            // Exclude links. (They have the REPARSE_POINT flag) For directories this
+            // covers junctions and volume mount points, so the traversal never leaves
+            // the root's volume, and cloud placeholders; those are counted apart
+            // from the directories pruned by a rule.
+            if (entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            {
+                if (entry.attributes & FILE_ATTRIBUTE_DIRECTORY)
+                    ++g_metrics->reparseDirectoriesSkipped;
+                continue;
+            }
+
+            if (entry.attributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                std::wstring fullPath = prefix + entry.name;
+                if (filter.PrunesDirectory(entry.name, fullPath))
+                {
+                    ++g_metrics->directoriesPruned;
+                    continue;
+                }
+                subdirectories.push_back(std::move(fullPath));
+            }
+            else
+            {
+                ++g_metrics->filesEnumerated;
+                // The path is only built for files that pass the filter.
+                if (filter.Matches(entry.name, entry.size))
+                {
+                    ++g_metrics->filesConsidered;
+                    if (hooks)
+                        ++hooks->filesConsidered;
+                    FileRecord record;
+                    record.path = prefix + entry.name;
+                    record.fileId = entry.fileId;
+                    record.volumeSerial = volumeSerial;
+                    record.size = entry.size;
+                    record.lastWriteTime = entry.lastWriteTime;
+                    record.attributes = entry.attributes;
+
+                    // Insert the record into the appropriate size bucket.
+                    if (hooks && hooks->onFile)
+                        hooks->onFile(std::move(record));
+                    else
+                        sizeGroups[entry.size].push_back(std::move(record));
+                }
+            }
+        }
+        span.End();
+
+        // The subdirectories go next, the first of them on top.
+        pending.insert(pending.end(), std::make_move_iterator(subdirectories.rbegin()),
+            std::make_move_iterator(subdirectories.rend()));
+        if (hooks && hooks->onDirectory)
+            hooks->onDirectory(hooks->filesConsidered);
+        if (hooks && hooks->onPending)
+            hooks->onPending(pending);
+    }
+}
+
+// The whole tree under directory.
+void EnumerateFilesAndGroupBySize(const std::wstring& directory,
+    std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    const PathFilter& filter = PathFilter(),
+    EnumerationHooks* hooks = nullptr)
+{
+    EnumerateFilesAndGroupBySize(std::vector<std::wstring>{ directory }, sizeGroups, filter, hooks);
+}
+
+//------------------------------------------------------------------------------
+// IsUnchangedSinceScan()
+//   Cheap re-validation right before a destructive step: compares the size and
+//   last write time recorded before comparison with the current ones, using a
+//   path query that does not open the file. Both come from the file rather than
+//   a directory entry, so they agree for every name of a hard-linked file.
+bool IsUnchangedSinceScan(const FileRecord& file)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    g_metrics->CountStat();
+    if (!GetFileAttributesExW(file.path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    const ULONGLONG size = (static_cast<ULONGLONG>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+    const ULONGLONG lastWriteTime = (static_cast<ULONGLONG>(data.ftLastWriteTime.dwHighDateTime) << 32)
+        | data.ftLastWriteTime.dwLowDateTime;
+    return size == file.size && lastWriteTime == file.lastWriteTime;
+}
+
+//------------------------------------------------------------------------------
+// CloneSource
+//   The master file opened once per group for block cloning, together with the
+//   parameters every FSCTL_DUPLICATE_EXTENTS_TO_FILE call needs.
+struct CloneSource {
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    LONGLONG size = 0;
+    DWORD clusterSize = 0;
+    WORD checksumAlgorithm = 0;
+    bool sparse = false;
+
+    ~CloneSource()
+    {
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+    }
+};
+
+//------------------------------------------------------------------------------
+// OpenCloneSource()
+//   Opens the master for block cloning. Returns false if its volume does not
+//   support block reference counting, in which case the hard-link path is used.
+bool OpenCloneSource(const std::wstring& master, CloneSource& source)
+{
+    // Deny writers so that the master cannot change while it is being cloned.
+    source.handle = CreateFileW(master.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        0,
+        nullptr);
+    g_metrics->CountOpen();
+    if (source.handle == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD fsFlags = 0;
+    if (!GetVolumeInformationByHandleW(source.handle, nullptr, 0, nullptr, nullptr, &fsFlags, nullptr, 0)
+        || !(fsFlags & FILE_SUPPORTS_BLOCK_REFCOUNTING))
+        return false;
+
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity = { 0 };
+    DWORD bytesReturned = 0;
+    if (!DeviceIoControl(source.handle, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0,
+        &integrity, sizeof(integrity), &bytesReturned, nullptr))
+        return false;
+    source.clusterSize = integrity.ClusterSizeInBytes;
+    source.checksumAlgorithm = integrity.ChecksumAlgorithm;
+
+    BY_HANDLE_FILE_INFORMATION fileInfo = { 0 };
+    if (!GetFileInformationByHandle(source.handle, &fileInfo) || source.clusterSize == 0)
+        return false;
+    source.size = (static_cast<LONGLONG>(fileInfo.nFileSizeHigh) << 32) | fileInfo.nFileSizeLow;
+    source.sparse = (fileInfo.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// ReadsEqual()
+//   Whether the first size bytes behind two handles are equal, read at explicit
+//   offsets so that neither file position matters. Returns false with the last
+//   error set if a read fails, and with ERROR_SUCCESS if the contents differ.
+bool ReadsEqual(HANDLE left, HANDLE right, LONGLONG size)
+{
+    constexpr DWORD CHUNK = 1024 * 1024;
+    std::vector<char> leftBuffer(CHUNK), rightBuffer(CHUNK);
+    for (LONGLONG offset = 0; offset < size; offset += CHUNK)
+    {
+        const DWORD count = static_cast<DWORD>((std::min)(static_cast<LONGLONG>(CHUNK), size - offset));
+        for (auto side : { std::make_pair(left, leftBuffer.data()), std::make_pair(right, rightBuffer.data()) })
+        {
+            OVERLAPPED at = { 0 };
+            at.Offset = static_cast<DWORD>(offset);
+            at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD bytesRead = 0;
+            g_metrics->CountRead(count);
+            if (!ReadFile(side.first, side.second, count, &bytesRead, &at))
+                return false;
+            if (bytesRead != count)
+            {
+                SetLastError(ERROR_SUCCESS);
+                return false;
+            }
+        }
+        if (memcmp(leftBuffer.data(), rightBuffer.data(), count) != 0)
+        {
+            SetLastError(ERROR_SUCCESS);
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// CloneFileExtents()
+//   Makes dupFile share the extents of the clone source, in ranges of up to
+//   CLONE_CHUNK bytes per FSCTL_DUPLICATE_EXTENTS_TO_FILE call. The duplicate is
+//   opened without write sharing for the duration, so nobody modifies it between
+//   the calls, and is re-validated through that handle before anything is
+//   cloned: its id, size and last write time must still be the scanned ones and
+//   its bytes those of the source, which writers are kept out of as well. On
+//   Failed the last error is set.
+CloneResult CloneFileExtents(const CloneSource& source, const FileRecord& dupFile)
+{
+    // Must stay below 4 GB and be a multiple of any cluster size.
+    constexpr LONGLONG CLONE_CHUNK = 1LL << 30;
+
+    HANDLE hTarget = CreateFileW(dupFile.path.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ,
+        nullptr,
+        OPEN_EXISTING,
+        0,
+        nullptr);
+    g_metrics->CountOpen();
+    if (hTarget == INVALID_HANDLE_VALUE)
+        return CloneResult::Failed;
+
+    FileRecord current;
+    if (!Win32FileSystem::QueryOpenFile(hTarget, current))
+    {
+        const DWORD err = GetLastError();
+        CloseHandle(hTarget);
+        SetLastError(err);
+        return CloneResult::Failed;
+    }
+    if (current.volumeSerial != dupFile.volumeSerial || current.fileId != dupFile.fileId
+        || current.size != dupFile.size || current.lastWriteTime != dupFile.lastWriteTime
+        || static_cast<LONGLONG>(current.size) != source.size)
+    {
+        CloseHandle(hTarget);
+        return CloneResult::Changed;
+    }
+    if (!ReadsEqual(source.handle, hTarget, source.size))
+    {
+        const DWORD err = GetLastError();
+        CloseHandle(hTarget);
+        SetLastError(err);
+        return err == ERROR_SUCCESS ? CloneResult::Changed : CloneResult::Failed;
+    }
+
+    bool result = true;
+    DWORD bytesReturned = 0;
+
+    // Clone regions must be cluster-aligned and the integrity settings must match.
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity = { 0 };
+    LARGE_INTEGER targetSize;
+    if (!DeviceIoControl(hTarget, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0,
+        &integrity, sizeof(integrity), &bytesReturned, nullptr)
+        || !GetFileSizeEx(hTarget, &targetSize))
+    {
+        result = false;
+    }
+    else if (integrity.ChecksumAlgorithm != source.checksumAlgorithm || targetSize.QuadPart != source.size)
+    {
+        SetLastError(ERROR_NOT_SUPPORTED);
+        result = false;
+    }
+    else if (source.sparse
+        && !DeviceIoControl(hTarget, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr))
+    {
+        result = false;
+    }
+
+    for (LONGLONG offset = 0; result && offset < source.size; offset += CLONE_CHUNK)
+    {
+        // The last range is rounded up to the cluster size; it may cross the end of file.
+        LONGLONG count = (std::min)(CLONE_CHUNK, source.size - offset);
+        count = (count + source.clusterSize - 1) / source.clusterSize * source.clusterSize;
+
+        DUPLICATE_EXTENTS_DATA extents = { 0 };
+        extents.FileHandle = source.handle;
+        extents.SourceFileOffset.QuadPart = offset;
+        extents.TargetFileOffset.QuadPart = offset;
+        extents.ByteCount.QuadPart = count;
+        result = DeviceIoControl(hTarget, FSCTL_DUPLICATE_EXTENTS_TO_FILE,
+            &extents, sizeof(extents), nullptr, 0, &bytesReturned, nullptr) != 0;
+    }
+
+    DWORD err = GetLastError();
+    CloseHandle(hTarget);
+    SetLastError(err);
+    return result ? CloneResult::Cloned : CloneResult::Failed;
+}
+
+//------------------------------------------------------------------------------
+// HardLinkReplacer
+//   Replaces duplicates with hard links to a master without a window in which the
+//   duplicate's name is gone: the link is created under the duplicate's name with
+//   FileLinkInformation and ReplaceIfExists, so the old file is only unlinked once
+//   the new link is in place, in a single call. If it fails, the duplicate is left
+//   untouched.
+//   The name is resolved relative to a handle of the duplicate's directory, and
+//   directory handles are kept open across calls so that runs touching the same
+//   directories over and over (millions of files) do not re-walk their paths.
+class HardLinkReplacer
+{
+public:
+    HardLinkReplacer()
+    {
+        HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+        if (ntdll)
+        {
+            m_setInformationFile = reinterpret_cast<NtSetInformationFileFn>(
+                GetProcAddress(ntdll, "NtSetInformationFile"));
+            m_statusToDosError = reinterpret_cast<RtlNtStatusToDosErrorFn>(
+                GetProcAddress(ntdll, "RtlNtStatusToDosError"));
+        }
+    }
+
+    ~HardLinkReplacer()
+    {
+        CloseDirectories();
+    }
+
+    HardLinkReplacer(const HardLinkReplacer&) = delete;
+    HardLinkReplacer& operator=(const HardLinkReplacer&) = delete;
+
+    // Opens the master whose links are going to be created.
+    // The returned handle is owned by the caller.
+    static HANDLE OpenMaster(const std::wstring& master)
+    {
+        g_metrics->CountOpen();
+        return CreateFileW(master.c_str(),
+            FILE_WRITE_ATTRIBUTES | SYNCHRONIZE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_OPEN_REPARSE_POINT,
+            nullptr);
+    }
+
+    // Atomically replaces dupFile with a hard link to the file open as hMaster.
+    // Returns false with the last error set on failure.
+    bool Replace(HANDLE hMaster, const std::wstring& dupFile)
+    {
+        if (!m_setInformationFile)
+        {
+            SetLastError(ERROR_NOT_SUPPORTED);
+            return false;
+        }
+
+        const size_t separator = dupFile.find_last_of(L"\\/");
+        if (separator == std::wstring::npos)
+        {
+            SetLastError(ERROR_FILE_NOT_FOUND);
+            return false;
+        }
+        HANDLE hDirectory = GetDirectory(dupFile.substr(0, separator));
+        if (hDirectory == INVALID_HANDLE_VALUE)
+            return false;
+
+        const size_t nameLength = dupFile.size() - separator - 1;
+        std::vector<BYTE> buffer(sizeof(FileLinkInformation) + nameLength * sizeof(WCHAR));
+        auto* linkInfo = reinterpret_cast<FileLinkInformation*>(buffer.data());
+        linkInfo->ReplaceIfExists = TRUE;
+        linkInfo->RootDirectory = hDirectory;
+        linkInfo->FileNameLength = static_cast<ULONG>(nameLength * sizeof(WCHAR));
+        std::memcpy(linkInfo->FileName, dupFile.c_str() + separator + 1, nameLength * sizeof(WCHAR));
+
+        IO_STATUS_BLOCK ioStatus = {};
+        NTSTATUS status = m_setInformationFile(hMaster, &ioStatus, linkInfo,
+            static_cast<ULONG>(buffer.size()), FILE_LINK_INFORMATION_CLASS);
+        if (status < 0)
+        {
+            SetLastError(m_statusToDosError ? m_statusToDosError(status) : ERROR_INVALID_FUNCTION);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    // FILE_LINK_INFORMATION from the DDK.
+    struct FileLinkInformation {
+        BOOLEAN ReplaceIfExists;
+        HANDLE RootDirectory;
+        ULONG FileNameLength;
+        WCHAR FileName[1];
+    };
+    static constexpr FILE_INFORMATION_CLASS FILE_LINK_INFORMATION_CLASS = static_cast<FILE_INFORMATION_CLASS>(11);
+
+    // Upper bound of directory handles kept open.
+    static constexpr size_t MAX_OPEN_DIRECTORIES = 256;
+
+    typedef NTSTATUS(NTAPI* NtSetInformationFileFn)(HANDLE, PIO_STATUS_BLOCK, PVOID, ULONG, FILE_INFORMATION_CLASS);
+    typedef ULONG(NTAPI* RtlNtStatusToDosErrorFn)(NTSTATUS);
+
+    HANDLE GetDirectory(const std::wstring& directory)
+    {
+        auto it = m_directories.find(directory);
+        if (it != m_directories.end())
+            return it->second;
+
+        if (m_directories.size() >= MAX_OPEN_DIRECTORIES)
+            CloseDirectories();
+
+        g_metrics->CountOpen();
+        HANDLE hDirectory = CreateFileW(directory.c_str(),
+            FILE_ADD_FILE | FILE_TRAVERSE | SYNCHRONIZE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS,
+            nullptr);
+        if (hDirectory != INVALID_HANDLE_VALUE)
+            m_directories.emplace(directory, hDirectory);
+        return hDirectory;
+    }
+
+    void CloseDirectories()
+    {
+        for (const auto& entry : m_directories)
+            CloseHandle(entry.second);
+        m_directories.clear();
+    }
+
+    NtSetInformationFileFn m_setInformationFile = nullptr;
+    RtlNtStatusToDosErrorFn m_statusToDosError = nullptr;
+    std::unordered_map<std::wstring, HANDLE> m_directories;
+};
+
+//------------------------------------------------------------------------------
+// DedupContext
+//   Per-worker state DeduplicateGroup() runs with: the file system's dedup session,
+//   the backend, the streams it reports to and the operation counters it updates.
+struct DedupStats {
+    size_t linked = 0;
+    size_t cloned = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+};
+
+struct DedupContext {
+    DedupSession& session;
+    DedupBackend backend;
+    std::wostream& out;
+    std::wostream& err;
+    DedupStats stats;
+};
+
+//------------------------------------------------------------------------------
+// GetHardLinkLimit()
+//   Maximum number of hard links per file on the volume of an open file, or 0
+//   if unknown (ERROR_TOO_MANY_LINKS then tells when it is reached).
+DWORD GetHardLinkLimit(HANDLE hFile)
+{
+    WCHAR fsName[MAX_PATH + 1] = { 0 };
+    if (!GetVolumeInformationByHandleW(hFile, nullptr, 0, nullptr, nullptr, nullptr, fsName, MAX_PATH + 1))
+        return 0;
+    if (_wcsicmp(fsName, L"NTFS") == 0)
+        return 1024;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// Win32DedupSession
+//   Dedup on the real file system: masters are opened with
+//   HardLinkReplacer::OpenMaster(), links made by the session's HardLinkReplacer
+//   and clones by CloneFileExtents().
+class Win32DedupMaster : public DedupMaster
+{
+public:
+    Win32DedupMaster(const std::wstring& path, HANDLE handle) : m_path(path), m_handle(handle) {}
+
+    ~Win32DedupMaster()
+    {
+        CloseHandle(m_handle);
+    }
+
+    Win32DedupMaster(const Win32DedupMaster&) = delete;
+    Win32DedupMaster& operator=(const Win32DedupMaster&) = delete;
+
+    HANDLE Handle() const { return m_handle; }
+
+    bool Query(FileRecord& file) override
+    {
+        return Win32FileSystem::QueryOpenFile(m_handle, file);
+    }
+
+    DWORD LinkLimit() override
+    {
+        return GetHardLinkLimit(m_handle);
+    }
+
+    bool PrepareClone() override
+    {
+        return OpenCloneSource(m_path, m_cloneSource);
+    }
+
+    CloneResult CloneInto(const FileRecord& dupFile) override
+    {
+        return CloneFileExtents(m_cloneSource, dupFile);
+    }
+
+private:
+    std::wstring m_path;
+    HANDLE m_handle;
+    CloneSource m_cloneSource;
+};
+
+class Win32DedupSession : public DedupSession
+{
+public:
+    std::unique_ptr<DedupMaster> OpenMaster(const std::wstring& path) override
+    {
+        HANDLE handle = HardLinkReplacer::OpenMaster(path);
+        if (handle == INVALID_HANDLE_VALUE)
+            return nullptr;
+        return std::make_unique<Win32DedupMaster>(path, handle);
+    }
+
+    bool ReplaceWithLink(DedupMaster& master, const std::wstring& dupPath) override
+    {
+        return m_replacer.Replace(static_cast<Win32DedupMaster&>(master).Handle(), dupPath);
+    }
+
+    bool IsUnchanged(const FileRecord& file) override
+    {
+        return IsUnchangedSinceScan(file);
+    }
+
+private:
+    HardLinkReplacer m_replacer;
+};
+
+std::unique_ptr<DedupSession> Win32FileSystem::OpenDedupSession()
+{
+    return std::make_unique<Win32DedupSession>();
+}
+
+//------------------------------------------------------------------------------
+// GroupMaster
+//   The file currently being linked to while a group is deduplicated, with the
+//   number of links it can still take.
+struct GroupMaster {
+    const FileRecord* file = nullptr;
+    std::unique_ptr<DedupMaster> handle;
+    DWORD linkCapacity = 0;     // Remaining links, or MAXDWORD if the limit is unknown.
+    bool cloneSupported = false;
+};
+
+//------------------------------------------------------------------------------
+// OpenGroupMaster()
+//   Makes file the master: opens it, confirms through the handle that it is still
+//   the file that was scanned and determines how many more links it can take.
+//   Returns false (with the reason logged) if it cannot serve as master.
+bool OpenGroupMaster(const FileRecord& file, DedupContext& context, std::unique_ptr<GroupMaster>& master)
+{
+    master = std::make_unique<GroupMaster>();
+    master->file = &file;
+    master->handle = context.session.OpenMaster(file.path);
+    if (!master->handle)
+    {
+        context.err << L"Failed to open master file: " << file.path
+            << L", error: " << GetLastError() << std::endl;
+        return false;
+    }
+
+    FileRecord current;
+    if (!master->handle->Query(current))
+    {
+        context.err << L"Failed to get file information for: " << file.path
+            << L", error: " << GetLastError() << std::endl;
+        return false;
+    }
+    if (current.fileId != file.fileId || current.size != file.size || current.lastWriteTime != file.lastWriteTime)
+    {
+        context.err << L"Master file changed since scan: " << file.path << std::endl;
+        return false;
+    }
+
+    const DWORD limit = master->handle->LinkLimit();
+    master->linkCapacity = limit == 0 ? MAXDWORD
+        : (current.linkCount < limit ? limit - current.linkCount : 0);
+
+    master->cloneSupported = context.backend == DedupBackend::CloneExtents
+        && master->handle->PrepareClone();
+
+    context.out << L"Master file: " << file.path << std::endl;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// DeduplicateGroup
+//   Given a vector of files that are known duplicates, this routine replaces them with
+//   hard links to a master copy, skipping those that already are.
+//   Files sharing a file id (already hard links of each other) form a class. The master
+//   is taken from the class with the most names, counting those outside the group from
+//   the recorded link count, so the fewest links have to be created, and the other
+//   classes are processed largest first. When the master runs out of links (1024
+//   on NTFS; otherwise detected from ERROR_TOO_MANY_LINKS), the class being processed
+//   becomes the next master, so huge groups are split over several masters without
+//   failing link attempts.
+//   File ids come from the records refreshed before comparison; each duplicate is only
+//   re-validated with a cheap attribute query right before it is replaced. With DedupBackend::CloneExtents the
+//   duplicates keep their own identity and share the master's extents instead, where the
+//   volume supports it; one clone per class covers all of its names. A clone target is
+//   re-validated through the handle it is cloned through and byte-compared with the
+//   master first, as a clone writes into the file itself; one that changed is skipped,
+//   not linked instead.
+//   Hard links are created through the context's replacer, which keeps directory handles
+//   open across groups; messages go to the context's streams.
+//   Returns true if the routine processed the group (errors are logged).
+bool DeduplicateGroup(const std::vector<FileRecord>& duplicateGroup, DedupContext& context)
+{
+    TraceSpan span("dedup", "group");
+    span.Arg("files", static_cast<uint64_t>(duplicateGroup.size()));
+
+    if (duplicateGroup.size() < 2)
+    {
+        context.err << L"No duplicates in group to deduplicate." << std::endl;
+        return true;
+    }
+
+    // Partition the group into classes of files sharing an id, largest first.
+    std::vector<std::vector<const FileRecord*>> classes;
+    {
+        std::map<std::pair<DWORD, ULONGLONG>, size_t> classIndex;
+        for (const auto& file : duplicateGroup)
+        {
+            auto inserted = classIndex.emplace(std::make_pair(file.volumeSerial, file.fileId), classes.size());
+            if (inserted.second)
+                classes.emplace_back();
+            classes[inserted.first->second].push_back(&file);
+        }
+        // Names outside the group count too: a file they keep alive frees nothing
+        // when replaced, so it is better made the master.
+        const auto names = [](const std::vector<const FileRecord*>& fileClass) {
+            return (std::max)(fileClass.size(), static_cast<size_t>(fileClass[0]->linkCount));
+        };
+        std::stable_sort(classes.begin(), classes.end(),
+            [&](const std::vector<const FileRecord*>& a, const std::vector<const FileRecord*>& b) {
+                return names(a) > names(b);
+            });
+    }
+
+    // A master that cannot be opened fails the group; one that changed since the scan skips it.
+    std::unique_ptr<GroupMaster> master;
+    if (!OpenGroupMaster(*classes[0][0], context, master))
+    {
+        if (!master->handle)
+            return false;
+        context.stats.failed += duplicateGroup.size() - 1;
+        return true;
+    }
+
+    for (size_t c = 0; c < classes.size(); ++c)
+    {
+        const std::vector<const FileRecord*>& fileClass = classes[c];
+        if (fileClass[0]->fileId == master->file->fileId && fileClass[0]->volumeSerial == master->file->volumeSerial)
+        {
+            // Already hard links to the master.
+            for (const FileRecord* file : fileClass)
+            {
+                if (file != master->file)
+                {
+                    context.out << L"Skipping file (already linked): " << file->path << std::endl;
+                    ++context.stats.skipped;
+                }
+            }
+            continue;
+        }
+
+        // One clone covers every name of the class.
+        if (master->cloneSupported)
+        {
+            const FileRecord& dupFile = *fileClass[0];
+            TraceSpan cloneSpan("dedup", "clone");
+            cloneSpan.Arg("path", dupFile.path);
+            const CloneResult cloned = master->handle->CloneInto(dupFile);
+            cloneSpan.End();
+            if (cloned == CloneResult::Changed)
+            {
+                context.err << L"Skipping file (changed since scan): " << dupFile.path << std::endl;
+                context.stats.failed += fileClass.size();
+                continue;
+            }
+            if (cloned == CloneResult::Cloned)
+            {
+                for (const FileRecord* file : fileClass)
+                    context.out << L"Cloned extents of " << master->file->path << L" into duplicate " << file->path << std::endl;
+                ++context.stats.cloned;
+                context.stats.skipped += fileClass.size() - 1;
+                continue;
+            }
+            context.err << L"Error cloning extents into: " << dupFile.path
+                << L". Error code: " << GetLastError() << L". Falling back to hard link." << std::endl;
+        }
+
+        for (size_t i = 0; i < fileClass.size(); ++i)
+        {
+            const FileRecord& dupFile = *fileClass[i];
+
+            if (!context.session.IsUnchanged(dupFile))
+            {
+                context.err << L"Skipping file (changed since scan): " << dupFile.path << std::endl;
+                ++context.stats.failed;
+                continue;
+            }
+
+            // Link the duplicate's name to the master; the duplicate survives if this fails.
+            DWORD hlErr = ERROR_TOO_MANY_LINKS;
+            if (master->linkCapacity > 0)
+            {
+                TraceSpan linkSpan("dedup", "link");
+                linkSpan.Arg("path", dupFile.path);
+                const bool linked = context.session.ReplaceWithLink(*master->handle, dupFile.path);
+                linkSpan.End();
+                if (linked)
+                {
+                    context.out << L"Replaced duplicate " << dupFile.path << L" with hard link to " << master->file->path << std::endl;
+                    ++context.stats.linked;
+                    if (master->linkCapacity != MAXDWORD)
+                        --master->linkCapacity;
+                    continue;
+                }
+                hlErr = GetLastError();
+            }
+
+            if (hlErr != ERROR_TOO_MANY_LINKS)
+            {
+                context.err << L"Error creating hard link for: " << dupFile.path
+                    << L" pointing to: " << master->file->path
+                    << L". Error code: " << hlErr << std::endl;
+                ++context.stats.failed;
+                continue;
+            }
+
+            // The master is full: this class takes over. Its remaining files already are links to it.
+            context.out << L"Link limit of " << master->file->path << L" reached." << std::endl;
+            if (!OpenGroupMaster(dupFile, context, master))
+            {
+                context.stats.failed += fileClass.size() - i;
+                for (size_t rest = c + 1; rest < classes.size(); ++rest)
+                    context.stats.failed += classes[rest].size();
+                return true;
+            }
+            context.stats.skipped += fileClass.size() - i - 1;
+            break;
+        }
+    }
+
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// DedupExecutor
+//   Runs DeduplicateGroup() over many groups on a pool of worker threads. A group
+//   is only started while each directory it touches has fewer than
+//   maxPerDirectory groups in flight and its device fewer than maxPerDevice, which
+//   keeps the workers from contending for the same directory locks and from
+//   flooding a single volume. Each worker has its own DedupSession; the output
+//   of a group is buffered and written to the log in one piece when the group is done.
+class DedupExecutor
+{
+public:
+    using GroupDoneCallback = std::function<void(const std::vector<FileRecord>& group, bool succeeded,
+        size_t done, size_t total)>;
+
+    // Progress and per-group messages go to log.
+    DedupExecutor(const DedupOptions& options, std::wostream& log) : m_options(options), m_log(log) {}
+
+    // Returns false if a group failed; groups not started by then are skipped,
+    // as are those not started once *cancel is set. onGroupDone is called after
+    // each group, one call at a time, with the group, whether it succeeded, and
+    // the groups done so far and their total.
+    bool Run(const std::vector<std::vector<FileRecord>>& groups,
+        const std::atomic<bool>* cancel = nullptr,
+        const GroupDoneCallback& onGroupDone = nullptr)
+    {
+        m_cancel = cancel;
+        m_onGroupDone = onGroupDone;
+        m_metrics = g_metrics;
+        m_tuning = g_compareTuning;
+        m_fileSystem = g_fileSystem;
+        m_onError = g_onError;
+        m_total = groups.size();
+        for (const auto& group : groups)
+        {
+            Task task;
+            task.group = &group;
+            for (const auto& file : group)
+            {
+                const size_t separator = file.path.find_last_of(L"\\/");
+                task.directories.push_back(separator == std::wstring::npos ? std::wstring() : file.path.substr(0, separator));
+                task.devices.push_back(GetDeviceKey(file.path));
+            }
+            SortUnique(task.directories);
+            SortUnique(task.devices);
+            m_pending.push_back(std::move(task));
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> workers;
+        const unsigned threads = (std::max)(m_options.threads, 1u);
+        for (unsigned i = 0; i < threads; ++i)
+            workers.emplace_back(&DedupExecutor::Worker, this);
+        for (auto& worker : workers)
+            worker.join();
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const size_t operations = m_stats.linked + m_stats.cloned;
+        m_log << L"\nDeduplication: " << operations << L" operations ("
+            << m_stats.linked << L" linked, " << m_stats.cloned << L" cloned, "
+            << m_stats.skipped << L" already linked, " << m_stats.failed << L" failed) in "
+            << seconds << L" s, " << (seconds > 0 ? operations / seconds : 0.0) << L" ops/s." << std::endl;
+
+        return !m_failed;
+    }
+
+private:
+    struct Task {
+        const std::vector<FileRecord>* group = nullptr;
+        std::vector<std::wstring> directories;
+        std::vector<std::wstring> devices;
+    };
+
+    // How many queued groups a worker looks at for one it may start.
+    static constexpr size_t SCHEDULING_WINDOW = 64;
+
+    // Drive ("C:") or UNC share ("\\server\share") of a path. Volumes mounted in
+    // folders are attributed to their host drive.
+    static std::wstring GetDeviceKey(const std::wstring& path)
+    {
+        std::wstring p = path;
+        if (p.compare(0, 8, L"\\\\?\\UNC\\") == 0)
+            p = L"\\\\" + p.substr(8);
+        else if (p.compare(0, 4, L"\\\\?\\") == 0)
+            p = p.substr(4);
+
+        if (p.compare(0, 2, L"\\\\") == 0)
+        {
+            size_t server = p.find(L'\\', 2);
+            size_t share = server == std::wstring::npos ? server : p.find(L'\\', server + 1);
+            return ToLower(p.substr(0, share));
+        }
+        return ToLower(p.substr(0, 2));
+    }
+
+    static void SortUnique(std::vector<std::wstring>& items)
+    {
+        std::sort(items.begin(), items.end());
+        items.erase(std::unique(items.begin(), items.end()), items.end());
+    }
+
+    bool CanStart(const Task& task) const
+    {
+        for (const auto& directory : task.directories)
+        {
+            auto it = m_activeDirectories.find(directory);
+            if (it != m_activeDirectories.end() && it->second >= m_options.maxPerDirectory)
+                return false;
+        }
+        for (const auto& device : task.devices)
+        {
+            auto it = m_activeDevices.find(device);
+            if (it != m_activeDevices.end() && it->second >= m_options.maxPerDevice)
+                return false;
+        }
+        return true;
+    }
+
+    void Acquire(const Task& task, int delta)
+    {
+        for (const auto& directory : task.directories)
+        {
+            if ((m_activeDirectories[directory] += delta) == 0)
+                m_activeDirectories.erase(directory);
+        }
+        for (const auto& device : task.devices)
+        {
+            if ((m_activeDevices[device] += delta) == 0)
+                m_activeDevices.erase(device);
+        }
+    }
+
+    void Worker()
+    {
+        // Count, read and report as the thread that started the run does.
+        g_metrics = m_metrics;
+        g_compareTuning = m_tuning;
+        g_fileSystem = m_fileSystem;
+        g_onError = m_onError;
+        std::unique_ptr<DedupSession> session = g_fileSystem->OpenDedupSession();
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_failed && !m_pending.empty() && !(m_cancel && *m_cancel))
+        {
+            auto it = m_pending.begin();
+            for (size_t n = 0; it != m_pending.end() && n < SCHEDULING_WINDOW; ++it, ++n)
+            {
+                if (CanStart(*it))
+                    break;
+            }
+            if (it == m_pending.end() || !CanStart(*it))
+            {
+                m_changed.wait(lock);
+                continue;
+            }
+
+            Task task = std::move(*it);
+            m_pending.erase(it);
+            Acquire(task, 1);
+            lock.unlock();
+
+            std::wostringstream out, err;
+            DedupContext context{ *session, m_options.backend, out, err };
+            const bool succeeded = DeduplicateGroup(*task.group, context);
+
+            lock.lock();
+            Acquire(task, -1);
+            m_stats.linked += context.stats.linked;
+            m_stats.cloned += context.stats.cloned;
+            m_stats.skipped += context.stats.skipped;
+            m_stats.failed += context.stats.failed;
+
+            m_log << L"*" << out.str();
+            std::wistringstream errors(err.str());
+            for (std::wstring line; std::getline(errors, line);)
+                ReportError(line);
+            if (!succeeded)
+            {
+                m_failed = true;
+                std::wstring message = L"Failed to deduplicate group:";
+                for (const auto& file : *task.group)
+                    message += L"\n  " + file.path;
+                ReportError(message);
+            }
+            ++m_done;
+            if (m_onGroupDone)
+                m_onGroupDone(*task.group, succeeded, m_done, m_total);
+            m_changed.notify_all();
+        }
+    }
+
+    DedupOptions m_options;
+    std::wostream& m_log;
+    std::list<Task> m_pending;
+    std::unordered_map<std::wstring, unsigned> m_activeDirectories;
+    std::unordered_map<std::wstring, unsigned> m_activeDevices;
+    DedupStats m_stats;
+    bool m_failed = false;
+    const std::atomic<bool>* m_cancel = nullptr;
+    GroupDoneCallback m_onGroupDone;
+    Metrics* m_metrics = nullptr;
+    CompareTuning* m_tuning = nullptr;
+    FileSystem* m_fileSystem = nullptr;
+    std::function<void(const std::wstring& message)> m_onError;
+    size_t m_done = 0;
+    size_t m_total = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
+
+//------------------------------------------------------------------------------
+// CorpusIndex
+//   Persistent index for ingest-time lookups: per size, one representative file
+//   for each distinct content of a corpus, with its sample hashes. Looking a new
+//   file up costs a size query, the sample reads and a comparison against only
+//   the representatives with equal samples, however large the corpus is.
+//   Each representative keeps its identity and last write time, so that one
+//   changed or deleted since it was indexed is noticed. Written by
+//   --build-index, read by --lookup, which with --add-new appends the files it
+//   does not find.
+class CorpusIndex
+{
+public:
+    struct Entry {
+        FileRecord file;
+        uint64_t samples[FINGERPRINT_SAMPLES];
+    };
+
+    // Returns false if the file is missing or malformed.
+    bool Load(const std::wstring& indexPath)
+    {
+        m_bySize.clear();
+        m_count = 0;
+        m_end = 0;
+        std::ifstream in(indexPath, std::ios::binary | std::ios::ate);
+        if (!in)
+            return false;
+        const uint64_t fileBytes = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+
+        uint32_t header[3] = {};
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || header[0] != MAGIC || header[1] != VERSION)
+            return false;
+
+        uint64_t left = fileBytes - sizeof(header);
+        for (uint32_t i = 0; i < header[2]; ++i)
+        {
+            Record record;
+            if (left < sizeof(record))
+                return false;
+            in.read(reinterpret_cast<char*>(&record), sizeof(record));
+            left -= sizeof(record);
+            // A corrupt length must not size the path past the end of the file.
+            if (!in || record.pathLength > left / sizeof(WCHAR))
+                return false;
+
+            Entry entry;
+            entry.file.size = record.size;
+            entry.file.fileId = record.fileId;
+            entry.file.volumeSerial = record.volumeSerial;
+            entry.file.lastWriteTime = record.lastWriteTime;
+            entry.file.attributes = record.attributes;
+            entry.file.path.resize(record.pathLength);
+            in.read(reinterpret_cast<char*>(&entry.file.path[0]), record.pathLength * sizeof(WCHAR));
+            left -= record.pathLength * sizeof(WCHAR);
+            if (!in)
+                return false;
+            std::memcpy(entry.samples, record.samples, sizeof(record.samples));
+            m_bySize[record.size].push_back(std::move(entry));
+        }
+        m_count = header[2];
+        m_end = fileBytes - left;
+        return true;
+    }
+
+    bool Save(const std::wstring& indexPath)
+    {
+        std::ofstream out(indexPath, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+
+        uint32_t header[3] = { MAGIC, VERSION, 0 };
+        for (const auto& bucket : m_bySize)
+            header[2] += static_cast<uint32_t>(bucket.second.size());
+        out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+        for (const auto& bucket : m_bySize)
+        {
+            for (const Entry& entry : bucket.second)
+                WriteEntry(out, entry);
+        }
+        m_count = header[2];
+        m_end = static_cast<uint64_t>(out.tellp());
+        return static_cast<bool>(out);
+    }
+
+    void Add(const FileRecord& file, const Fingerprint& fingerprint)
+    {
+        Entry entry;
+        entry.file.path = file.path;
+        entry.file.size = file.size;
+        entry.file.fileId = file.fileId;
+        entry.file.volumeSerial = file.volumeSerial;
+        entry.file.lastWriteTime = file.lastWriteTime;
+        entry.file.attributes = file.attributes;
+        std::memcpy(entry.samples, fingerprint.samples, sizeof(entry.samples));
+        m_bySize[file.size].push_back(std::move(entry));
+    }
+
+    // Add() that also appends the entry to the index at indexPath, which must
+    // be the one loaded or saved last. The entry goes after the records the
+    // header counts, and the count is updated last, so an append cut short
+    // leaves the index as it was.
+    bool Append(const std::wstring& indexPath, const FileRecord& file, const Fingerprint& fingerprint)
+    {
+        Add(file, fingerprint);
+        std::ofstream out(indexPath, std::ios::binary | std::ios::in | std::ios::out);
+        if (!out || m_end == 0)
+            return false;
+
+        out.seekp(static_cast<std::streamoff>(m_end));
+        WriteEntry(out, m_bySize[file.size].back());
+        out.flush();
+        if (!out)
+            return false;
+        const uint64_t end = static_cast<uint64_t>(out.tellp());
+        const uint32_t count = m_count + 1;
+        out.seekp(2 * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        out.close();
+        if (out.fail())
+            return false;
+        m_count = count;
+        m_end = end;
+        return true;
+    }
+
+    const std::vector<Entry>* Find(ULONGLONG size) const
+    {
+        auto it = m_bySize.find(size);
+        return it == m_bySize.end() ? nullptr : &it->second;
+    }
+
+private:
+    static constexpr uint32_t MAGIC = 0x58464448; // "HDFX"
+    static constexpr uint32_t VERSION = 2;
+
+#pragma pack(push, 1)
+    struct Record {
+        uint64_t size;
+        uint64_t fileId;
+        uint32_t volumeSerial;
+        uint64_t lastWriteTime;
+        uint32_t attributes;
+        uint64_t samples[FINGERPRINT_SAMPLES];
+        uint32_t pathLength;    // UTF-16 code units following the record.
+    };
+#pragma pack(pop)
+
+    static void WriteEntry(std::ofstream& out, const Entry& entry)
+    {
+        Record record = {};
+        record.size = entry.file.size;
+        record.fileId = entry.file.fileId;
+        record.volumeSerial = entry.file.volumeSerial;
+        record.lastWriteTime = entry.file.lastWriteTime;
+        record.attributes = entry.file.attributes;
+        std::memcpy(record.samples, entry.samples, sizeof(record.samples));
+        record.pathLength = static_cast<uint32_t>(entry.file.path.size());
+        out.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        out.write(reinterpret_cast<const char*>(entry.file.path.data()), entry.file.path.size() * sizeof(WCHAR));
+    }
+
+    std::unordered_map<ULONGLONG, std::vector<Entry>> m_bySize;
+    uint32_t m_count = 0;       // Records counted in the header on disk.
+    uint64_t m_end = 0;         // Where they end; 0 if nothing was loaded or saved.
+};
+
+//------------------------------------------------------------------------------
+// RunWriter / RunReader
+//   Sorted run files of the external mode (ScanOptions::scratchFolder). Records
+//   come ordered by decreasing size, then path, and are front-coded with varints:
+//     size decrease, shared path prefix, suffix length, suffix (UTF-16),
+//     file id, volume serial, last write time, attributes
+//   A path sharing its folder with the previous record shrinks to the name,
+//   and a size to a byte or two.
+class RunWriter
+{
+public:
+    explicit RunWriter(const std::wstring& path) : m_out(path, std::ios::binary | std::ios::trunc) {}
+
+    bool Write(const FileRecord& record)
+    {
+        size_t shared = 0;
+        const size_t limit = (std::min)(record.path.size(), m_previousPath.size());
+        while (shared < limit && record.path[shared] == m_previousPath[shared])
+            ++shared;
+
+        PutVarint(m_previousSize - record.size);
+        PutVarint(shared);
+        PutVarint(record.path.size() - shared);
+        m_buffer.append(reinterpret_cast<const char*>(record.path.data() + shared),
+            (record.path.size() - shared) * sizeof(WCHAR));
+        PutVarint(record.fileId);
+        PutVarint(record.volumeSerial);
+        PutVarint(record.lastWriteTime);
+        PutVarint(record.attributes);
+
+        m_previousSize = record.size;
+        m_previousPath = record.path;
+        if (m_buffer.size() >= FLUSH_THRESHOLD)
+            Flush();
+        return static_cast<bool>(m_out);
+    }
+
+    bool Close()
+    {
+        Flush();
+        m_out.close();
+        return !m_out.fail();
+    }
+
+private:
+    static constexpr size_t FLUSH_THRESHOLD = 256 * 1024;
+
+    void PutVarint(uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            m_buffer += static_cast<char>(value | 0x80);
+        m_buffer += static_cast<char>(value);
+    }
+
+    void Flush()
+    {
+        m_out.write(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+    }
+
+    std::ofstream m_out;
+    std::string m_buffer;
+    ULONGLONG m_previousSize = ~0ULL;
+    std::wstring m_previousPath;
+};
+
+class RunReader
+{
+public:
+    static constexpr size_t BUFFER_SIZE = 256 * 1024;
+
+    explicit RunReader(const std::wstring& path) : m_in(path, std::ios::binary), m_buffer(BUFFER_SIZE)
+    {
+        m_failed = !m_in;
+    }
+
+    // False at the end of the run, and on a malformed run, which Failed() tells.
+    bool Read(FileRecord& record)
+    {
+        uint64_t sizeDelta = 0, shared = 0, suffix = 0;
+        if (m_failed || !GetVarint(sizeDelta))
+            return false;
+        uint64_t fileId = 0, volumeSerial = 0, lastWriteTime = 0, attributes = 0;
+        m_failed = !GetVarint(shared) || !GetVarint(suffix) || shared > m_path.size();
+        if (!m_failed)
+        {
+            m_path.resize(static_cast<size_t>(shared + suffix));
+            m_failed = !GetBytes(&m_path[static_cast<size_t>(shared)], static_cast<size_t>(suffix) * sizeof(WCHAR))
+                || !GetVarint(fileId) || !GetVarint(volumeSerial) || !GetVarint(lastWriteTime) || !GetVarint(attributes);
+        }
+        if (m_failed)
+            return false;
+
+        m_size -= sizeDelta;
+        record.path = m_path;
+        record.size = m_size;
+        record.fileId = fileId;
+        record.volumeSerial = static_cast<DWORD>(volumeSerial);
+        record.lastWriteTime = lastWriteTime;
+        record.attributes = static_cast<DWORD>(attributes);
+        return true;
+    }
+
+    bool Failed() const { return m_failed; }
+
+private:
+    bool Fill()
+    {
+        m_in.read(m_buffer.data(), m_buffer.size());
+        m_begin = 0;
+        m_end = static_cast<size_t>(m_in.gcount());
+        return m_end > 0;
+    }
+
+    // A run ending inside a varint is malformed; one ending before it is done.
+    bool GetVarint(uint64_t& value)
+    {
+        value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            if (m_begin == m_end && !Fill())
+            {
+                m_failed |= shift > 0;
+                return false;
+            }
+            const unsigned char byte = static_cast<unsigned char>(m_buffer[m_begin++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        m_failed = true;
+        return false;
+    }
+
+    bool GetBytes(void* dest, size_t bytes)
+    {
+        char* out = static_cast<char*>(dest);
+        while (bytes > 0)
+        {
+            if (m_begin == m_end && !Fill())
+                return false;
+            const size_t chunk = (std::min)(bytes, m_end - m_begin);
+            std::memcpy(out, m_buffer.data() + m_begin, chunk);
+            m_begin += chunk;
+            out += chunk;
+            bytes -= chunk;
+        }
+        return true;
+    }
+
+    std::ifstream m_in;
+    std::vector<char> m_buffer;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+    bool m_failed = false;
+    ULONGLONG m_size = ~0ULL;
+    std::wstring m_path;
+};
+
+//------------------------------------------------------------------------------
+// ExternalSizeSorter
+//   Collects FileRecords in a buffer bounded by a memory budget, spilling it as
+//   a sorted run whenever it is full, then merges the runs and hands out one
+//   size group at a time. Memory stays within the budget plus the largest size
+//   group, however many files are added: merging more runs than the budget has
+//   read buffers for first merges them into fewer, longer ones.
+//   A checkpointed scan keeps its runs when it stops short, and adopts them when
+//   it resumes; it spills only between directories, with Buffer() and Spill().
+class ExternalSizeSorter
+{
+public:
+    ExternalSizeSorter(const std::wstring& scratchFolder, size_t memoryBudget)
+        : m_scratchFolder(scratchFolder), m_memoryBudget(memoryBudget) {}
+
+    ~ExternalSizeSorter()
+    {
+        if (m_keepRuns)
+            return;
+        for (const auto& run : m_runs)
+            DeleteFileW(run.c_str());
+    }
+
+    // Returns false if a run could not be written.
+    bool Add(FileRecord&& record)
+    {
+        Buffer(std::move(record));
+        return !Full() || Spill();
+    }
+
+    void Buffer(FileRecord&& record)
+    {
+        m_bufferBytes += sizeof(FileRecord) + (record.path.capacity() + 1) * sizeof(WCHAR);
+        m_buffer.push_back(std::move(record));
+    }
+
+    bool Full() const { return m_bufferBytes >= m_memoryBudget; }
+
+    // Writes the buffered records as a sorted run. Returns false if it could
+    // not be written.
+    bool Spill()
+    {
+        if (m_buffer.empty())
+            return true;
+
+        std::sort(m_buffer.begin(), m_buffer.end(), Less);
+        const std::wstring path = NextRunPath();
+        m_runs.push_back(path);
+        RunWriter writer(path);
+        bool written = true;
+        for (const auto& record : m_buffer)
+            written = written && writer.Write(record);
+        written = writer.Close() && written;
+
+        m_buffer.clear();
+        m_bufferBytes = 0;
+        if (!written)
+            ReportError(L"Failed to write run file: " + path);
+        return written;
+    }
+
+    // Takes over the runs of an earlier sorter, written with the same order.
+    void Adopt(const std::vector<std::wstring>& runs)
+    {
+        m_runs.insert(m_runs.end(), runs.begin(), runs.end());
+    }
+
+    const std::vector<std::wstring>& Runs() const { return m_runs; }
+
+    // Whether the run files outlive the sorter.
+    void KeepRuns(bool keep) { m_keepRuns = keep; }
+
+    // Calls onGroup for every size shared by two or more files, largest size
+    // first, until it returns false. Returns false if it did, or if a run
+    // could not be written or read. Runs merged into fewer are reported to
+    // onRunsChanged, if given, before they are deleted.
+    bool ForEachSizeGroup(const std::function<bool(ULONGLONG size, const std::vector<FileRecord>& files)>& onGroup,
+        const std::function<void(const std::vector<std::wstring>& runs)>& onRunsChanged = nullptr)
+    {
+        if (!Spill())
+            return false;
+
+        const size_t fanIn = (std::max)(size_t(2), m_memoryBudget / (2 * RunReader::BUFFER_SIZE));
+        while (m_runs.size() > fanIn)
+        {
+            std::vector<std::wstring> inputs(m_runs.begin(), m_runs.begin() + fanIn);
+            m_runs.erase(m_runs.begin(), m_runs.begin() + fanIn);
+            const std::wstring output = NextRunPath();
+            m_runs.push_back(output);
+
+            RunWriter writer(output);
+            const bool merged = Merge(inputs, [&](const FileRecord& record) { return writer.Write(record); })
+                && writer.Close();
+            if (!merged)
+            {
+                // The inputs stay the runs, for a checkpointed scan to resume.
+                m_runs.pop_back();
+                DeleteFileW(output.c_str());
+                m_runs.insert(m_runs.begin(), inputs.begin(), inputs.end());
+                return false;
+            }
+            if (onRunsChanged)
+                onRunsChanged(m_runs);
+            for (const auto& input : inputs)
+                DeleteFileW(input.c_str());
+        }
+
+        std::vector<FileRecord> group;
+        auto emit = [&]() { return group.size() < 2 || onGroup(group.front().size, group); };
+        const bool merged = Merge(m_runs, [&](const FileRecord& record) {
+            if (!group.empty() && record.size != group.front().size)
+            {
+                if (!emit())
+                    return false;
+                group.clear();
+            }
+            group.push_back(record);
+            return true;
+        });
+        return merged && emit();
+    }
+
+private:
+    // Adopted runs may come from an earlier process of the same id.
+    std::wstring NextRunPath()
+    {
+        std::wstring path;
+        do
+        {
+            path = m_scratchFolder + L"\\hdf-run-" + std::to_wstring(GetCurrentProcessId())
+                + L"-" + std::to_wstring(m_nextRun++) + L".tmp";
+        } while (std::find(m_runs.begin(), m_runs.end(), path) != m_runs.end());
+        return path;
+    }
+
+    // Larger sizes first: they tend to free the most, which matters when a
+    // compare budget stops the scan part way.
+    static bool Less(const FileRecord& a, const FileRecord& b)
+    {
+        return a.size != b.size ? a.size > b.size : a.path < b.path;
+    }
+
+    // K-way merge of sorted runs through a heap of their current records.
+    static bool Merge(const std::vector<std::wstring>& runs, const std::function<bool(const FileRecord&)>& emit)
+    {
+        std::vector<std::unique_ptr<RunReader>> readers;
+        std::vector<FileRecord> heads(runs.size());
+        std::vector<size_t> heap;
+        auto greater = [&](size_t a, size_t b) { return Less(heads[b], heads[a]); };
+        for (size_t i = 0; i < runs.size(); ++i)
+        {
+            readers.push_back(std::make_unique<RunReader>(runs[i]));
+            if (readers[i]->Read(heads[i]))
+                heap.push_back(i);
+        }
+        std::make_heap(heap.begin(), heap.end(), greater);
+
+        while (!heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const size_t i = heap.back();
+            if (!emit(heads[i]))
+                return false;
+            if (readers[i]->Read(heads[i]))
+                std::push_heap(heap.begin(), heap.end(), greater);
+            else
+                heap.pop_back();
+        }
+
+        for (size_t i = 0; i < readers.size(); ++i)
+        {
+            if (readers[i]->Failed())
+            {
+                ReportError(L"Failed to read run file: " + runs[i]);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::wstring m_scratchFolder;
+    size_t m_memoryBudget;
+    std::vector<FileRecord> m_buffer;
+    size_t m_bufferBytes = 0;
+    std::vector<std::wstring> m_runs;
+    unsigned m_nextRun = 0;
+    bool m_keepRuns = false;
+};
+
+//------------------------------------------------------------------------------
+// ScanJournal
+//   Checkpoint of a long scan (ScanOptions::checkpointPath), kept as an
+//   append-only log, so that an interrupted scan resumes where it stopped:
+//     Header       - what is scanned; a log of another scan is not resumed;
+//     Directory    - a directory listing, replayed instead of listing it again;
+//     Runs         - in external mode instead of listings: the sorted run files
+//                    written so far and the directories left to list then;
+//     SizeGroup    - a size whose files were compared, with its duplicate groups;
+//     Deduplicated - a group that was deduplicated, by size and master path;
+//     Completed    - the scan finished and its groups were deduplicated or
+//                    written (DuplicateScanner::Finish()): the log is started
+//                    over when opened again, rather than replaying listings
+//                    gone stale.
+//   Each record is framed by its type and payload length and followed by an
+//   FNV-1a sum of the payload. Loading stops at the first torn or corrupt
+//   record and the log is cut there before anything is appended, so it always
+//   ends at a consistent point. Appends are flushed to disk every few seconds,
+//   Runs records at once, since run files are deleted on the strength of them.
+class ScanJournal
+{
+public:
+    ~ScanJournal()
+    {
+        if (m_handle != INVALID_HANDLE_VALUE)
+        {
+            FlushFileBuffers(m_handle);
+            CloseHandle(m_handle);
+        }
+    }
+
+    // Loads the log at path and opens it for appending, or starts a new one.
+    // Returns false if it cannot be opened or belongs to another scan.
+    bool Open(const std::wstring& path, const std::wstring& signature)
+    {
+        bool sameScan = true;
+        const uint64_t consistentBytes = Load(path, signature, sameScan);
+        if (!sameScan)
+        {
+            ReportError(L"Checkpoint " + path + L" belongs to another scan.");
+            return false;
+        }
+
+        m_handle = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_handle == INVALID_HANDLE_VALUE)
+        {
+            ReportError(L"Failed to open checkpoint: " + path);
+            return false;
+        }
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(consistentBytes);
+        SetFilePointerEx(m_handle, end, nullptr, FILE_BEGIN);
+        SetEndOfFile(m_handle);
+        m_lastFlush = std::chrono::steady_clock::now();
+
+        if (consistentBytes == 0)
+        {
+            std::string payload;
+            PutString(payload, signature);
+            Append(RecordType::Header, payload);
+        }
+        return true;
+    }
+
+    // Hands out a listing recorded earlier; each is replayed once.
+    bool TakeDirectory(const std::wstring& directory, DWORD& volumeSerial, std::vector<DirectoryEntry>& entries)
+    {
+        auto it = m_directories.find(directory);
+        if (it == m_directories.end())
+            return false;
+        volumeSerial = it->second.volumeSerial;
+        entries = std::move(it->second.entries);
+        m_directories.erase(it);
+        return true;
+    }
+
+    void AppendDirectory(const std::wstring& directory, DWORD volumeSerial, const std::vector<DirectoryEntry>& entries)
+    {
+        std::string payload;
+        PutString(payload, directory);
+        Put(payload, volumeSerial);
+        Put(payload, entries.size());
+        for (const auto& entry : entries)
+        {
+            PutString(payload, entry.name);
+            Put(payload, entry.fileId);
+            Put(payload, entry.size);
+            Put(payload, entry.lastWriteTime);
+            Put(payload, entry.attributes);
+        }
+        Append(RecordType::Directory, payload);
+    }
+
+    // The duplicate groups of a size decided earlier, or nullptr.
+    const std::vector<std::vector<FileRecord>>* FindSizeGroup(ULONGLONG size) const
+    {
+        auto it = m_sizeGroups.find(size);
+        return it == m_sizeGroups.end() ? nullptr : &it->second;
+    }
+
+    void AppendSizeGroup(ULONGLONG size, const std::vector<std::vector<FileRecord>>& groups)
+    {
+        std::string payload;
+        Put(payload, size);
+        Put(payload, groups.size());
+        for (const auto& group : groups)
+        {
+            Put(payload, group.size());
+            for (const auto& file : group)
+                PutFile(payload, file);
+        }
+        Append(RecordType::SizeGroup, payload);
+    }
+
+    // The run files and pending directories of the last Runs record, if any.
+    bool FindRuns(std::vector<std::wstring>& runs, std::vector<std::wstring>& pending) const
+    {
+        runs = m_runs;
+        pending = m_pending;
+        return m_hasRuns;
+    }
+
+    void AppendRuns(const std::vector<std::wstring>& runs, const std::vector<std::wstring>& pending)
+    {
+        std::string payload;
+        Put(payload, runs.size());
+        for (const auto& run : runs)
+            PutString(payload, run);
+        Put(payload, pending.size());
+        for (const auto& directory : pending)
+            PutString(payload, directory);
+        Append(RecordType::Runs, payload);
+        Sync();
+    }
+
+    void AppendCompleted()
+    {
+        Append(RecordType::Completed, std::string());
+        Sync();
+    }
+
+    bool IsDeduplicated(const std::vector<FileRecord>& group) const
+    {
+        return !group.empty() && m_deduplicated.count({ group.front().size, group.front().path }) != 0;
+    }
+
+    void AppendDeduplicated(const std::vector<FileRecord>& group)
+    {
+        std::string payload;
+        Put(payload, group.front().size);
+        PutString(payload, group.front().path);
+        Append(RecordType::Deduplicated, payload);
+    }
+
+private:
+    enum class RecordType : uint32_t {
+        Header = 1,
+        Directory,
+        SizeGroup,
+        Deduplicated,
+        Runs,
+        Completed
+    };
+
+    struct Listing {
+        DWORD volumeSerial = 0;
+        std::vector<DirectoryEntry> entries;
+    };
+
+    static constexpr auto FLUSH_INTERVAL = std::chrono::seconds(5);
+    static constexpr uint32_t MAX_RECORD_SIZE = 1u << 30;
+
+    static uint32_t Checksum(const std::string& payload)
+    {
+        uint32_t hash = 2166136261u;
+        for (char ch : payload)
+            hash = (hash ^ static_cast<unsigned char>(ch)) * 16777619u;
+        return hash;
+    }
+
+    static void Put(std::string& out, uint64_t value)
+    {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void PutString(std::string& out, const std::wstring& text)
+    {
+        Put(out, text.size());
+        out.append(reinterpret_cast<const char*>(text.data()), text.size() * sizeof(WCHAR));
+    }
+
+    static void PutFile(std::string& out, const FileRecord& file)
+    {
+        PutString(out, file.path);
+        Put(out, file.fileId);
+        Put(out, file.volumeSerial);
+        Put(out, file.size);
+        Put(out, file.lastWriteTime);
+        Put(out, file.attributes);
+    }
+
+    // Reads a payload back; every Get fails once the payload is exhausted.
+    struct Cursor {
+        const std::string& payload;
+        size_t pos = 0;
+
+        bool Get(uint64_t& value)
+        {
+            if (payload.size() - pos < sizeof(value))
+                return false;
+            std::memcpy(&value, payload.data() + pos, sizeof(value));
+            pos += sizeof(value);
+            return true;
+        }
+
+        template <typename T>
+        bool GetAs(T& value)
+        {
+            uint64_t raw = 0;
+            if (!Get(raw))
+                return false;
+            value = static_cast<T>(raw);
+            return true;
+        }
+
+        bool GetString(std::wstring& text)
+        {
+            uint64_t length = 0;
+            if (!Get(length) || (payload.size() - pos) / sizeof(WCHAR) < length)
+                return false;
+            text.assign(reinterpret_cast<const WCHAR*>(payload.data() + pos), static_cast<size_t>(length));
+            pos += static_cast<size_t>(length) * sizeof(WCHAR);
+            return true;
+        }
+
+        bool GetFile(FileRecord& file)
+        {
+            return GetString(file.path) && GetAs(file.fileId) && GetAs(file.volumeSerial) && GetAs(file.size)
+                && GetAs(file.lastWriteTime) && GetAs(file.attributes);
+        }
+    };
+
+    // Returns the length of the consistent prefix of the log.
+    uint64_t Load(const std::wstring& path, const std::wstring& signature, bool& sameScan)
+    {
+        std::ifstream in(path, std::ios::binary);
+        uint64_t consistentBytes = 0;
+        std::string payload;
+        for (bool first = true; in; first = false)
+        {
+            uint32_t frame[2] = {};
+            uint32_t checksum = 0;
+            in.read(reinterpret_cast<char*>(frame), sizeof(frame));
+            if (!in || frame[1] > MAX_RECORD_SIZE)
+                break;
+            payload.resize(frame[1]);
+            in.read(&payload[0], frame[1]);
+            in.read(reinterpret_cast<char*>(&checksum), sizeof(checksum));
+            if (!in || checksum != Checksum(payload))
+                break;
+
+            Cursor cursor{ payload };
+            const RecordType type = static_cast<RecordType>(frame[0]);
+            if (!first && type == RecordType::Completed)
+            {
+                m_directories.clear();
+                m_sizeGroups.clear();
+                m_deduplicated.clear();
+                m_runs.clear();
+                m_pending.clear();
+                m_hasRuns = false;
+                return 0;
+            }
+            if (first)
+            {
+                std::wstring recorded;
+                sameScan = type == RecordType::Header && cursor.GetString(recorded) && recorded == signature;
+                if (!sameScan)
+                    return 0;
+            }
+            else if (!Replay(type, cursor))
+            {
+                break;
+            }
+            consistentBytes += sizeof(frame) + frame[1] + sizeof(checksum);
+        }
+        return consistentBytes;
+    }
+
+    bool Replay(RecordType type, Cursor& cursor)
+    {
+        if (type == RecordType::Directory)
+        {
+            std::wstring directory;
+            Listing listing;
+            uint64_t count = 0;
+            if (!cursor.GetString(directory) || !cursor.GetAs(listing.volumeSerial) || !cursor.Get(count))
+                return false;
+            for (uint64_t i = 0; i < count; ++i)
+            {
+                DirectoryEntry entry;
+                if (!cursor.GetString(entry.name) || !cursor.GetAs(entry.fileId) || !cursor.GetAs(entry.size)
+                    || !cursor.GetAs(entry.lastWriteTime) || !cursor.GetAs(entry.attributes))
+                    return false;
+                listing.entries.push_back(std::move(entry));
+            }
+            m_directories[directory] = std::move(listing);
+            return true;
+        }
+        if (type == RecordType::SizeGroup)
+        {
+            ULONGLONG size = 0;
+            uint64_t groupCount = 0;
+            if (!cursor.GetAs(size) || !cursor.Get(groupCount))
+                return false;
+            std::vector<std::vector<FileRecord>> groups(static_cast<size_t>(groupCount));
+            for (auto& group : groups)
+            {
+                uint64_t fileCount = 0;
+                if (!cursor.Get(fileCount))
+                    return false;
+                group.resize(static_cast<size_t>(fileCount));
+                for (auto& file : group)
+                {
+                    if (!cursor.GetFile(file))
+                        return false;
+                }
+            }
+            m_sizeGroups[size] = std::move(groups);
+            return true;
+        }
+        if (type == RecordType::Runs)
+        {
+            std::vector<std::wstring> lists[2];
+            for (auto& list : lists)
+            {
+                uint64_t count = 0;
+                if (!cursor.Get(count))
+                    return false;
+                for (uint64_t i = 0; i < count; ++i)
+                {
+                    std::wstring text;
+                    if (!cursor.GetString(text))
+                        return false;
+                    list.push_back(std::move(text));
+                }
+            }
+            m_runs = std::move(lists[0]);
+            m_pending = std::move(lists[1]);
+            m_hasRuns = true;
+            return true;
+        }
+        if (type == RecordType::Deduplicated)
+        {
+            ULONGLONG size = 0;
+            std::wstring master;
+            if (!cursor.GetAs(size) || !cursor.GetString(master))
+                return false;
+            m_deduplicated.insert({ size, master });
+            return true;
+        }
+        return false;
+    }
+
+    void Append(RecordType type, const std::string& payload)
+    {
+        std::string record;
+        const uint32_t frame[2] = { static_cast<uint32_t>(type), static_cast<uint32_t>(payload.size()) };
+        const uint32_t checksum = Checksum(payload);
+        record.append(reinterpret_cast<const char*>(frame), sizeof(frame));
+        record += payload;
+        record.append(reinterpret_cast<const char*>(&checksum), sizeof(checksum));
+
+        DWORD written = 0;
+        if (!WriteFile(m_handle, record.data(), static_cast<DWORD>(record.size()), &written, nullptr)
+            || written != record.size())
+        {
+            if (!m_writeFailed)
+                ReportError(L"Failed to write checkpoint (error " + std::to_wstring(GetLastError()) + L").");
+            m_writeFailed = true;
+        }
+
+        if (std::chrono::steady_clock::now() - m_lastFlush >= FLUSH_INTERVAL)
+            Sync();
+    }
+
+    void Sync()
+    {
+        FlushFileBuffers(m_handle);
+        m_lastFlush = std::chrono::steady_clock::now();
+    }
+
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+    bool m_writeFailed = false;
+    std::chrono::steady_clock::time_point m_lastFlush;
+    std::unordered_map<std::wstring, Listing> m_directories;
+    std::unordered_map<ULONGLONG, std::vector<std::vector<FileRecord>>> m_sizeGroups;
+    std::set<std::pair<ULONGLONG, std::wstring>> m_deduplicated;
+    std::vector<std::wstring> m_runs;
+    std::vector<std::wstring> m_pending;
+    bool m_hasRuns = false;
+};
+
+//------------------------------------------------------------------------------
+// JournaledFileSystem
+//   Lists directories from a ScanJournal where it has them, and records every
+//   other listing in it; files are read from the wrapped file system.
+class JournaledFileSystem : public FileSystem
+{
+public:
+    JournaledFileSystem(FileSystem& inner, ScanJournal& journal) : m_inner(inner), m_journal(journal) {}
+
+    bool ListDirectory(const std::wstring& directory, DWORD& volumeSerial,
+        std::vector<DirectoryEntry>& entries) override
+    {
+        if (m_journal.TakeDirectory(directory, volumeSerial, entries))
+            return true;
+        if (!m_inner.ListDirectory(directory, volumeSerial, entries))
+            return false;
+        m_journal.AppendDirectory(directory, volumeSerial, entries);
+        return true;
+    }
+
+    std::unique_ptr<FileReader> OpenForRead(const std::wstring& path) override
+    {
+        return m_inner.OpenForRead(path);
+    }
+
+    bool QueryDataMap(const std::wstring& path, DataMap& dataMap, LONGLONG& fileSize) override
+    {
+        return m_inner.QueryDataMap(path, dataMap, fileSize);
+    }
+
+    bool QueryFileState(const std::wstring& path, FileRecord& file) override
+    {
+        return m_inner.QueryFileState(path, file);
+    }
+
+    std::unique_ptr<DedupSession> OpenDedupSession() override
+    {
+        return m_inner.OpenDedupSession();
+    }
+
+    bool ReadWhole(const std::wstring& path, char* buffer, ULONGLONG size) override
+    {
+        return m_inner.ReadWhole(path, buffer, size);
+    }
+
+    std::wstring NormalizeRoot(const std::wstring& root) override
+    {
+        return m_inner.NormalizeRoot(root);
+    }
+
+private:
+    FileSystem& m_inner;
+    ScanJournal& m_journal;
+};
+
+//------------------------------------------------------------------------------
+// CompareSizeGroup()
+//   Groups the files of one size by content, through the fingerprint cache if
+//   there is one, and delivers the duplicate groups to callbacks.onGroup. With
+//   a journal, a size decided before is replayed from it without reading any
+//   file, and a newly decided one is recorded.
+//   Each file's record is first refreshed from the file itself
+//   (FileSystem::QueryFileState()), so that the records delivered, which dedup
+//   re-validates against, predate the reads and agree across hard links; a file
+//   whose size changed since it was listed is left for the next scan.
+void CompareSizeGroup(ULONGLONG size, const std::vector<FileRecord>& listed, FingerprintCache* cache,
+    bool trustCache, ScanJournal* journal, const ScanCallbacks& callbacks, ScanSummary& summary)
+{
+    std::vector<std::vector<FileRecord>> duplicateGroups;
+    const std::vector<std::vector<FileRecord>>* decided = journal ? journal->FindSizeGroup(size) : nullptr;
+    if (!decided)
+    {
+        TraceSpan span("compare", "size group");
+        span.Arg("size", size);
+        span.Arg("files", static_cast<uint64_t>(listed.size()));
+
+        std::vector<FileRecord> files;
+        files.reserve(listed.size());
+        for (const FileRecord& file : listed)
+        {
+            FileRecord current = file;
+            if (g_fileSystem->QueryFileState(file.path, current) && current.size == size)
+                files.push_back(std::move(current));
+        }
+
+        if (cache)
+            GroupFilesUsingFingerprintCache(files, size, *cache, trustCache, duplicateGroups);
+        else if (size <= g_compareTuning->smallFileLimit)
+            GroupSmallFiles(files, duplicateGroups);
+        else
+            GroupFilesByContentUsingMap(files, duplicateGroups, 0);
+
+        duplicateGroups.erase(std::remove_if(duplicateGroups.begin(), duplicateGroups.end(),
+            [](const std::vector<FileRecord>& group) { return group.size() < 2; }), duplicateGroups.end());
+        if (journal)
+            journal->AppendSizeGroup(size, duplicateGroups);
+        decided = &duplicateGroups;
+    }
+
+    for (const auto& group : *decided)
+    {
+        ++summary.groups;
+        summary.gain += size * (group.size() - 1);
+        if (callbacks.onGroup)
+            callbacks.onGroup(size, group);
+    }
+}
+
+//------------------------------------------------------------------------------
+// PotentialGain()
+//   What a size group frees if all its files turn out to be duplicates.
+ULONGLONG PotentialGain(ULONGLONG size, size_t files)
+{
+    return files < 2 ? 0 : size * (files - 1);
+}
+
+//------------------------------------------------------------------------------
+// CompareBudget
+//   The time and read limits of one compare stage (ScanOptions::timeBudgetSeconds
+//   and readBudget), measured from construction.
+class CompareBudget
+{
+public:
+    explicit CompareBudget(const ScanOptions& options)
+        : m_start(std::chrono::steady_clock::now()),
+          m_timeBudget(std::chrono::seconds(options.timeBudgetSeconds)),
+          m_readBudget(options.readBudget),
+          m_bytesBefore(BytesRead())
+    {
+    }
+
+    bool Spent() const
+    {
+        if (m_timeBudget.count() != 0 && std::chrono::steady_clock::now() - m_start >= m_timeBudget)
+            return true;
+        return m_readBudget != 0 && BytesRead() - m_bytesBefore >= m_readBudget;
+    }
+
+private:
+    static uint64_t BytesRead()
+    {
+        return g_metrics->phases[static_cast<size_t>(Phase::Compare)].bytesRead.load();
+    }
+
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::seconds m_timeBudget;
+    ULONGLONG m_readBudget;
+    uint64_t m_bytesBefore;
+};
+
+//------------------------------------------------------------------------------
+// ScanSignature()
+//   What a checkpoint records as its scan: the root folder and the filters.
+std::wstring ScanSignature(const ScanOptions& options)
+{
+    std::wostringstream signature;
+    signature << options.rootFolder << L'|' << options.extensionFilter
+        << L'|' << options.minSize << L'|' << options.maxSize;
+    for (const auto& glob : options.includeGlobs)
+        signature << L"|+" << glob;
+    for (const auto& glob : options.excludeGlobs)
+        signature << L"|-" << glob;
+    for (const auto& glob : options.excludeDirectories)
+        signature << L"|/" << glob;
+    return signature.str();
+}
+
+//------------------------------------------------------------------------------
+// DuplicateScanner
+//   See HandleDuplicateFiles.h. Each stage records its metrics phase; the
+//   fingerprint cache is saved after every Group() that changed it.
+struct DuplicateScanner::State {
+    std::atomic<bool> cancel{ false };
+    Metrics metrics;            // Totals over the calls made so far.
+    unsigned depth = 0;         // Calls in progress; Scan() makes nested ones.
+    std::wstring cachePath;
+    std::unique_ptr<FingerprintCache> cache;
+    std::wstring corpusPath;
+    std::unique_ptr<CorpusIndex> corpus;
+    std::wstring journalPath;
+    std::unique_ptr<ScanJournal> journal;
+    bool scanned = false;                   // The journaled scan went through.
+    std::vector<std::wstring> scannedRuns;  // Its run files, kept for Finish().
+
+    // Opens the checkpoint named in options, if any, unless it is open already.
+    // Returns false if it cannot be resumed.
+    bool UseJournal(const ScanOptions& options)
+    {
+        if (options.checkpointPath == journalPath)
+            return true;
+        journal.reset();
+        journalPath.clear();
+        if (options.checkpointPath.empty())
+            return true;
+
+        journal = std::make_unique<ScanJournal>();
+        if (!journal->Open(options.checkpointPath, ScanSignature(options)))
+        {
+            journal.reset();
+            return false;
+        }
+        journalPath = options.checkpointPath;
+        return true;
+    }
+
+    // Enumerates through the checkpoint, if there is one: listings it holds are
+    // replayed, the others recorded.
+    void Enumerate(const ScanOptions& options, EnumerationHooks& hooks,
+        std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups)
+    {
+        FileSystem* const fileSystem = g_fileSystem;
+        std::unique_ptr<JournaledFileSystem> journaled;
+        if (journal)
+        {
+            journaled = std::make_unique<JournaledFileSystem>(*fileSystem, *journal);
+            g_fileSystem = journaled.get();
+        }
+        const std::wstring root = fileSystem->NormalizeRoot(options.rootFolder);
+        EnumerateFilesAndGroupBySize(root, sizeGroups, PathFilter(options), &hooks);
+        g_fileSystem = fileSystem;
+    }
+
+    // Loads the corpus index at path unless it is loaded already; null if it
+    // cannot be read.
+    CorpusIndex* UseCorpus(const std::wstring& path)
+    {
+        if (path != corpusPath || !corpus)
+        {
+            corpusPath = path;
+            corpus = std::make_unique<CorpusIndex>();
+            if (!corpus->Load(path))
+                corpus.reset();
+        }
+        return corpus.get();
+    }
+
+    // A warm cache is kept as long as its path stays the same.
+    FingerprintCache* UseCache(const std::wstring& path)
+    {
+        if (path != cachePath)
+        {
+            cache.reset();
+            cachePath = path;
+            if (!path.empty())
+            {
+                cache = std::make_unique<FingerprintCache>(path);
+                cache->Load();
+            }
+        }
+        return cache.get();
+    }
+
+    // Set up for the duration of every public call. The outermost one clears
+    // the cancel flag and puts in, for this thread, metrics and a tuning of the
+    // call's own and callbacks.onError; when it returns, its metrics are added
+    // to the scanner's and to those in place before, which are restored.
+    class Call
+    {
+    public:
+        Call(State& state, const ScanCallbacks& callbacks)
+            : m_state(state), m_outermost(state.depth++ == 0)
+        {
+            if (!m_outermost)
+                return;
+            state.cancel = false;
+            m_tuning = *g_compareTuning;
+            m_outerMetrics = g_metrics;
+            m_outerTuning = g_compareTuning;
+            m_outerOnError = g_onError;
+            g_metrics = &m_metrics;
+            g_compareTuning = &m_tuning;
+            g_onError = callbacks.onError;
+        }
+
+        ~Call()
+        {
+            --m_state.depth;
+            if (!m_outermost)
+                return;
+            g_metrics = m_outerMetrics;
+            g_compareTuning = m_outerTuning;
+            g_onError = m_outerOnError;
+            m_state.metrics.Add(m_metrics);
+            g_metrics->Add(m_metrics);
+        }
+
+        Call(const Call&) = delete;
+        Call& operator=(const Call&) = delete;
+
+    private:
+        State& m_state;
+        const bool m_outermost;
+        Metrics m_metrics;
+        CompareTuning m_tuning;
+        Metrics* m_outerMetrics = nullptr;
+        CompareTuning* m_outerTuning = nullptr;
+        std::function<void(const std::wstring& message)> m_outerOnError;
+    };
+
+    EnumerationHooks MakeHooks(const ScanCallbacks& callbacks)
+    {
+        EnumerationHooks hooks;
+        hooks.cancel = &cancel;
+        if (callbacks.onProgress)
+        {
+            hooks.onDirectory = [&callbacks](uint64_t filesConsidered) {
+                callbacks.onProgress(ScanProgress{ ScanStage::Enumerate, filesConsidered, 0 });
+            };
+        }
+        return hooks;
+    }
+};
+
+DuplicateScanner::DuplicateScanner() : m_state(std::make_unique<State>()) {}
+
+DuplicateScanner::~DuplicateScanner() = default;
+
+bool DuplicateScanner::Enumerate(const ScanOptions& options, const ScanCallbacks& callbacks,
+    std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups)
+{
+    State::Call call(*m_state, callbacks);
+    if (!m_state->UseJournal(options))
+        return false;
+    PhaseScope scope(Phase::Enumerate);
+
+    EnumerationHooks hooks = m_state->MakeHooks(callbacks);
+    m_state->Enumerate(options, hooks, sizeGroups);
+    return !m_state->cancel;
+}
+
+bool DuplicateScanner::Group(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    const ScanOptions& options, const ScanCallbacks& callbacks, ScanSummary& summary)
+{
+    State::Call call(*m_state, callbacks);
+    if (!m_state->UseJournal(options))
+        return false;
+    *g_compareTuning = options.tuning;
+    FingerprintCache* cache = m_state->UseCache(options.cachePath);
+
+    // Most potential gain first; equal gains keep their size order.
+    std::vector<const std::pair<const ULONGLONG, std::vector<FileRecord>>*> schedule;
+    for (const auto& entry : sizeGroups)
+    {
+        if (entry.second.size() >= 2)
+            schedule.push_back(&entry);
+    }
+    std::stable_sort(schedule.begin(), schedule.end(), [](const auto* a, const auto* b) {
+        return PotentialGain(a->first, a->second.size()) > PotentialGain(b->first, b->second.size());
+    });
+
+    ScanProgress progress{ ScanStage::Compare, 0, schedule.size() };
+    PhaseScope compareScope(Phase::Compare);
+    CompareBudget budget(options);
+    for (const auto* entry : schedule)
+    {
+        if (m_state->cancel)
+            break;
+        if (budget.Spent())
+        {
+            ++summary.unexploredSizeGroups;
+            summary.unexploredGain += PotentialGain(entry->first, entry->second.size());
+            continue;
+        }
+
+        CompareSizeGroup(entry->first, entry->second, cache, options.trustCache, m_state->journal.get(), callbacks, summary);
+
+        ++progress.done;
+        if (callbacks.onProgress)
+            callbacks.onProgress(progress);
+    }
+    compareScope.End();
+    m_state->scanned = m_state->journal && !m_state->cancel && summary.unexploredSizeGroups == 0;
+
+    if (cache && !cache->Save())
+        ReportError(L"Failed to save fingerprint cache: " + m_state->cachePath);
+
+    return !m_state->cancel;
+}
+
+bool DuplicateScanner::Scan(const ScanOptions& options, const ScanCallbacks& callbacks, ScanSummary& summary)
+{
+    State::Call call(*m_state, callbacks);
+    std::map<ULONGLONG, std::vector<FileRecord>> sizeGroups;
+    if (options.scratchFolder.empty())
+        return Enumerate(options, callbacks, sizeGroups) && Group(sizeGroups, options, callbacks, summary);
+
+    // External mode: records go to sorted runs, size groups come back one by one.
+    // The fingerprint cache is held in memory whole, so it is not used here.
+    if (!options.cachePath.empty())
+    {
+        ReportError(L"A fingerprint cache cannot be used with a scratch folder.");
+        return false;
+    }
+    if (!m_state->UseJournal(options))
+        return false;
+    ExternalSizeSorter sorter(options.scratchFolder, options.memoryBudget);
+
+    // A checkpoint holds no listings here, only the runs and the directories
+    // left to list each time a run is written, so runs are cut between
+    // directories. A resumed scan takes the runs over and lists only the rest.
+    ScanJournal* const journal = m_state->journal.get();
+    std::vector<std::wstring> runs;
+    std::vector<std::wstring> pending;
+    if (journal && journal->FindRuns(runs, pending))
+        sorter.Adopt(runs);
+    else
+        pending.push_back(g_fileSystem->NormalizeRoot(options.rootFolder));
+    sorter.KeepRuns(journal != nullptr);
+
+    bool spilled = true;
+    if (!pending.empty())
+    {
+        PhaseScope scope(Phase::Enumerate);
+        EnumerationHooks hooks = m_state->MakeHooks(callbacks);
+        if (!journal)
+        {
+            hooks.onFile = [&](FileRecord&& record) { spilled = sorter.Add(std::move(record)) && spilled; };
+        }
+        else
+        {
+            hooks.onFile = [&](FileRecord&& record) { sorter.Buffer(std::move(record)); };
+            hooks.onPending = [&](const std::vector<std::wstring>& left) {
+                if (!sorter.Full())
+                    return;
+                spilled = sorter.Spill() && spilled;
+                if (spilled)
+                    journal->AppendRuns(sorter.Runs(), left);
+            };
+        }
+        EnumerateFilesAndGroupBySize(pending, sizeGroups, PathFilter(options), &hooks);
+        if (journal && spilled && !m_state->cancel)
+        {
+            spilled = sorter.Spill();
+            if (spilled)
+                journal->AppendRuns(sorter.Runs(), std::vector<std::wstring>());
+        }
+    }
+    if (!spilled || m_state->cancel)
+        return false;
+
+    *g_compareTuning = options.tuning;
+
+    PhaseScope compareScope(Phase::Compare);
+    ScanProgress progress{ ScanStage::Compare, 0, 0 };
+    CompareBudget budget(options);
+    const bool merged = sorter.ForEachSizeGroup([&](ULONGLONG size, const std::vector<FileRecord>& files) {
+        if (m_state->cancel)
+            return false;
+        if (budget.Spent())
+        {
+            ++summary.unexploredSizeGroups;
+            summary.unexploredGain += PotentialGain(size, files.size());
+            return true;
+        }
+        CompareSizeGroup(size, files, nullptr, false, journal, callbacks, summary);
+        ++progress.done;
+        if (callbacks.onProgress)
+            callbacks.onProgress(progress);
+        return true;
+    }, [&](const std::vector<std::wstring>& merged) {
+        if (journal)
+            journal->AppendRuns(merged, std::vector<std::wstring>());
+    });
+    compareScope.End();
+
+    // Runs are kept for a scan that has more to do when run again, and for one
+    // that went through until Finish(): its groups are delivered again if dedup
+    // is interrupted.
+    m_state->scanned = journal && merged && !m_state->cancel && summary.unexploredSizeGroups == 0;
+    if (m_state->scanned)
+        m_state->scannedRuns = sorter.Runs();
+    return merged && !m_state->cancel;
+}
+
+bool DuplicateScanner::Deduplicate(const std::vector<std::vector<FileRecord>>& groups, const DedupOptions& options,
+    const ScanCallbacks& callbacks, std::wostream& log)
+{
+    State::Call call(*m_state, callbacks);
+    PhaseScope scope(Phase::Dedup);
+
+    // Groups the checkpoint has as done are skipped; newly done ones are recorded.
+    ScanJournal* journal = m_state->journal.get();
+    std::vector<std::vector<FileRecord>> remaining;
+    if (journal)
+    {
+        for (const auto& group : groups)
+        {
+            if (!journal->IsDeduplicated(group))
+                remaining.push_back(group);
+        }
+    }
+
+    DedupExecutor::GroupDoneCallback onGroupDone;
+    if (callbacks.onProgress || journal)
+    {
+        onGroupDone = [&](const std::vector<FileRecord>& group, bool succeeded, size_t done, size_t total) {
+            if (journal && succeeded)
+                journal->AppendDeduplicated(group);
+            if (callbacks.onProgress)
+                callbacks.onProgress(ScanProgress{ ScanStage::Dedup, done, total });
+        };
+    }
+    DedupExecutor executor(options, log);
+    const bool succeeded = executor.Run(journal ? remaining : groups, &m_state->cancel, onGroupDone);
+    return succeeded && !m_state->cancel;
+}
+
+void DuplicateScanner::Finish()
+{
+    if (!m_state->journal || !m_state->scanned)
+        return;
+    m_state->journal->AppendCompleted();
+    for (const auto& run : m_state->scannedRuns)
+        DeleteFileW(run.c_str());
+    m_state->scanned = false;
+    m_state->scannedRuns.clear();
+}
+
+bool DuplicateScanner::BuildCorpusIndex(const ScanOptions& options, const ScanCallbacks& callbacks,
+    const std::wstring& indexPath)
+{
+    State::Call call(*m_state, callbacks);
+    std::map<ULONGLONG, std::vector<FileRecord>> sizeGroups;
+    if (!Enumerate(options, callbacks, sizeGroups))
+        return false;
+
+    // Every file but the first of a duplicate group is left out.
+    std::unordered_map<std::wstring, bool> copies;
+    ScanCallbacks groupCallbacks = callbacks;
+    groupCallbacks.onGroup = [&](ULONGLONG size, const std::vector<FileRecord>& group) {
+        for (size_t i = 1; i < group.size(); ++i)
+            copies[group[i].path] = true;
+        if (callbacks.onGroup)
+            callbacks.onGroup(size, group);
+    };
+    ScanSummary summary;
+    if (!Group(sizeGroups, options, groupCallbacks, summary))
+        return false;
+
+    // Sample hashes come from the fingerprint cache where it has them.
+    PhaseScope scope(Phase::Compare);
+    FingerprintCache* cache = m_state->cache.get();
+    CorpusIndex index;
+    for (const auto& entry : sizeGroups)
+    {
+        if (m_state->cancel)
+            return false;
+        for (const auto& file : entry.second)
+        {
+            if (copies.count(file.path))
+                continue;
+
+            // Lookups check representatives against the identity recorded here.
+            FileRecord current;
+            if (!g_fileSystem->QueryFileState(file.path, current) || current.size != file.size)
+            {
+                ReportError(L"Error reading file, not indexed: " + file.path);
+                continue;
+            }
+            current.path = file.path;
+            const FileIdentity identity(current);
+            Fingerprint fingerprint;
+            if (const Fingerprint* cached = cache && current.fileId ? cache->Find(identity) : nullptr)
+            {
+                fingerprint = *cached;
+            }
+            else if (!ComputeSampleHashes(file.path, file.size, fingerprint))
+            {
+                ReportError(L"Error reading file, not indexed: " + file.path);
+                continue;
+            }
+            else if (cache && current.fileId)
+            {
+                cache->Store(identity, fingerprint);
+            }
+            index.Add(current, fingerprint);
+        }
+    }
+
+    if (cache && !cache->Save())
+        ReportError(L"Failed to save fingerprint cache: " + m_state->cachePath);
+    if (!index.Save(indexPath))
+        return false;
+    Finish();
+    return true;
+}
+
+bool DuplicateScanner::FindInCorpus(const std::wstring& indexPath, const std::wstring& filePath, CorpusMatch& match)
+{
+    State::Call call(*m_state, ScanCallbacks());
+    match = CorpusMatch();
+    CorpusIndex* corpus = m_state->UseCorpus(indexPath);
+    if (!corpus)
+        return false;
+
+    PhaseScope scope(Phase::Compare);
+    FileRecord incoming;
+    if (!g_fileSystem->QueryFileState(filePath, incoming))
+        return false;
+    incoming.path = filePath;
+
+    const std::vector<CorpusIndex::Entry>* entries = corpus->Find(incoming.size);
+    if (!entries)
+        return true;
+
+    Fingerprint fingerprint;
+    if (!ComputeSampleHashes(filePath, incoming.size, fingerprint))
+        return false;
+
+    // A representative changed or deleted since it was indexed proves nothing
+    // about the content it stood for.
+    std::vector<FileRecord> candidates;
+    for (const auto& entry : *entries)
+    {
+        if (std::memcmp(entry.samples, fingerprint.samples, sizeof(entry.samples)) != 0)
+            continue;
+        FileRecord current;
+        if (!g_fileSystem->QueryFileState(entry.file.path, current) || current.size != entry.file.size
+            || current.fileId != entry.file.fileId || current.volumeSerial != entry.file.volumeSerial
+            || current.lastWriteTime != entry.file.lastWriteTime)
+        {
+            ReportError(L"Indexed file changed since the index was built, skipped: " + entry.file.path);
+            ++match.staleEntries;
+            continue;
+        }
+        current.path = entry.file.path;
+        candidates.push_back(current);
+    }
+    if (candidates.empty())
+        return true;
+
+    // The representatives differ from each other, so at most one is left equal.
+    std::map<GroupKey, std::vector<FileRecord>> keyGroups;
+    std::vector<FileRecord> equal;
+    CompareFilesBufferedAdvanced(incoming, candidates.begin(), candidates.end(), 0, keyGroups, equal);
+    if (!equal.empty())
+    {
+        match.found = true;
+        match.masterPath = equal.front().path;
+    }
+    return true;
+}
+
+bool DuplicateScanner::AddToCorpus(const std::wstring& indexPath, const std::wstring& filePath)
+{
+    State::Call call(*m_state, ScanCallbacks());
+    CorpusIndex* corpus = m_state->UseCorpus(indexPath);
+    if (!corpus)
+        return false;
+
+    PhaseScope scope(Phase::Compare);
+    FileRecord file;
+    Fingerprint fingerprint;
+    if (!g_fileSystem->QueryFileState(filePath, file) || !ComputeSampleHashes(filePath, file.size, fingerprint))
+        return false;
+    file.path = filePath;
+    if (!corpus->Append(indexPath, file, fingerprint))
+    {
+        // What is on disk no longer matches what is loaded.
+        m_state->corpus.reset();
+        return false;
+    }
+    return true;
+}
+
+void DuplicateScanner::Cancel()
+{
+    m_state->cancel = true;
+}
+
+bool DuplicateScanner::Cancelled() const
+{
+    return m_state->cancel;
+}
+
+//------------------------------------------------------------------------------
+// GroupSink
+//   Destination of confirmed duplicate groups. Groups are handed over as soon as
+//   their size group has been resolved; sinks buffer their output and never flush
+//   per line.
+//     HumanGroupSink  - the classic console listing (default);
+//     JsonlGroupSink  - one UTF-8 JSON object per line;
+//     BinaryGroupSink - compact length-prefixed records.
+class GroupSink
+{
+public:
+    virtual ~GroupSink() = default;
+
+    virtual void WriteGroup(size_t groupNumber, ULONGLONG size, const std::vector<FileRecord>& group) = 0;
+    virtual void WriteSummary(const ScanSummary& summary) = 0;
+    virtual bool Flush() = 0;
+};
+
+class HumanGroupSink : public GroupSink
+{
+public:
+    explicit HumanGroupSink(std::wostream& out) : m_out(out) {}
+
+    void WriteGroup(size_t groupNumber, ULONGLONG size, const std::vector<FileRecord>& group) override
+    {
+        m_buffer += L"\nDuplicate Group #" + std::to_wstring(groupNumber) + L" size " + std::to_wstring(size) + L":\n";
+        for (const auto& file : group)
+        {
+            m_buffer += L"  ";
+            m_buffer += file.path;
+            m_buffer += L'\n';
+        }
+        if (m_buffer.size() >= FLUSH_THRESHOLD)
+            WriteBuffer();
+    }
+
+    void WriteSummary(const ScanSummary& summary) override
+    {
+        if (summary.groups == 0)
+            m_buffer += L"\nNo duplicate files found.\n";
+        else
+            m_buffer += L"\nGain: " + std::to_wstring(summary.gain) + L" bytes.\n";
+    }
+
+    bool Flush() override
+    {
+        WriteBuffer();
+        m_out.flush();
+        return static_cast<bool>(m_out);
+    }
+
+private:
+    static constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    void WriteBuffer()
+    {
+        m_out.write(m_buffer.data(), static_cast<std::streamsize>(m_buffer.size()));
+        m_buffer.clear();
+    }
+
+    std::wostream& m_out;
+    std::wstring m_buffer;
+};
+
+//------------------------------------------------------------------------------
+// ByteGroupSink
+//   Base of the machine-readable sinks: collects bytes and writes them to a file
+//   handle (standard output or a file) in large blocks.
+class ByteGroupSink : public GroupSink
+{
+public:
+    // An empty outputPath writes to standard output.
+    explicit ByteGroupSink(const std::wstring& outputPath)
+    {
+        if (outputPath.empty())
+        {
+            m_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+        }
+        else
+        {
+            m_handle = CreateFileW(outputPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            m_ownsHandle = m_handle != INVALID_HANDLE_VALUE;
+        }
+        m_ok = m_handle != INVALID_HANDLE_VALUE && m_handle != nullptr;
+    }
+
+    ~ByteGroupSink() override
+    {
+        if (m_ownsHandle)
+            CloseHandle(m_handle);
+    }
+
+    bool Flush() override
+    {
+        WriteBuffer();
+        return m_ok;
+    }
+
+protected:
+    static constexpr size_t FLUSH_THRESHOLD = 1024 * 1024;
+
+    void Append(const void* data, size_t size)
+    {
+        const char* bytes = static_cast<const char*>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+        if (m_buffer.size() >= FLUSH_THRESHOLD)
+            WriteBuffer();
+    }
+
+    void Append(const std::string& text)
+    {
+        Append(text.data(), text.size());
+    }
+
+private:
+    void WriteBuffer()
+    {
+        size_t offset = 0;
+        while (m_ok && offset < m_buffer.size())
+        {
+            DWORD written = 0;
+            DWORD chunk = static_cast<DWORD>((std::min)(m_buffer.size() - offset, static_cast<size_t>(MAXDWORD)));
+            m_ok = WriteFile(m_handle, m_buffer.data() + offset, chunk, &written, nullptr) != 0;
+            offset += written;
+        }
+        m_buffer.clear();
+    }
+
+    HANDLE m_handle = INVALID_HANDLE_VALUE;
+    bool m_ownsHandle = false;
+    bool m_ok = false;
+    std::vector<char> m_buffer;
+};
+
+class JsonlGroupSink : public ByteGroupSink
+{
+public:
+    using ByteGroupSink::ByteGroupSink;
+
+    void WriteGroup(size_t groupNumber, ULONGLONG size, const std::vector<FileRecord>& group) override
+    {
+        std::string line = "{\"group\":" + std::to_string(groupNumber) + ",\"size\":" + std::to_string(size) + ",\"files\":[";
+        for (size_t i = 0; i < group.size(); ++i)
+        {
+            if (i > 0)
+                line += ',';
+            AppendJsonString(line, group[i].path);
+        }
+        line += "]}\n";
+        Append(line);
+    }
+
+    void WriteSummary(const ScanSummary& summary) override
+    {
+        Append("{\"groups\":" + std::to_string(summary.groups) + ",\"gain\":" + std::to_string(summary.gain)
+            + ",\"unexploredSizeGroups\":" + std::to_string(summary.unexploredSizeGroups)
+            + ",\"unexploredGain\":" + std::to_string(summary.unexploredGain) + "}\n");
+    }
+};
+
+//   Binary record layout (little endian, no padding), after a "HDFG" magic and
+//   a uint32 version:
+//     group:   uint8 1, uint64 size, uint32 fileCount,
+//              per file: uint64 fileId, uint32 pathLength, pathLength WCHARs
+//     summary: uint8 0, uint64 groupCount, uint64 gain,
+//              uint64 unexploredSizeGroups, uint64 unexploredGain
+class BinaryGroupSink : public ByteGroupSink
+{
+public:
+    explicit BinaryGroupSink(const std::wstring& outputPath) : ByteGroupSink(outputPath)
+    {
+        const uint32_t header[2] = { 0x47464448, 2 }; // "HDFG", version
+        Append(header, sizeof(header));
+    }
+
+    void WriteGroup(size_t /*groupNumber*/, ULONGLONG size, const std::vector<FileRecord>& group) override
+    {
+        const uint8_t type = 1;
+        const uint64_t groupSize = size;
+        const uint32_t fileCount = static_cast<uint32_t>(group.size());
+        Append(&type, sizeof(type));
+        Append(&groupSize, sizeof(groupSize));
+        Append(&fileCount, sizeof(fileCount));
+        for (const auto& file : group)
+        {
+            const uint64_t fileId = file.fileId;
+            const uint32_t pathLength = static_cast<uint32_t>(file.path.size());
+            Append(&fileId, sizeof(fileId));
+            Append(&pathLength, sizeof(pathLength));
+            Append(file.path.data(), file.path.size() * sizeof(WCHAR));
+        }
+    }
+
+    void WriteSummary(const ScanSummary& summary) override
+    {
+        const uint8_t type = 0;
+        const uint64_t values[4] = { summary.groups, summary.gain, summary.unexploredSizeGroups, summary.unexploredGain };
+        Append(&type, sizeof(type));
+        Append(values, sizeof(values));
+    }
+};
+
+//------------------------------------------------------------------------------
+// Dedup plan file
+//   Binary snapshot of the detection result, written by --plan and consumed by
+//   --apply, so that the expensive detection can run separately from linking.
+//   Layout (little endian, no padding):
+//     PlanHeader
+//     per group:  uint32 fileCount
+//       per file: PlanFileEntry, then pathLength WCHARs (no terminator)
+//   The first file of a group is its master. The id/size/write-time snapshot is
+//   what DeduplicateGroup() re-validates each file against before linking.
+#pragma pack(push, 1)
+struct PlanHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t groupCount;
+    uint64_t fileCount;
+};
+
+struct PlanFileEntry {
+    uint64_t fileId;
+    uint64_t size;
+    uint64_t lastWriteTime;
+    uint32_t volumeSerial;
+    uint32_t attributes;
+    uint32_t pathLength;
+};
+#pragma pack(pop)
+
+constexpr uint32_t PLAN_MAGIC = 0x50464448; // "HDFP"
+constexpr uint32_t PLAN_VERSION = 1;
+
+//------------------------------------------------------------------------------
+// PlanWriter
+//   Writes a plan file one group at a time, so that the groups never have to be
+//   held in memory together. The header is left blank until Close() fills it
+//   in, so a plan that was cut short is rejected rather than half applied.
+class PlanWriter
+{
+public:
+    explicit PlanWriter(const std::wstring& planPath) : m_out(planPath, std::ios::binary | std::ios::trunc)
+    {
+        m_out.write(reinterpret_cast<const char*>(&m_header), sizeof(m_header));
+    }
+
+    void Write(const std::vector<FileRecord>& group)
+    {
+        const uint32_t fileCount = static_cast<uint32_t>(group.size());
+        m_out.write(reinterpret_cast<const char*>(&fileCount), sizeof(fileCount));
+        for (const auto& file : group)
+        {
+            PlanFileEntry entry = { file.fileId, file.size, file.lastWriteTime,
+                static_cast<uint32_t>(file.volumeSerial), static_cast<uint32_t>(file.attributes),
+                static_cast<uint32_t>(file.path.size()) };
+            m_out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+            m_out.write(reinterpret_cast<const char*>(file.path.data()), file.path.size() * sizeof(WCHAR));
+        }
+        ++m_header.groupCount;
+        m_header.fileCount += group.size();
+    }
+
+    // Returns false if anything failed to be written.
+    bool Close()
+    {
+        const PlanHeader header = { PLAN_MAGIC, PLAN_VERSION, m_header.groupCount, m_header.fileCount };
+        m_out.flush();
+        m_out.seekp(0);
+        m_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        m_out.close();
+        return !m_out.fail();
+    }
+
+private:
+    std::ofstream m_out;
+    PlanHeader m_header = { 0, 0, 0, 0 };
+};
+
+//------------------------------------------------------------------------------
+// WriteDedupPlan()
+//   Writes the duplicate groups to a plan file. Returns false on I/O failure.
+bool WriteDedupPlan(const std::wstring& planPath, const std::vector<std::vector<FileRecord>>& groups)
+{
+    PlanWriter writer(planPath);
+    for (const auto& group : groups)
+        writer.Write(group);
+    return writer.Close();
+}
+
+//------------------------------------------------------------------------------
+// ReadDedupPlan()
+//   Memory-maps a plan file and hands the duplicate groups in it to onBatch, in
+//   batches holding about batchBytes of records, so that a plan larger than
+//   memory can be applied. The whole plan is checked before the first batch.
+//   No file named in the plan is touched. Returns false if the plan is missing
+//   or malformed.
+bool ReadDedupPlan(const std::wstring& planPath, size_t batchBytes,
+    const std::function<void(const std::vector<std::vector<FileRecord>>& groups)>& onBatch)
+{
+    HANDLE hFile = CreateFileW(planPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(PlanHeader)))
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    HANDLE hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(hFile);
+    if (!hMapping)
+        return false;
+    const BYTE* view = static_cast<const BYTE*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(hMapping);
+    if (!view)
+        return false;
+
+    const BYTE* pos = nullptr;
+    const BYTE* const end = view + fileSize.QuadPart;
+    auto take = [&](void* dest, size_t bytes) {
+        if (static_cast<size_t>(end - pos) < bytes)
+            return false;
+        std::memcpy(dest, pos, bytes);
+        pos += bytes;
+        return true;
+    };
+
+    // One pass checks the layout, a second one delivers the groups. Counts are
+    // only trusted as far as the bytes left can hold them: a group takes at
+    // least its file count, a file at least its entry.
+    auto bytesLeft = [&]() { return static_cast<uint64_t>(end - pos); };
+    auto parse = [&](bool deliver) {
+        pos = view;
+        PlanHeader header;
+        bool result = take(&header, sizeof(header)) && header.magic == PLAN_MAGIC && header.version == PLAN_VERSION;
+
+        std::vector<std::vector<FileRecord>> groups;
+        size_t groupsBytes = 0;
+        for (uint64_t g = 0; result && g < header.groupCount; ++g)
+        {
+            uint32_t fileCount = 0;
+            result = take(&fileCount, sizeof(fileCount));
+
+            std::vector<FileRecord> group;
+            if (deliver)
+                group.reserve(static_cast<size_t>((std::min)(static_cast<uint64_t>(fileCount), bytesLeft() / sizeof(PlanFileEntry))));
+            for (uint32_t f = 0; result && f < fileCount; ++f)
+            {
+                PlanFileEntry entry;
+                result = take(&entry, sizeof(entry))
+                    && static_cast<size_t>(end - pos) >= entry.pathLength * sizeof(WCHAR);
+                if (!result)
+                    break;
+                if (!deliver)
+                {
+                    pos += entry.pathLength * sizeof(WCHAR);
+                    continue;
+                }
+
+                FileRecord file;
+                file.fileId = entry.fileId;
+                file.size = entry.size;
+                file.lastWriteTime = entry.lastWriteTime;
+                file.volumeSerial = entry.volumeSerial;
+                file.attributes = entry.attributes;
+                file.path.resize(entry.pathLength);
+                take(&file.path[0], entry.pathLength * sizeof(WCHAR));
+                groupsBytes += sizeof(FileRecord) + (file.path.size() + 1) * sizeof(WCHAR);
+                group.push_back(std::move(file));
+            }
+            if (!deliver || !result)
+                continue;
+            groups.push_back(std::move(group));
+            if (groupsBytes >= batchBytes)
+            {
+                onBatch(groups);
+                groups.clear();
+                groupsBytes = 0;
+            }
+        }
+        if (deliver && result && !groups.empty())
+            onBatch(groups);
+        return result;
+    };
+
+    const bool result = parse(false) && parse(true);
+    UnmapViewOfFile(view);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+// PrintMetrics() / WriteMetricsTextfile()
+//   Report metrics at exit: as a readable summary, and in the Prometheus text
+//   exposition format for the node exporter's textfile collector.
+const wchar_t* const PHASE_NAMES[] = { L"enumerate", L"compare", L"dedup" };
+
+// Bytes read in the compare phase per byte that was needed to decide.
+double GetIoAmplification(const Metrics& metrics)
+{
+    const uint64_t decisive = metrics.decisiveBytes.load();
+    const uint64_t read = metrics.phases[static_cast<size_t>(Phase::Compare)].bytesRead.load();
+    return decisive ? static_cast<double>(read) / decisive : 0.0;
+}
+
+void PrintMetrics(const Metrics& metrics, std::wostream& out)
+{
+    out << L"\nMetrics:\n";
+    out << L"  files enumerated: " << metrics.filesEnumerated << L", directories: " << metrics.directoriesEnumerated
+        << L", directories pruned: " << metrics.directoriesPruned
+        << L", reparse points skipped: " << metrics.reparseDirectoriesSkipped << L", files considered: " << metrics.filesConsidered << L'\n';
+    for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+    {
+        const PhaseCounters& counters = metrics.phases[i];
+        out << L"  " << PHASE_NAMES[i] << L": " << counters.nanoseconds / 1e9 << L" s, "
+            << counters.opens << L" opens, " << counters.statCalls << L" stat calls, "
+            << counters.readCalls << L" reads, " << counters.seeks << L" seeks, "
+            << counters.bytesRead << L" bytes read\n";
+    }
+    out << L"  bytes needed to decide: " << metrics.decisiveBytes
+        << L", I/O amplification: " << GetIoAmplification(metrics) << L'\n';
+
+    auto printHistogram = [&out](const wchar_t* name, const Histogram& histogram) {
+        out << L"  " << name << L":";
+        for (size_t i = 0; i <= histogram.Bounds().size(); ++i)
+        {
+            out << L" ";
+            if (i < histogram.Bounds().size())
+                out << L"<=" << histogram.Bounds()[i];
+            else
+                out << L">" << histogram.Bounds().back();
+            out << L":" << histogram.Bucket(i);
+        }
+        out << L'\n';
+    };
+    printHistogram(L"mismatch offset", metrics.mismatchOffset);
+    printHistogram(L"recursion depth", metrics.recursionDepth);
+    out.flush();
+}
+
+bool WriteMetricsTextfile(const Metrics& metrics, const std::wstring& path)
+{
+    std::ostringstream text;
+    auto counter = [&text](const char* name, const char* help, const char* type) {
+        text << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    };
+    auto perPhase = [&](const char* name, const char* help, const char* type, auto value) {
+        counter(name, help, type);
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+        {
+            std::wstring phaseName = PHASE_NAMES[i];
+            text << name << "{phase=\"" << std::string(phaseName.begin(), phaseName.end()) << "\"} "
+                << value(metrics.phases[i]) << '\n';
+        }
+    };
+    auto histogram = [&](const char* name, const char* help, const Histogram& h) {
+        counter(name, help, "histogram");
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < h.Bounds().size(); ++i)
+        {
+            cumulative += h.Bucket(i);
+            text << name << "_bucket{le=\"" << h.Bounds()[i] << "\"} " << cumulative << '\n';
+        }
+        cumulative += h.Bucket(h.Bounds().size());
+        text << name << "_bucket{le=\"+Inf\"} " << cumulative << '\n';
+        text << name << "_sum " << h.Sum() << '\n';
+        text << name << "_count " << cumulative << '\n';
+    };
+
+    perPhase("hdf_phase_seconds", "Wall-clock time spent per phase.", "gauge",
+        [](const PhaseCounters& c) { return c.nanoseconds / 1e9; });
+    perPhase("hdf_opens_total", "Files and directories opened.", "counter",
+        [](const PhaseCounters& c) { return c.opens.load(); });
+    perPhase("hdf_stat_calls_total", "Metadata queries.", "counter",
+        [](const PhaseCounters& c) { return c.statCalls.load(); });
+    perPhase("hdf_read_calls_total", "Read calls.", "counter",
+        [](const PhaseCounters& c) { return c.readCalls.load(); });
+    perPhase("hdf_seeks_total", "Seeks.", "counter",
+        [](const PhaseCounters& c) { return c.seeks.load(); });
+    perPhase("hdf_read_bytes_total", "Bytes read.", "counter",
+        [](const PhaseCounters& c) { return c.bytesRead.load(); });
+
+    counter("hdf_files_enumerated_total", "Files seen during enumeration.", "counter");
+    text << "hdf_files_enumerated_total " << metrics.filesEnumerated << '\n';
+    counter("hdf_directories_enumerated_total", "Directories listed during enumeration.", "counter");
+    text << "hdf_directories_enumerated_total " << metrics.directoriesEnumerated << '\n';
+    counter("hdf_directories_pruned_total", "Directories skipped unopened by exclusion rules.", "counter");
+    text << "hdf_directories_pruned_total " << metrics.directoriesPruned << '\n';
+    counter("hdf_reparse_directories_skipped_total", "Junctions, mount points and other reparse-point directories skipped.", "counter");
+    text << "hdf_reparse_directories_skipped_total " << metrics.reparseDirectoriesSkipped << '\n';
+    counter("hdf_files_considered_total", "Files passing the filters.", "counter");
+    text << "hdf_files_considered_total " << metrics.filesConsidered << '\n';
+    counter("hdf_decisive_bytes_total", "Bytes that had to be read to decide every file.", "counter");
+    text << "hdf_decisive_bytes_total " << metrics.decisiveBytes << '\n';
+    counter("hdf_io_amplification_ratio", "Bytes read while comparing per decisive byte.", "gauge");
+    text << "hdf_io_amplification_ratio " << GetIoAmplification(metrics) << '\n';
+
+    histogram("hdf_mismatch_offset_bytes", "Offset of the first mismatch against the pivot.", metrics.mismatchOffset);
+    histogram("hdf_recursion_depth", "Recursion depth of content grouping calls.", metrics.recursionDepth);
+
+    // Write next to the target and rename, so the collector never sees a partial file.
+    const std::wstring tempPath = path + L".tmp";
+    {
+        std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        const std::string content = text.str();
+        out.write(content.data(), content.size());
+        if (!out)
+            return false;
+    }
+    return MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+void DuplicateScanner::PrintMetrics(std::wostream& out) const
+{
+    ::PrintMetrics(m_state->metrics, out);
+}
+
+bool DuplicateScanner::WriteMetricsTextfile(const std::wstring& path) const
+{
+    return ::WriteMetricsTextfile(m_state->metrics, path);
+}
+
+//------------------------------------------------------------------------------
+// BenchConfig
+//   Parameters of a synthetic benchmark tree. The same configuration and seed
+//   always produce the same tree, so results can be compared between builds.
+enum class MismatchPosition {
+    Head,
+    Middle,
+    Tail
+};
+
+struct BenchConfig {
+    uint64_t seed = 1;
+    unsigned files = 2000;
+    ULONGLONG minSize = MIN_SIZE_TO_CONSIDER;
+    ULONGLONG maxSize = 4 * 1024 * 1024;    // Sizes are about log-uniform between the two.
+    double duplicateRatio = 0.3;            // Share of files that copy another file's content.
+    unsigned contentsPerSize = 2;           // Distinct contents sharing each size.
+    MismatchPosition mismatch = MismatchPosition::Tail;
+    double sparseRatio = 0.0;               // Share of sizes whose contents have a hole, written sparse.
+    double linkRatio = 0.0;                 // Share of duplicates created as hard links.
+    unsigned depth = 3;
+    unsigned fanout = 4;
+    unsigned runs = 5;
+};
+
+// Parse "key=value,key=value"; returns false on an unknown key or bad value.
+bool ParseBenchConfig(const std::wstring& text, BenchConfig& config)
+{
+    std::wstringstream items(text);
+    std::wstring item;
+    while (std::getline(items, item, L','))
+    {
+        const size_t equals = item.find(L'=');
+        if (equals == std::wstring::npos)
+            return false;
+        const std::wstring key = item.substr(0, equals);
+        const std::wstring value = item.substr(equals + 1);
+        try
+        {
+            if (key == L"seed")
+                config.seed = std::stoull(value);
+            else if (key == L"files")
+                config.files = static_cast<unsigned>(std::stoul(value));
+            else if (key == L"min-size")
+                config.minSize = std::stoull(value);
+            else if (key == L"max-size")
+                config.maxSize = std::stoull(value);
+            else if (key == L"dup-ratio")
+                config.duplicateRatio = std::stod(value);
+            else if (key == L"contents-per-size")
+                config.contentsPerSize = static_cast<unsigned>(std::stoul(value));
+            else if (key == L"mismatch" && value == L"head")
+                config.mismatch = MismatchPosition::Head;
+            else if (key == L"mismatch" && value == L"middle")
+                config.mismatch = MismatchPosition::Middle;
+            else if (key == L"mismatch" && value == L"tail")
+                config.mismatch = MismatchPosition::Tail;
+            else if (key == L"sparse-ratio")
+                config.sparseRatio = std::stod(value);
+            else if (key == L"link-ratio")
+                config.linkRatio = std::stod(value);
+            else if (key == L"depth")
+                config.depth = static_cast<unsigned>(std::stoul(value));
+            else if (key == L"fanout")
+                config.fanout = static_cast<unsigned>(std::stoul(value));
+            else if (key == L"runs")
+                config.runs = static_cast<unsigned>(std::stoul(value));
+            else
+                return false;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+
+    // Variants are told apart by one byte, so at most 255 of them per size.
+    return config.files > 0 && config.runs > 0 && config.fanout > 0
+        && config.minSize > 0 && config.minSize <= config.maxSize
+        && config.contentsPerSize > 0 && config.contentsPerSize <= 255
+        && config.duplicateRatio >= 0.0 && config.duplicateRatio < 1.0
+        && config.sparseRatio >= 0.0 && config.sparseRatio <= 1.0
+        && config.linkRatio >= 0.0 && config.linkRatio <= 1.0;
+}
+
+//------------------------------------------------------------------------------
+// BenchRandom
+//   SplitMix64. The standard distributions are implementation-defined, so the
+//   generator does its own arithmetic to stay reproducible across toolchains;
+//   bench sizes are drawn with integers only, as libm results vary by CRT.
+class BenchRandom
+{
+public:
+    explicit BenchRandom(uint64_t seed) : m_state(seed) {}
+
+    static uint64_t Mix(uint64_t value)
+    {
+        value += 0x9E3779B97F4A7C15ULL;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        return value ^ (value >> 31);
+    }
+
+    uint64_t Next() { return Mix(m_state++); }
+    uint64_t Below(uint64_t bound) { return Next() % bound; }
+
+    // About log-uniform in [low, high] without floating point: an octave
+    // [low << k, (low << (k + 1)) - 1] picked uniformly, the last one running
+    // to high, then a value uniformly within it.
+    uint64_t LogUniform(uint64_t low, uint64_t high)
+    {
+        unsigned octaves = 1;
+        while ((low << octaves) <= high / 2)
+            ++octaves;
+        const unsigned octave = static_cast<unsigned>(Below(octaves));
+        const uint64_t first = low << octave;
+        const uint64_t last = octave + 1 == octaves ? high : 2 * first - 1;
+        return first + Below(last - first + 1);
+    }
+    double Unit() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    uint64_t m_state;
+};
+
+//------------------------------------------------------------------------------
+// BenchContent / BenchTree
+//   A distinct content is a pseudo-random pattern per size; its variants differ
+//   from the pattern in one byte at the configured mismatch position. The tree
+//   lists every file by its path below the root and records what a correct run
+//   has to find.
+struct BenchContent {
+    ULONGLONG size = 0;
+    uint64_t pattern = 0;
+    unsigned variant = 0;       // 0 is the pattern itself.
+    ULONGLONG mismatchOffset = 0;
+    ULONGLONG holeBegin = 0;    // Zero-filled range; empty unless the size is sparse.
+    ULONGLONG holeEnd = 0;
+    bool sparse = false;
+    unsigned copies = 1;
+};
+
+struct BenchFile {
+    std::wstring path;          // Below the root, starting with a backslash.
+    size_t content = 0;
+    size_t linkTo = SIZE_MAX;   // Index of the file this one is a hard link to.
+};
+
+struct BenchTree {
+    std::vector<BenchContent> contents;
+    std::vector<BenchFile> layout;
+    ULONGLONG files = 0;
+    ULONGLONG bytes = 0;
+    ULONGLONG expectedGroups = 0;
+    ULONGLONG expectedGain = 0;
+};
+
+// Byte p of a content is byte p % 8 of the word for p / 8, whatever the
+// alignment of the range asked for.
+void FillBenchChunk(const BenchContent& content, ULONGLONG offset, char* buffer, size_t length)
+{
+    for (size_t i = 0; i < length; )
+    {
+        const ULONGLONG position = offset + i;
+        const size_t skip = static_cast<size_t>(position % sizeof(uint64_t));
+        const size_t count = (std::min)(sizeof(uint64_t) - skip, length - i);
+        uint64_t word = 0;
+        if (position < content.holeBegin || position >= content.holeEnd)
+            word = BenchRandom::Mix(content.pattern ^ (position / 8));
+        std::memcpy(buffer + i, reinterpret_cast<const char*>(&word) + skip, count);
+        i += count;
+    }
+    if (content.variant != 0 && content.mismatchOffset >= offset && content.mismatchOffset < offset + length)
+        buffer[content.mismatchOffset - offset] ^= static_cast<char>(content.variant);
+}
+
+// Write one copy of a content; sparse files skip their all-zero chunks.
+bool WriteBenchFile(const std::wstring& path, const BenchContent& content)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD bytesReturned = 0;
+    bool ok = !content.sparse
+        || DeviceIoControl(hFile, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr);
+
+    constexpr size_t CHUNK_SIZE = 64 * 1024;
+    std::vector<char> buffer(CHUNK_SIZE);
+    for (ULONGLONG offset = 0; ok && offset < content.size; offset += CHUNK_SIZE)
+    {
+        const DWORD length = static_cast<DWORD>((std::min)(static_cast<ULONGLONG>(CHUNK_SIZE), content.size - offset));
+        FillBenchChunk(content, offset, buffer.data(), length);
+        if (content.sparse && std::all_of(buffer.begin(), buffer.begin() + length, [](char c) { return c == 0; }))
+            continue;
+
+        LARGE_INTEGER position;
+        position.QuadPart = static_cast<LONGLONG>(offset);
+        DWORD written = 0;
+        ok = SetFilePointerEx(hFile, position, nullptr, FILE_BEGIN)
+            && WriteFile(hFile, buffer.data(), length, &written, nullptr) && written == length;
+    }
+
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(content.size);
+    ok = ok && SetFilePointerEx(hFile, end, nullptr, FILE_BEGIN) && SetEndOfFile(hFile);
+    CloseHandle(hFile);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// PlanBenchTree() / GenerateBenchTree()
+//   Lay out the tree described by config, and create it on disk under root,
+//   which must not exist yet.
+void PlanBenchTree(const BenchConfig& config, BenchTree& tree)
+{
+    BenchRandom random(config.seed);
+    tree = BenchTree();
+
+    // Distinct contents, grouped contentsPerSize to a size.
+    const unsigned uniqueCount = (std::max)(1u,
+        static_cast<unsigned>(config.files * (1.0 - config.duplicateRatio) + 0.5));
+    for (unsigned first = 0; first < uniqueCount; first += config.contentsPerSize)
+    {
+        BenchContent content;
+        content.size = random.LogUniform(config.minSize, config.maxSize);
+        content.pattern = random.Next();
+        content.sparse = random.Unit() < config.sparseRatio;
+        if (content.sparse)
+        {
+            constexpr ULONGLONG HOLE_ALIGNMENT = 64 * 1024;
+            content.holeBegin = (content.size / 4 + HOLE_ALIGNMENT - 1) / HOLE_ALIGNMENT * HOLE_ALIGNMENT;
+            content.holeEnd = (std::max)(content.holeBegin, content.size * 3 / 4 / HOLE_ALIGNMENT * HOLE_ALIGNMENT);
+        }
+        switch (config.mismatch)
+        {
+        case MismatchPosition::Head:    content.mismatchOffset = 0; break;
+        case MismatchPosition::Middle:  content.mismatchOffset = content.size / 2; break;
+        case MismatchPosition::Tail:    content.mismatchOffset = content.size - 1; break;
+        }
+        for (unsigned variant = 0; variant < config.contentsPerSize && first + variant < uniqueCount; ++variant)
+        {
+            content.variant = variant;
+            tree.contents.push_back(content);
+        }
+    }
+
+    // The remaining files copy a random content.
+    for (unsigned i = uniqueCount; i < config.files; ++i)
+        ++tree.contents[random.Below(tree.contents.size())].copies;
+
+    for (size_t index = 0; index < tree.contents.size(); ++index)
+    {
+        const BenchContent& content = tree.contents[index];
+        const size_t first = tree.layout.size();
+        for (unsigned copy = 0; copy < content.copies; ++copy)
+        {
+            BenchFile file;
+            for (unsigned level = 0; level < config.depth; ++level)
+                file.path += L"\\d" + std::to_wstring(random.Below(config.fanout));
+            file.path += L"\\f" + std::to_wstring(index) + L"_" + std::to_wstring(copy) + L".bin";
+            file.content = index;
+            if (copy > 0 && random.Unit() < config.linkRatio)
+                file.linkTo = first;
+            tree.layout.push_back(std::move(file));
+        }
+
+        tree.files += content.copies;
+        tree.bytes += content.size * content.copies;
+        if (content.copies > 1 && content.size >= MIN_SIZE_TO_CONSIDER)
+        {
+            ++tree.expectedGroups;
+            tree.expectedGain += content.size * (content.copies - 1);
+        }
+    }
+}
+
+bool GenerateBenchTree(const std::wstring& root, const BenchConfig& config, BenchTree& tree)
+{
+    if (!CreateDirectoryW(root.c_str(), nullptr))
+        return false;
+
+    PlanBenchTree(config, tree);
+    for (const BenchFile& file : tree.layout)
+    {
+        const std::wstring path = root + file.path;
+        for (size_t separator = path.find(L'\\', root.size() + 1); separator != std::wstring::npos;
+            separator = path.find(L'\\', separator + 1))
+        {
+            if (!CreateDirectoryW(path.substr(0, separator).c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+                return false;
+        }
+
+        // Hard links fall back to copies where the file system has none.
+        const bool linked = file.linkTo != SIZE_MAX
+            && CreateHardLinkW(path.c_str(), (root + tree.layout[file.linkTo].path).c_str(), nullptr);
+        if (!linked && !WriteBenchFile(path, tree.contents[file.content]))
+        {
+            std::wcerr << L"Failed to create benchmark file: " << path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// VirtualFileSystem
+//   A FileSystem over a planned BenchTree, held in memory; the tree must outlive it. Contents are
+//   synthesized by FillBenchChunk() as they are read, so none is stored. Each
+//   listing, open and read adds its configured latency, and each byte its share
+//   of the bandwidth, to a simulated I/O clock. With wait set, the time is also
+//   slept. Results then depend on the algorithm alone, not on the disk or the
+//   cache.
+//   Files can be deduplicated: a hard link makes the duplicate's name another
+//   name of the master, with NTFS's limit of links per file; a clone, having no
+//   extents to share, only re-validates the duplicate and reads both files.
+struct VirtualIoCost {
+    uint64_t listNs = 0;
+    uint64_t openNs = 0;
+    uint64_t readNs = 0;        // Per read call.
+    double bytesPerNs = 0.0;    // 0 for unlimited bandwidth.
+    bool wait = false;
+};
+
+// Parse "key=value,key=value"; returns false on an unknown key or bad value.
+bool ParseVirtualIoCost(const std::wstring& text, VirtualIoCost& cost)
+{
+    std::wstringstream items(text);
+    std::wstring item;
+    while (std::getline(items, item, L','))
+    {
+        const size_t equals = item.find(L'=');
+        if (equals == std::wstring::npos)
+            return false;
+        const std::wstring key = item.substr(0, equals);
+        const std::wstring value = item.substr(equals + 1);
+        try
+        {
+            if (key == L"list-us")
+                cost.listNs = std::stoull(value) * 1000;
+            else if (key == L"open-us")
+                cost.openNs = std::stoull(value) * 1000;
+            else if (key == L"read-us")
+                cost.readNs = std::stoull(value) * 1000;
+            else if (key == L"mbps")
+                cost.bytesPerNs = std::stod(value) * 1048576.0 / 1e9;
+            else if (key == L"wait")
+                cost.wait = std::stoul(value) != 0;
+            else
+                return false;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+    return cost.bytesPerNs >= 0.0;
+}
+
+class VirtualFileSystem : public FileSystem
+{
+public:
+    VirtualFileSystem(const std::wstring& root, const BenchTree& tree, const VirtualIoCost& cost)
+        : m_cost(cost)
+    {
+        m_directories[root];
+        for (size_t i = 0; i < tree.layout.size(); ++i)
+        {
+            const BenchFile& file = tree.layout[i];
+            const std::wstring path = root + file.path;
+
+            // Add every directory on the way that is not known yet to its parent.
+            size_t parentEnd = root.size();
+            for (size_t separator = path.find(L'\\', parentEnd + 1); separator != std::wstring::npos;
+                separator = path.find(L'\\', separator + 1))
+            {
+                if (m_directories.emplace(path.substr(0, separator), std::vector<DirectoryEntry>()).second)
+                {
+                    DirectoryEntry entry;
+                    entry.name = path.substr(parentEnd + 1, separator - parentEnd - 1);
+                    entry.attributes = FILE_ATTRIBUTE_DIRECTORY;
+                    m_directories[path.substr(0, parentEnd)].push_back(std::move(entry));
+                }
+                parentEnd = separator;
+            }
+
+            const BenchContent& content = tree.contents[file.content];
+            DirectoryEntry entry;
+            entry.name = path.substr(parentEnd + 1);
+            entry.fileId = (file.linkTo != SIZE_MAX ? file.linkTo : i) + 1;
+            entry.size = content.size;
+            entry.attributes = content.sparse ? FILE_ATTRIBUTE_SPARSE_FILE : FILE_ATTRIBUTE_NORMAL;
+            m_files.emplace(path, VirtualFile{ &content, entry.fileId });
+            ++m_linkCounts[entry.fileId];
+            m_directories[path.substr(0, parentEnd)].push_back(std::move(entry));
+        }
+    }
+
+    // Simulated time spent in I/O so far.
+    uint64_t SimulatedNs() const { return m_simulatedNs.load(std::memory_order_relaxed); }
+
+    bool ListDirectory(const std::wstring& directory, DWORD& volumeSerial,
+        std::vector<DirectoryEntry>& entries) override
+    {
+        g_metrics->CountOpen();
+        g_metrics->CountStat();
+        Charge(m_cost.listNs);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_directories.find(directory);
+        if (it == m_directories.end())
+            return false;
+        volumeSerial = VOLUME_SERIAL;
+        entries = it->second;
+        return true;
+    }
+
+    std::unique_ptr<FileReader> OpenForRead(const std::wstring& path) override
+    {
+        Charge(m_cost.openNs);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_files.find(path);
+        if (it == m_files.end())
+            return nullptr;
+        return std::make_unique<Reader>(*this, *it->second.content);
+    }
+
+    // The hole, less the 64 KB block holding a mismatch byte inside it, as a
+    // sparse file written by WriteBenchFile() would have it.
+    bool QueryDataMap(const std::wstring& path, DataMap& dataMap, LONGLONG& fileSize) override
+    {
+        g_metrics->CountOpen();
+        g_metrics->CountStat();
+        Charge(m_cost.openNs);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_files.find(path);
+        if (it == m_files.end())
+            return false;
+
+        const BenchContent& content = *it->second.content;
+        const LONGLONG size = static_cast<LONGLONG>(content.size);
+        LONGLONG holeBegin = (std::min)(static_cast<LONGLONG>(content.holeBegin), size);
+        LONGLONG holeEnd = (std::min)(static_cast<LONGLONG>(content.holeEnd), size);
+        DataRange mismatchBlock{ 0, 0 };
+        if (content.variant != 0 && content.mismatchOffset >= content.holeBegin && content.mismatchOffset < content.holeEnd)
+        {
+            constexpr LONGLONG BLOCK = 64 * 1024;
+            mismatchBlock.offset = static_cast<LONGLONG>(content.mismatchOffset) / BLOCK * BLOCK;
+            mismatchBlock.length = (std::min)(BLOCK, size - mismatchBlock.offset);
+        }
+
+        dataMap.clear();
+        for (const DataRange& range : { DataRange{ 0, holeBegin }, mismatchBlock, DataRange{ holeEnd, size - holeEnd } })
+        {
+            if (range.length > 0)
+                dataMap.push_back(range);
+        }
+        fileSize = size;
+        return true;
+    }
+
+    bool QueryFileState(const std::wstring& path, FileRecord& file) override
+    {
+        g_metrics->CountOpen();
+        g_metrics->CountStat();
+        Charge(m_cost.openNs);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_files.find(path);
+        if (it == m_files.end())
+            return false;
+        Describe(it->second, file);
+        return true;
+    }
+
+    std::unique_ptr<DedupSession> OpenDedupSession() override
+    {
+        return std::make_unique<Session>(*this);
+    }
+
+private:
+    struct VirtualFile {
+        const BenchContent* content;
+        ULONGLONG fileId;
+    };
+
+    class Master : public DedupMaster
+    {
+    public:
+        Master(VirtualFileSystem& fileSystem, const VirtualFile& file) : m_fileSystem(fileSystem), m_file(file) {}
+
+        const VirtualFile& File() const { return m_file; }
+
+        bool Query(FileRecord& file) override
+        {
+            g_metrics->CountStat();
+            std::lock_guard<std::mutex> lock(m_fileSystem.m_mutex);
+            m_fileSystem.Describe(m_file, file);
+            return true;
+        }
+
+        DWORD LinkLimit() override { return LINK_LIMIT; }
+
+        bool PrepareClone() override { return true; }
+
+        CloneResult CloneInto(const FileRecord& dupFile) override
+        {
+            g_metrics->CountOpen();
+            m_fileSystem.Charge(m_fileSystem.m_cost.openNs);
+            VirtualFile target;
+            {
+                std::lock_guard<std::mutex> lock(m_fileSystem.m_mutex);
+                auto it = m_fileSystem.m_files.find(dupFile.path);
+                if (it == m_fileSystem.m_files.end())
+                {
+                    SetLastError(ERROR_FILE_NOT_FOUND);
+                    return CloneResult::Failed;
+                }
+                target = it->second;
+            }
+            if (target.fileId != dupFile.fileId || target.content->size != dupFile.size
+                || dupFile.lastWriteTime != 0 || target.content->size != m_file.content->size)
+                return CloneResult::Changed;
+
+            // Contents are immutable, so the comparison needs no lock.
+            Reader master(m_fileSystem, *m_file.content), duplicate(m_fileSystem, *target.content);
+            std::vector<char> masterBuffer(1024 * 1024), duplicateBuffer(masterBuffer.size());
+            for (ULONGLONG offset = 0; offset < m_file.content->size; offset += masterBuffer.size())
+            {
+                const std::streamsize count = static_cast<std::streamsize>(
+                    (std::min)(static_cast<ULONGLONG>(masterBuffer.size()), m_file.content->size - offset));
+                master.Read(masterBuffer.data(), count);
+                duplicate.Read(duplicateBuffer.data(), count);
+                g_metrics->CountRead(count);
+                g_metrics->CountRead(count);
+                if (memcmp(masterBuffer.data(), duplicateBuffer.data(), static_cast<size_t>(count)) != 0)
+                    return CloneResult::Changed;
+            }
+            return CloneResult::Cloned;
+        }
+
+    private:
+        VirtualFileSystem& m_fileSystem;
+        VirtualFile m_file;
+    };
+
+    class Session : public DedupSession
+    {
+    public:
+        explicit Session(VirtualFileSystem& fileSystem) : m_fileSystem(fileSystem) {}
+
+        std::unique_ptr<DedupMaster> OpenMaster(const std::wstring& path) override
+        {
+            g_metrics->CountOpen();
+            m_fileSystem.Charge(m_fileSystem.m_cost.openNs);
+            std::lock_guard<std::mutex> lock(m_fileSystem.m_mutex);
+            auto it = m_fileSystem.m_files.find(path);
+            if (it == m_fileSystem.m_files.end())
+            {
+                SetLastError(ERROR_FILE_NOT_FOUND);
+                return nullptr;
+            }
+            return std::make_unique<Master>(m_fileSystem, it->second);
+        }
+
+        bool ReplaceWithLink(DedupMaster& master, const std::wstring& dupPath) override
+        {
+            const VirtualFile& masterFile = static_cast<Master&>(master).File();
+            m_fileSystem.Charge(m_fileSystem.m_cost.openNs);
+            std::lock_guard<std::mutex> lock(m_fileSystem.m_mutex);
+            auto it = m_fileSystem.m_files.find(dupPath);
+            if (it == m_fileSystem.m_files.end())
+            {
+                SetLastError(ERROR_FILE_NOT_FOUND);
+                return false;
+            }
+            if (m_fileSystem.m_linkCounts[masterFile.fileId] >= LINK_LIMIT)
+            {
+                SetLastError(ERROR_TOO_MANY_LINKS);
+                return false;
+            }
+
+            if (--m_fileSystem.m_linkCounts[it->second.fileId] == 0)
+                m_fileSystem.m_linkCounts.erase(it->second.fileId);
+            ++m_fileSystem.m_linkCounts[masterFile.fileId];
+            it->second = masterFile;
+
+            const size_t separator = dupPath.find_last_of(L'\\');
+            const std::wstring name = dupPath.substr(separator + 1);
+            for (DirectoryEntry& entry : m_fileSystem.m_directories[dupPath.substr(0, separator)])
+            {
+                if (entry.name == name)
+                    entry.fileId = masterFile.fileId;
+            }
+            return true;
+        }
+
+        bool IsUnchanged(const FileRecord& file) override
+        {
+            g_metrics->CountStat();
+            m_fileSystem.Charge(m_fileSystem.m_cost.openNs);
+            std::lock_guard<std::mutex> lock(m_fileSystem.m_mutex);
+            auto it = m_fileSystem.m_files.find(file.path);
+            return it != m_fileSystem.m_files.end() && it->second.content->size == file.size && file.lastWriteTime == 0;
+        }
+
+    private:
+        VirtualFileSystem& m_fileSystem;
+    };
+
+    class Reader : public FileReader
+    {
+    public:
+        Reader(VirtualFileSystem& fileSystem, const BenchContent& content)
+            : m_fileSystem(fileSystem), m_content(content) {}
+
+        void Seek(LONGLONG offset) override { m_position = static_cast<ULONGLONG>(offset); }
+
+        std::streamsize Read(char* buffer, std::streamsize count) override
+        {
+            const ULONGLONG available = m_content.size > m_position ? m_content.size - m_position : 0;
+            const size_t length = static_cast<size_t>((std::min)(static_cast<ULONGLONG>(count), available));
+            const VirtualIoCost& cost = m_fileSystem.m_cost;
+            m_fileSystem.Charge(cost.readNs
+                + (cost.bytesPerNs > 0.0 ? static_cast<uint64_t>(length / cost.bytesPerNs) : 0));
+            FillBenchChunk(m_content, m_position, buffer, length);
+            m_position += length;
+            return static_cast<std::streamsize>(length);
+        }
+
+    private:
+        VirtualFileSystem& m_fileSystem;
+        const BenchContent& m_content;
+        ULONGLONG m_position = 0;
+    };
+
+    void Charge(uint64_t ns)
+    {
+        m_simulatedNs.fetch_add(ns, std::memory_order_relaxed);
+        if (m_cost.wait && ns > 0)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+    }
+
+    // The state of a file, as QueryFileState(). With m_mutex held.
+    void Describe(const VirtualFile& virtualFile, FileRecord& file) const
+    {
+        const BenchContent& content = *virtualFile.content;
+        file.fileId = virtualFile.fileId;
+        file.volumeSerial = VOLUME_SERIAL;
+        file.size = content.size;
+        file.lastWriteTime = 0;
+        file.attributes = content.sparse ? FILE_ATTRIBUTE_SPARSE_FILE : FILE_ATTRIBUTE_NORMAL;
+        auto links = m_linkCounts.find(virtualFile.fileId);
+        file.linkCount = links == m_linkCounts.end() ? 0 : links->second;
+    }
+
+    static constexpr DWORD VOLUME_SERIAL = 0x56465330;  // "VFS0"
+    static constexpr DWORD LINK_LIMIT = 1024;
+
+    VirtualIoCost m_cost;
+    std::mutex m_mutex;         // Guards the tables below, which dedup changes.
+    std::unordered_map<std::wstring, std::vector<DirectoryEntry>> m_directories;
+    std::unordered_map<std::wstring, VirtualFile> m_files;
+    std::unordered_map<ULONGLONG, DWORD> m_linkCounts;
+    std::atomic<uint64_t> m_simulatedNs{ 0 };
+};
+
+//------------------------------------------------------------------------------
+// RemoveTree()
+//   Delete a directory and everything below it.
+bool RemoveTree(const std::wstring& directory)
+{
+    WIN32_FIND_DATAW findData;
+    HANDLE hFind = FindFirstFileW((directory + L"\\*").c_str(), &findData);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            const std::wstring name = findData.cFileName;
+            if (name == L"." || name == L"..")
+                continue;
+            const std::wstring path = directory + L"\\" + name;
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                RemoveTree(path);
+            else
+                DeleteFileW(path.c_str());
+        } while (FindNextFileW(hFind, &findData));
+        FindClose(hFind);
+    }
+    return RemoveDirectoryW(directory.c_str()) != 0;
+}
+
+//------------------------------------------------------------------------------
+// RunBenchmark()
+//   Generate a tree under scratchFolder and time each phase on its own, then
+//   the full pipeline, config.runs times each. Phases that modify the tree run
+//   on a freshly generated one; generation is not timed. Caches are warm after
+//   the first run, as nothing here can drop them.
+//
+//   With virtualIo the tree lives in a VirtualFileSystem instead, and each phase
+//   also reports its simulated I/O time.
+//
+//   Output is one line per phase of space-separated key=value pairs in a fixed
+//   order and precision, so results can be diffed between builds.
+bool RunBenchmark(const std::wstring& scratchFolder, const BenchConfig& config,
+    const DedupOptions& dedupOptions, const VirtualIoCost* virtualIo, std::wostream& out)
+{
+    const std::wstring root = virtualIo ? std::wstring(L"vfs:") : scratchFolder + L"\\bench-tree";
+    BenchTree tree;
+    std::unique_ptr<VirtualFileSystem> virtualFileSystem;
+
+    auto elapsedMs = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto totalBytesRead = []() {
+        uint64_t bytes = 0;
+        for (const PhaseCounters& counters : g_metrics->phases)
+            bytes += counters.bytesRead;
+        return bytes;
+    };
+    auto simulatedNs = [&virtualFileSystem]() {
+        return virtualFileSystem ? virtualFileSystem->SimulatedNs() : 0;
+    };
+    auto regenerate = [&]() {
+        if (virtualIo)
+        {
+            PlanBenchTree(config, tree);
+            virtualFileSystem = std::make_unique<VirtualFileSystem>(root, tree, *virtualIo);
+            g_fileSystem = virtualFileSystem.get();
+            return true;
+        }
+        RemoveTree(root);
+        if (GenerateBenchTree(root, config, tree))
+            return true;
+        std::wcerr << L"Failed to generate benchmark tree: " << root << std::endl;
+        return false;
+    };
+    auto enumerate = [&](std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups) {
+        PhaseScope scope(Phase::Enumerate);
+        EnumerateFilesAndGroupBySize(root, sizeGroups);
+    };
+    // Through DuplicateScanner::Group(), as a scan compares, with the tuning in
+    // place; its metrics are added to those counted here when it returns.
+    auto compare = [](const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+        std::vector<std::vector<FileRecord>>& groups, ULONGLONG& gain) {
+        ScanOptions options;
+        options.tuning = *g_compareTuning;
+        ScanCallbacks callbacks;
+        callbacks.onGroup = [&groups](ULONGLONG, const std::vector<FileRecord>& group) { groups.push_back(group); };
+        ScanSummary summary;
+        DuplicateScanner scanner;
+        scanner.Group(sizeGroups, options, callbacks, summary);
+        gain = summary.gain;
+    };
+    auto deduplicate = [&](const std::vector<std::vector<FileRecord>>& groups) {
+        PhaseScope scope(Phase::Dedup);
+        std::wostringstream discard;
+        DedupExecutor executor(dedupOptions, discard);
+        return executor.Run(groups);
+    };
+
+    // Latency over the runs, throughput at the median.
+    struct Sample {
+        std::vector<double> ms;
+        uint64_t files = 0;
+        uint64_t bytesRead = 0;
+        uint64_t simulatedNs = 0;
+    };
+    auto report = [&out, virtualIo](const wchar_t* phase, Sample& sample, const std::wstring& extra) {
+        std::sort(sample.ms.begin(), sample.ms.end());
+        const double median = sample.ms[sample.ms.size() / 2];
+        const double seconds = (std::max)(median, 1e-6) / 1000.0;
+        const size_t runs = sample.ms.size();
+        out << L"phase=" << phase << L" runs=" << runs
+            << L" min_ms=" << sample.ms.front() << L" median_ms=" << median << L" max_ms=" << sample.ms.back()
+            << L" files=" << sample.files / runs << L" files_per_s=" << (sample.files / runs) / seconds
+            << L" read_mb=" << (sample.bytesRead / runs) / 1048576.0
+            << L" read_mb_per_s=" << (sample.bytesRead / runs) / 1048576.0 / seconds;
+        if (virtualIo)
+            out << L" sim_io_ms=" << (sample.simulatedNs / runs) / 1e6;
+        out << extra << L'\n';
+    };
+
+    const std::streamsize precision = out.precision(3);
+    const std::ios_base::fmtflags flags = out.setf(std::ios::fixed, std::ios::floatfield);
+    const wchar_t* const MISMATCH_NAMES[] = { L"head", L"middle", L"tail" };
+    out << L"benchmark version=1 seed=" << config.seed << L" files=" << config.files
+        << L" min_size=" << config.minSize << L" max_size=" << config.maxSize
+        << L" dup_ratio=" << config.duplicateRatio << L" contents_per_size=" << config.contentsPerSize
+        << L" mismatch=" << MISMATCH_NAMES[static_cast<int>(config.mismatch)]
+        << L" sparse_ratio=" << config.sparseRatio << L" link_ratio=" << config.linkRatio
+        << L" depth=" << config.depth << L" fanout=" << config.fanout << L" runs=" << config.runs
+        << L" filesystem=" << (virtualIo ? L"virtual" : L"disk") << L'\n';
+
+    // Never delete a folder this run did not create.
+    if (!virtualIo && GetFileAttributesW(root.c_str()) != INVALID_FILE_ATTRIBUTES)
+    {
+        std::wcerr << L"Benchmark folder already exists: " << root << std::endl;
+        return false;
+    }
+
+    bool ok = true;
+    Sample generateSample, enumerateSample, compareSample, dedupSample, fullSample;
+    std::wstring checks;
+    for (unsigned run = 0; ok && run < config.runs; ++run)
+    {
+        // Generation, then enumeration and comparison on the untouched tree.
+        auto start = std::chrono::steady_clock::now();
+        if (!(ok = regenerate()))
+            break;
+        generateSample.ms.push_back(elapsedMs(start));
+        generateSample.files += tree.files;
+
+        std::map<ULONGLONG, std::vector<FileRecord>> sizeGroups;
+        uint64_t simulatedBefore = simulatedNs();
+        start = std::chrono::steady_clock::now();
+        enumerate(sizeGroups);
+        enumerateSample.ms.push_back(elapsedMs(start));
+        enumerateSample.simulatedNs += simulatedNs() - simulatedBefore;
+        for (const auto& entry : sizeGroups)
+            enumerateSample.files += entry.second.size();
+
+        std::vector<std::vector<FileRecord>> groups;
+        ULONGLONG gain = 0;
+        uint64_t bytesBefore = totalBytesRead();
+        simulatedBefore = simulatedNs();
+        start = std::chrono::steady_clock::now();
+        compare(sizeGroups, groups, gain);
+        compareSample.ms.push_back(elapsedMs(start));
+        compareSample.bytesRead += totalBytesRead() - bytesBefore;
+        compareSample.simulatedNs += simulatedNs() - simulatedBefore;
+        for (const auto& entry : sizeGroups)
+            compareSample.files += entry.second.size() > 1 ? entry.second.size() : 0;
+        if (run == 0)
+        {
+            const bool correct = groups.size() == tree.expectedGroups && gain == tree.expectedGain;
+            checks = L" groups=" + std::to_wstring(groups.size()) + L" expected_groups=" + std::to_wstring(tree.expectedGroups)
+                + L" gain=" + std::to_wstring(gain) + L" expected_gain=" + std::to_wstring(tree.expectedGain)
+                + L" check=" + (correct ? L"ok" : L"FAILED");
+            ok = correct;
+        }
+
+        // Deduplication on its own, of the groups just found.
+        simulatedBefore = simulatedNs();
+        start = std::chrono::steady_clock::now();
+        ok = deduplicate(groups) && ok;
+        dedupSample.ms.push_back(elapsedMs(start));
+        dedupSample.simulatedNs += simulatedNs() - simulatedBefore;
+        for (const auto& group : groups)
+            dedupSample.files += group.size();
+
+        // The full pipeline on a fresh tree.
+        if (!(ok = ok && regenerate()))
+            break;
+        sizeGroups.clear();
+        groups.clear();
+        bytesBefore = totalBytesRead();
+        simulatedBefore = simulatedNs();
+        start = std::chrono::steady_clock::now();
+        enumerate(sizeGroups);
+        compare(sizeGroups, groups, gain);
+        ok = deduplicate(groups);
+        fullSample.ms.push_back(elapsedMs(start));
+        fullSample.simulatedNs += simulatedNs() - simulatedBefore;
+        fullSample.files += tree.files;
+        fullSample.bytesRead += totalBytesRead() - bytesBefore;
+    }
+
+    if (!generateSample.ms.empty())
+    {
+        out << L"tree files=" << tree.files << L" bytes=" << tree.bytes
+            << L" expected_groups=" << tree.expectedGroups << L" expected_gain=" << tree.expectedGain << L'\n';
+        report(L"generate", generateSample, L"");
+        report(L"enumerate", enumerateSample, L"");
+        report(L"compare", compareSample, checks);
+    }
+    if (!dedupSample.ms.empty())
+        report(L"dedup", dedupSample, L"");
+    if (!fullSample.ms.empty())
+        report(L"full", fullSample, L"");
+    out.flush();
+    out.precision(precision);
+    out.flags(flags);
+
+    if (virtualIo)
+        g_fileSystem = &g_win32FileSystem;
+    else
+        RemoveTree(root);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// MicrobenchConfig
+//   The sweep run by --microbench: every combination of file size, number of
+//   right files and mismatch position gets its own files, on which every
+//   kernel is timed with every batch and chunk size. Lists are ':'-separated.
+struct MicrobenchConfig {
+    uint64_t seed = 1;
+    std::vector<ULONGLONG> sizes{ 1024 * 1024 };
+    std::vector<size_t> rights{ 1, 8, 64 };
+    std::vector<std::wstring> mismatches{ L"head", L"middle", L"tail", L"uniform", L"none" };
+    std::vector<std::wstring> kernels{ L"buffered", L"hole-aware", L"hash" };
+    std::vector<size_t> batches{ 1, 16, 256 };
+    std::vector<size_t> chunks{ 4096, 65536, 1024 * 1024 };
+    unsigned runs = 5;
 };
 
-typedef std::pair<std::streamsize, char> GroupKey;
+// Parse "key=value:value,key=value"; returns false on an unknown key or bad value.
+bool ParseMicrobenchConfig(const std::wstring& text, MicrobenchConfig& config)
+{
+    auto split = [](const std::wstring& value) {
+        std::vector<std::wstring> parts;
+        std::wstringstream stream(value);
+        std::wstring part;
+        while (std::getline(stream, part, L':'))
+            parts.push_back(part);
+        return parts;
+    };
+    auto numbers = [&split](const std::wstring& value, auto& list) {
+        list.clear();
+        for (const std::wstring& part : split(value))
+        {
+            const ULONGLONG number = std::stoull(part);
+            if (number == 0)
+                return false;
+            list.push_back(static_cast<typename std::decay_t<decltype(list)>::value_type>(number));
+        }
+        return !list.empty();
+    };
+    auto names = [&split](const std::wstring& value, std::vector<std::wstring>& list,
+        std::initializer_list<const wchar_t*> allowed) {
+        list = split(value);
+        for (const std::wstring& name : list)
+        {
+            if (std::none_of(allowed.begin(), allowed.end(), [&name](const wchar_t* a) { return name == a; }))
+                return false;
+        }
+        return !list.empty();
+    };
+
+    std::wstringstream items(text);
+    std::wstring item;
+    while (std::getline(items, item, L','))
+    {
+        const size_t equals = item.find(L'=');
+        if (equals == std::wstring::npos)
+            return false;
+        const std::wstring key = item.substr(0, equals);
+        const std::wstring value = item.substr(equals + 1);
+        try
+        {
+            bool valid = true;
+            if (key == L"seed")
+                config.seed = std::stoull(value);
+            else if (key == L"runs")
+                valid = (config.runs = static_cast<unsigned>(std::stoul(value))) > 0;
+            else if (key == L"size")
+                valid = numbers(value, config.sizes);
+            else if (key == L"rights")
+                valid = numbers(value, config.rights);
+            else if (key == L"batch")
+                valid = numbers(value, config.batches);
+            else if (key == L"chunk")
+                valid = numbers(value, config.chunks);
+            else if (key == L"mismatch")
+                valid = names(value, config.mismatches, { L"head", L"middle", L"tail", L"uniform", L"none" });
+            else if (key == L"kernel")
+                valid = names(value, config.kernels, { L"buffered", L"hole-aware", L"hash" });
+            else
+                valid = false;
+            if (!valid)
+                return false;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+    return true;
+}
 
 //------------------------------------------------------------------------------
-// CompareFilesBufferedAdvanced()
-//   Template function that compares a master (left) file against a collection
-//   of right files (via iterators over std::wstring). It reads the master file
-//   one chunk at a time. For each master chunk, it reads the same number of bytes
-//   from each right file. If a mismatch or size difference is detected, the 
-//   function computes a comparison key (for example, the first mismatch byte offset
-//   plus 1, multiplied by -1 if master < right, or by 1 if master > right), adds 
-//   the right file's path to the keyGroups map, and removes that file from further comparison.
-//   After processing the master file, any remaining right file is checked for extra data.
-template <typename T> // T is an iterator over std::wstring items.
-void CompareFilesBufferedAdvanced(const std::wstring& masterFilePath,
-    T rightFileBegin,
-    T rightFileEnd,
-    std::streamsize totalBytesRead,
-    std::map<GroupKey, std::vector<std::wstring>>& keyGroups,
-    std::vector<std::wstring>& duplicateGroup)
+// RunMicrobenchmark()
+//   Time the compare kernels on files written under scratchFolder: the buffered
+//   loop of CompareFilesBufferedAdvanced(), its hole-aware loop (forced by
+//   marking the records sparse) and whole-file SHA-256 as the hashing
+//   alternative, for which batch and chunk size do not apply. Kernels are
+//   driven through GroupFilesByContentUsingMap() so that the batch size counts.
+//
+//   Files are read from the cache once written; point scratchFolder at a RAM
+//   disk and at a real disk to compare the two. Output has one line per
+//   measurement, of key=value pairs in a fixed order and precision. I/O calls
+//   are the opens, metadata queries, reads and seeks counted by g_metrics->
+bool RunMicrobenchmark(const std::wstring& scratchFolder, const MicrobenchConfig& config, std::wostream& out)
 {
-    // Open the master (left) file in binary mode.
-    std::ifstream master(masterFilePath, std::ios::binary);
-    if (!master) {
-        std::wcerr << L"Error opening master file: " << masterFilePath << std::endl;
+    const std::wstring root = scratchFolder + L"\\microbench";
+    if (GetFileAttributesW(root.c_str()) != INVALID_FILE_ATTRIBUTES)
+    {
+        std::wcerr << L"Microbenchmark folder already exists: " << root << std::endl;
+        return false;
+    }
+
+    const CompareTuning savedTuning = *g_compareTuning;
+    const std::streamsize precision = out.precision(3);
+    const std::ios_base::fmtflags flags = out.setf(std::ios::fixed, std::ios::floatfield);
+    out << L"microbenchmark version=1 seed=" << config.seed << L" runs=" << config.runs << L'\n';
+
+    PhaseScope scope(Phase::Compare);
+    const PhaseCounters& counters = g_metrics->phases[static_cast<size_t>(Phase::Compare)];
+    auto calls = [&counters]() {
+        return counters.opens + counters.statCalls + counters.readCalls + counters.seeks;
+    };
+
+    BenchRandom random(config.seed);
+    bool ok = true;
+    for (size_t sizeIndex = 0; ok && sizeIndex < config.sizes.size(); ++sizeIndex)
+    for (size_t rightsIndex = 0; ok && rightsIndex < config.rights.size(); ++rightsIndex)
+    for (size_t mismatchIndex = 0; ok && mismatchIndex < config.mismatches.size(); ++mismatchIndex)
+    {
+        const ULONGLONG size = config.sizes[sizeIndex];
+        const size_t rights = config.rights[rightsIndex];
+        const std::wstring& mismatch = config.mismatches[mismatchIndex];
+
+        // A pivot and right files that differ from it in one byte each.
+        if (!CreateDirectoryW(root.c_str(), nullptr))
+        {
+            std::wcerr << L"Failed to create microbenchmark folder: " << root << std::endl;
+            ok = false;
+            break;
+        }
+        std::vector<FileRecord> files(rights + 1);
+        BenchContent content;
+        content.size = size;
+        content.pattern = random.Next();
+        for (size_t i = 0; ok && i < files.size(); ++i)
+        {
+            content.variant = (i == 0 || mismatch == L"none") ? 0 : static_cast<unsigned>((i - 1) % 255 + 1);
+            if (mismatch == L"head")
+                content.mismatchOffset = 0;
+            else if (mismatch == L"middle")
+                content.mismatchOffset = size / 2;
+            else if (mismatch == L"uniform")
+                content.mismatchOffset = random.Below(size);
+            else
+                content.mismatchOffset = size - 1;
+
+            files[i].path = root + L"\\f" + std::to_wstring(i) + L".bin";
+            files[i].size = size;
+            if (!WriteBenchFile(files[i].path, content))
+            {
+                std::wcerr << L"Failed to create microbenchmark file: " << files[i].path << std::endl;
+                ok = false;
+            }
+        }
+
+        for (size_t kernelIndex = 0; ok && kernelIndex < config.kernels.size(); ++kernelIndex)
+        {
+            const std::wstring& kernel = config.kernels[kernelIndex];
+            const bool hash = kernel == L"hash";
+            for (FileRecord& file : files)
+                file.attributes = kernel == L"hole-aware" ? FILE_ATTRIBUTE_SPARSE_FILE : FILE_ATTRIBUTE_NORMAL;
+
+            for (size_t batchIndex = 0; batchIndex < (hash ? 1 : config.batches.size()); ++batchIndex)
+            for (size_t chunkIndex = 0; chunkIndex < (hash ? 1 : config.chunks.size()); ++chunkIndex)
+            {
+                const size_t batch = hash ? 0 : config.batches[batchIndex];
+                const size_t chunk = hash ? 0 : config.chunks[chunkIndex];
+                if (!hash)
+                {
+                    g_compareTuning->maxBatch = batch;
+                    g_compareTuning->chunkSize = chunk;
+                }
+
+                std::vector<double> ms;
+                const uint64_t bytesBefore = counters.bytesRead;
+                const uint64_t callsBefore = calls();
+                for (unsigned run = 0; run < config.runs; ++run)
+                {
+                    const auto start = std::chrono::steady_clock::now();
+                    if (hash)
+                    {
+                        Fingerprint fingerprint;
+                        for (const FileRecord& file : files)
+                            ComputeContentHash(file.path, fingerprint);
+                    }
+                    else
+                    {
+                        std::vector<std::vector<FileRecord>> duplicateGroups;
+                        GroupFilesByContentUsingMap(files, duplicateGroups, 0);
+                    }
+                    ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+                }
+
+                std::sort(ms.begin(), ms.end());
+                const double median = ms[ms.size() / 2];
+                const double seconds = (std::max)(median, 1e-6) / 1000.0;
+                const double readMb = (counters.bytesRead - bytesBefore) / 1048576.0 / config.runs;
+                const double dataMb = static_cast<double>(size) * files.size() / 1048576.0;
+                out << L"kernel=" << kernel << L" size=" << size << L" rights=" << rights << L" mismatch=" << mismatch
+                    << L" batch=" << batch << L" chunk=" << chunk
+                    << L" runs=" << config.runs << L" min_ms=" << ms.front() << L" median_ms=" << median
+                    << L" max_ms=" << ms.back() << L" data_mb_per_s=" << dataMb / seconds
+                    << L" read_mb=" << readMb << L" read_mb_per_s=" << readMb / seconds
+                    << L" calls_per_mb=" << (calls() - callsBefore) / static_cast<double>(config.runs) / (std::max)(readMb, 1e-9)
+                    << L'\n';
+                *g_compareTuning = savedTuning;
+            }
+        }
+        out.flush();
+        RemoveTree(root);
+    }
+
+    out.precision(precision);
+    out.flags(flags);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// MismatchProfile
+//   Sampled statistics of how same-size files differ: the share of pairs that
+//   are identical, and a histogram of the first mismatch offset relative to the
+//   file size. Written by --sample-mismatches, read by --simulate.
+//
+//   Text format: a "hdf-mismatch-profile 1" line, then "pairs N", "identical N"
+//   and one "bucket I N" line per histogram bucket.
+struct MismatchProfile {
+    static constexpr size_t BUCKETS = 64;
+
+    uint64_t pairs = 0;
+    uint64_t identical = 0;
+    uint64_t buckets[BUCKETS] = {};
+
+    bool Save(const std::wstring& path) const
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << "hdf-mismatch-profile 1\npairs " << pairs << "\nidentical " << identical << '\n';
+        for (size_t i = 0; i < BUCKETS; ++i)
+            out << "bucket " << i << ' ' << buckets[i] << '\n';
+        return static_cast<bool>(out);
+    }
+
+    bool Load(const std::wstring& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string word;
+        int version = 0;
+        if (!(in >> word >> version) || word != "hdf-mismatch-profile" || version != 1)
+            return false;
+        while (in >> word)
+        {
+            if (word == "pairs")
+                in >> pairs;
+            else if (word == "identical")
+                in >> identical;
+            else if (word == "bucket")
+            {
+                size_t index = BUCKETS;
+                uint64_t count = 0;
+                in >> index >> count;
+                if (index >= BUCKETS)
+                    return false;
+                buckets[index] = count;
+            }
+            else
+                return false;
+        }
+
+        // DrawMismatch() walks the buckets by these counts.
+        uint64_t different = 0;
+        for (uint64_t count : buckets)
+            different += count;
+        return pairs > 0 && identical <= pairs && different == pairs - identical;
+    }
+
+    // Offset in [0, size) drawn from the histogram, uniform within a bucket.
+    ULONGLONG DrawMismatch(ULONGLONG size, BenchRandom& random) const
+    {
+        const uint64_t different = pairs - identical;
+        if (different == 0)
+            return 0;
+        uint64_t pick = random.Below(different);
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && pick >= buckets[bucket])
+            pick -= buckets[bucket++];
+        const double fraction = (bucket + random.Unit()) / BUCKETS;
+        return (std::min)(size - 1, static_cast<ULONGLONG>(fraction * size));
+    }
+};
+
+//------------------------------------------------------------------------------
+// FindFirstMismatch()
+//   Offset of the first byte where two files of the given size differ, or size
+//   if they are identical. Returns false if either cannot be read.
+bool FindFirstMismatch(const std::wstring& left, const std::wstring& right, ULONGLONG size, ULONGLONG& offset)
+{
+    std::unique_ptr<FileReader> readers[2] = { g_fileSystem->OpenForRead(left), g_fileSystem->OpenForRead(right) };
+    if (!readers[0] || !readers[1])
+        return false;
+
+    std::vector<char> buffers(2 * BUFFER_SIZE);
+    for (offset = 0; offset < size; )
+    {
+        const std::streamsize length = static_cast<std::streamsize>((std::min)(static_cast<ULONGLONG>(BUFFER_SIZE), size - offset));
+        if (readers[0]->Read(buffers.data(), length) != length
+            || readers[1]->Read(buffers.data() + BUFFER_SIZE, length) != length)
+            return false;
+        if (std::memcmp(buffers.data(), buffers.data() + BUFFER_SIZE, static_cast<size_t>(length)) != 0)
+        {
+            size_t i = 0;
+            while (buffers[i] == buffers[BUFFER_SIZE + i])
+                ++i;
+            offset += i;
+            return true;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// SampleMismatchProfile()
+//   Compare up to pairCount random pairs of same-size files, each from a size
+//   group picked at random, and histogram where they first differ.
+void SampleMismatchProfile(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    uint64_t pairCount, MismatchProfile& profile)
+{
+    std::vector<const std::vector<FileRecord>*> groups;
+    for (const auto& entry : sizeGroups)
+    {
+        if (entry.second.size() >= 2)
+            groups.push_back(&entry.second);
+    }
+    if (groups.empty())
         return;
+
+    BenchRandom random(1);
+    for (uint64_t i = 0; i < pairCount; ++i)
+    {
+        const std::vector<FileRecord>& group = *groups[random.Below(groups.size())];
+        const size_t left = random.Below(group.size());
+        const size_t right = (left + 1 + random.Below(group.size() - 1)) % group.size();
+        const ULONGLONG size = group[left].size;
+
+        ULONGLONG offset;
+        if (!FindFirstMismatch(group[left].path, group[right].path, size, offset))
+            continue;
+        ++profile.pairs;
+        if (offset >= size)
+            ++profile.identical;
+        else
+            ++profile.buckets[(std::min)(MismatchProfile::BUCKETS - 1, static_cast<size_t>(offset * MismatchProfile::BUCKETS / size))];
     }
-    master.seekg(totalBytesRead, std::ios::beg);
+}
 
-    // Build a vector of right file state objects.
-    std::vector<RightFileState> rightStates;
-    for (T it = rightFileBegin; it != rightFileEnd; ++it)
+//------------------------------------------------------------------------------
+// GainEstimate / EstimateGain()
+//   Estimates the gain of all size groups from a sample, reading about
+//   fraction of their data. Groups are drawn with replacement, each with
+//   probability proportional to its potential gain W_i (size times files beyond
+//   the first). Every draw of a group adds up to filesPerGroup more of its files,
+//   picked at random, to that group's sample, and they are compared by the
+//   hashes of their probe blocks (ComputeSampleHashes()). The share p_i of
+//   identical pairs in the sample is unbiased for the group's. Scaled by n_i / 2
+//   it is the share r_i of files beyond the first of each content when
+//   duplicates come in pairs, but a content with k copies has k(k-1)/2 pairs
+//   for its k-1 files, so it overstates r_i k/2-fold: the figure is an upper
+//   estimate of the gain, not the gain. (Sampling a few files cannot tell many
+//   pairs from fewer contents with many copies.) It is W times the mean of the
+//   scaled p_i over the draws (Hansen-Hurwitz), capped at 1 per group; a group
+//   sampled whole gives r_i exactly. The 95% upper bound adds the spread between
+//   draws and each group's own sampling variance, weighted by how often it was
+//   drawn (two-stage sampling); the latter counts each content's pairs as one
+//   cluster, and at least one pair, so that seeing none still leaves room
+//   above. What the sampled files show among themselves is the one figure from
+//   below. Once every file has been probed all three are the gain. Probe blocks
+//   cannot tell apart files differing only elsewhere, so none is a hard bound.
+struct GainEstimate {
+    uint64_t sizeGroups = 0;        // Size groups with two or more files.
+    ULONGLONG dataBytes = 0;        // Their total size.
+    ULONGLONG potentialGain = 0;    // W.
+    uint64_t draws = 0;
+    uint64_t groupsRead = 0;        // Distinct groups among the draws.
+    ULONGLONG bytesRead = 0;
+    bool exact = false;             // Every file was probed.
+    double upper = 0;               // Upper estimate of the gain.
+    double upperBound = 0;          // Its 95% upper confidence bound.
+    double found = 0;               // Gain among the sampled files.
+};
+
+void EstimateGain(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    double fraction, size_t filesPerGroup, GainEstimate& estimate)
+{
+    constexpr uint64_t MAX_DRAWS = 1000000;
+    std::vector<const std::vector<FileRecord>*> groups;
+    std::vector<double> cumulative;
+    uint64_t totalFiles = 0;
+    for (const auto& entry : sizeGroups)
     {
-        RightFileState state;
-        state.filePath = *it;
-        state.stream.open(state.filePath.c_str(), std::ios::binary);
-        if (!state.stream) {
-            std::wcerr << L"Error opening right file: " << state.filePath << std::endl;
+        if (entry.second.size() < 2)
             continue;
-        }
-        state.stream.seekg(totalBytesRead, std::ios::beg);
-        rightStates.push_back(std::move(state));
+        groups.push_back(&entry.second);
+        totalFiles += entry.second.size();
+        estimate.dataBytes += entry.first * entry.second.size();
+        estimate.potentialGain += PotentialGain(entry.first, entry.second.size());
+        cumulative.push_back(static_cast<double>(estimate.potentialGain));
     }
+    estimate.sizeGroups = groups.size();
+    if (groups.empty())
+        return;
 
-    char masterBuffer[BUFFER_SIZE];
+    // The sample of a drawn group: the first taken files of a shuffle of the
+    // group, kept sparse, so that it is a uniform random subset however it grew.
+    struct Sample {
+        std::unordered_map<size_t, size_t> moved;
+        size_t taken = 0;
+        size_t probed = 0;          // Those whose probe blocks could be read.
+        std::map<std::string, size_t> contents;
+        uint64_t draws = 0;
+    };
+    BenchRandom random(1);
+    std::map<size_t, Sample> samples;
+    uint64_t filesTaken = 0;
+    auto grow = [&](size_t i, Sample& sample) {
+        const std::vector<FileRecord>& files = *groups[i];
+        const size_t n = files.size();
+        const size_t target = (std::min)(n, sample.taken + (std::max)(size_t(2), filesPerGroup));
+        auto at = [&sample](size_t j) {
+            auto it = sample.moved.find(j);
+            return it == sample.moved.end() ? j : it->second;
+        };
+        for (; sample.taken < target; ++sample.taken, ++filesTaken)
+        {
+            const size_t j = sample.taken;
+            const size_t t = j + static_cast<size_t>(random.Below(n - j));
+            const FileRecord& file = files[at(t)];
+            sample.moved[t] = at(j);
 
-    //std::streamsize totalBytesRead = 0;
+            Fingerprint fingerprint;
+            if (!ComputeSampleHashes(file.path, file.size, fingerprint))
+                continue;
+            estimate.bytesRead += FINGERPRINT_SAMPLES * (std::min)(file.size, static_cast<ULONGLONG>(BUFFER_SIZE));
+            ++sample.contents[std::string(reinterpret_cast<const char*>(fingerprint.samples), sizeof(fingerprint.samples))];
+            ++sample.probed;
+        }
+    };
 
-    // Process the master file one chunk at a time.
-    while (true)
+    const double budget = fraction * estimate.dataBytes;
+    while ((estimate.bytesRead < budget || estimate.draws < 2) && filesTaken < totalFiles
+        && estimate.draws < MAX_DRAWS)
     {
-        master.read(masterBuffer, BUFFER_SIZE);
-        std::streamsize masterBytes = master.gcount();
-        if (masterBytes <= 0) // End of master file.
-            break;
+        const double pick = random.Unit() * cumulative.back();
+        const size_t i = (std::min)(groups.size() - 1,
+            static_cast<size_t>(std::upper_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin()));
+        Sample& sample = samples[i];
+        grow(i, sample);
+        ++sample.draws;
+        ++estimate.draws;
+    }
+    estimate.groupsRead = samples.size();
 
-        // Iterate over rightStates; if a right file fails comparison for this chunk,
-        // compute its key and remove it from the list.
-        for (auto it = rightStates.begin(); it != rightStates.end(); )
+    for (const auto& entry : samples)
+        estimate.found += static_cast<double>(groups[entry.first]->front().size) * (entry.second.probed - entry.second.contents.size());
+
+    // Every file probed: the gain is what the probes say, with no sampling error.
+    if (filesTaken == totalFiles)
+    {
+        estimate.exact = true;
+        estimate.upper = estimate.upperBound = estimate.found;
+        return;
+    }
+
+    const double draws = static_cast<double>(estimate.draws);
+    double sum = 0;
+    double sumOfSquares = 0;
+    double withinVariance = 0;
+    for (const auto& entry : samples)
+    {
+        const Sample& sample = entry.second;
+        const double n = static_cast<double>(groups[entry.first]->size());
+        const double probed = static_cast<double>(sample.probed);
+        double ratio = 0;
+        double variance = 0;
+        if (sample.taken == groups[entry.first]->size())
         {
-            char rightBuffer[BUFFER_SIZE];
-            it->stream.read(rightBuffer, masterBytes);
-            std::streamsize rightBytes = it->stream.gcount();
+            ratio = (probed - sample.contents.size()) / (n - 1);
+        }
+        else if (sample.probed >= 2)
+        {
+            // Contents are taken as independent clusters of identical pairs:
+            // the variance of their count is about the sum of squared cluster
+            // sizes, with the finite population correction.
+            double identicalPairs = 0;
+            double clusterSquares = 0;
+            for (const auto& content : sample.contents)
+            {
+                const double cluster = content.second * (content.second - 1.0) / 2;
+                identicalPairs += cluster;
+                clusterSquares += cluster * cluster;
+            }
+            const double pairs = probed * (probed - 1) / 2;
+            ratio = (std::min)(1.0, identicalPairs / pairs * n / 2);
+            variance = (std::min)(0.25, (n / 2) * (n / 2) * (std::max)(clusterSquares, 1.0) / (pairs * pairs) * (1 - probed / n));
+        }
+        const double share = sample.draws / draws;
+        sum += sample.draws * ratio;
+        sumOfSquares += sample.draws * ratio * ratio;
+        withinVariance += share * share * variance;
+    }
 
-            // If the right file didn't supply as many bytes as master, it's shorter or had a read error.
-            if (rightBytes != masterBytes) {
-                it = rightStates.erase(it);
+    const double mean = sum / draws;
+    const double betweenVariance = draws > 1 ? (std::max)(0.0, (sumOfSquares - draws * mean * mean) / (draws - 1)) : 0.0;
+    const double potential = static_cast<double>(estimate.potentialGain);
+    estimate.upper = potential * mean;
+    estimate.upperBound = potential * (std::min)(1.0, mean + 1.645 * std::sqrt(betweenVariance / draws + withinVariance));
+}
+//------------------------------------------------------------------------------
+// SimulatedGroup
+//   A random instance of a size group under the profile. Files are added one at
+//   a time: at the copy rate a file copies the content of an earlier file,
+//   otherwise it gets a new content that follows an earlier file's content up
+//   to a drawn mismatch offset and is its own from there. Mismatch offsets are
+//   then consistent across all pairs.
+class SimulatedGroup
+{
+public:
+    SimulatedGroup(size_t fileCount, ULONGLONG size, double copyRate, const MismatchProfile& profile, BenchRandom& random)
+        : m_size(size)
+    {
+        m_segments.push_back({ { 0, 0 } });
+        m_fileContent.push_back(0);
+        for (size_t i = 1; i < fileCount; ++i)
+        {
+            const size_t earlier = m_fileContent[random.Below(i)];
+            if (random.Unit() < copyRate)
+            {
+                m_fileContent.push_back(earlier);
                 continue;
             }
 
-            // Compare the current chunk.
-            int cmp = std::memcmp(masterBuffer, rightBuffer, static_cast<size_t>(masterBytes));
-            if (cmp != 0)
+            // The new content owns its bytes from the drawn offset; below it,
+            // whoever owns them in the earlier content.
+            const ULONGLONG offset = profile.DrawMismatch(size, random);
+            const size_t content = m_segments.size();
+            std::vector<Segment> segments;
+            for (const Segment& segment : m_segments[earlier])
             {
-                // Find first mismatching byte.
-                std::streamsize mismatchIndex = 0;
-                for (; mismatchIndex < masterBytes; ++mismatchIndex) {
-                    if (masterBuffer[mismatchIndex] != rightBuffer[mismatchIndex])
-                        break;
-                }
-                //int64_t diffKey = (cmp < 0 ? -1LL : 1LL) * (totalBytesRead + mismatchIndex + 1);
-                GroupKey key{ totalBytesRead + mismatchIndex, rightBuffer[mismatchIndex] };
-                keyGroups[key].push_back(it->filePath);
-                it = rightStates.erase(it);
+                if (segment.begin >= offset)
+                    break;
+                segments.push_back(segment);
             }
-            else {
-                ++it;
+            segments.push_back({ offset, content });
+            m_segments.push_back(std::move(segments));
+            m_fileContent.push_back(content);
+        }
+    }
+
+    size_t FileCount() const { return m_fileContent.size(); }
+
+    // First offset where files a and b differ, or the size if they do not.
+    ULONGLONG Mismatch(size_t a, size_t b) const
+    {
+        const std::vector<Segment>& left = m_segments[m_fileContent[a]];
+        const std::vector<Segment>& right = m_segments[m_fileContent[b]];
+        size_t i = 0;
+        while (i < left.size() && i < right.size() && left[i].begin == right[i].begin && left[i].owner == right[i].owner)
+            ++i;
+        if (i == left.size() && i == right.size())
+            return m_size;
+        const ULONGLONG leftBegin = i < left.size() ? left[i].begin : m_size;
+        const ULONGLONG rightBegin = i < right.size() ? right[i].begin : m_size;
+        return (std::min)(leftBegin, rightBegin);
+    }
+
+    // Content that provides the byte of file a at offset; equal owners mean equal bytes.
+    size_t OwnerAt(size_t a, ULONGLONG offset) const
+    {
+        const std::vector<Segment>& segments = m_segments[m_fileContent[a]];
+        size_t owner = 0;
+        for (const Segment& segment : segments)
+        {
+            if (segment.begin > offset)
+                break;
+            owner = segment.owner;
+        }
+        return owner;
+    }
+
+private:
+    struct Segment {
+        ULONGLONG begin;
+        size_t owner;
+    };
+
+    ULONGLONG m_size;
+    std::vector<std::vector<Segment>> m_segments;   // Per content, by increasing offset.
+    std::vector<size_t> m_fileContent;
+};
+
+//------------------------------------------------------------------------------
+// FitCopyRate()
+//   The copy rate at which random pairs from random simulated groups, drawn as
+//   SampleMismatchProfile() draws them, are identical as often as the sampled
+//   pairs were. Found by bisection with the same random draws for every rate.
+double FitCopyRate(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups, const MismatchProfile& profile)
+{
+    constexpr size_t GROUP_DRAWS = 256;
+    std::vector<size_t> counts;
+    for (const auto& entry : sizeGroups)
+    {
+        if (entry.second.size() >= 2)
+            counts.push_back(entry.second.size());
+    }
+    if (counts.empty())
+        return 0.0;
+
+    // Share of identical pairs in groups built by the copy process alone.
+    auto identicalShare = [&counts](double copyRate) {
+        BenchRandom random(1);
+        double share = 0;
+        std::vector<size_t> contentOf, members;
+        for (size_t draw = 0; draw < GROUP_DRAWS; ++draw)
+        {
+            const size_t n = counts[random.Below(counts.size())];
+            contentOf.assign(1, 0);
+            members.assign(1, 1);
+            for (size_t i = 1; i < n; ++i)
+            {
+                const size_t earlier = contentOf[random.Below(i)];
+                const bool copy = random.Unit() < copyRate;
+                contentOf.push_back(copy ? earlier : members.size());
+                if (copy)
+                    ++members[earlier];
+                else
+                    members.push_back(1);
             }
+            double pairs = 0;
+            for (size_t m : members)
+                pairs += static_cast<double>(m) * (m - 1);
+            share += pairs / (static_cast<double>(n) * (n - 1)) / GROUP_DRAWS;
         }
+        return share;
+    };
 
-        totalBytesRead += masterBytes;
+    const double target = static_cast<double>(profile.identical) / profile.pairs;
+    double low = 0.0, high = 1.0;
+    for (int i = 0; i < 20; ++i)
+    {
+        const double middle = (low + high) / 2;
+        if (identicalShare(middle) < target)
+            low = middle;
+        else
+            high = middle;
+    }
+    return (low + high) / 2;
+}
 
-        // If all right files have produced a difference, we're done.
-        if (rightStates.empty())
-            break;
+//------------------------------------------------------------------------------
+// StrategyBytes
+//   Bytes a size group costs to read under each compare strategy:
+//     pivot - GroupFilesByContentUsingMap(): every pass reads the pivot and each
+//             right file up to the chunk holding their mismatch, per batch;
+//     hash  - every file read in full;
+//     n-way - all files read in lockstep, each until the chunk after which no
+//             other file matches it.
+struct StrategyBytes {
+    double pivot = 0;
+    double hash = 0;
+    double nway = 0;
+};
+
+ULONGLONG RoundUpToChunk(ULONGLONG bytes, ULONGLONG chunk)
+{
+    return (bytes + chunk - 1) / chunk * chunk;
+}
+
+void SimulatePivotPasses(const SimulatedGroup& group, const std::vector<size_t>& files,
+    ULONGLONG start, ULONGLONG size, double& bytes)
+{
+    if (files.size() < 2)
+        return;
+
+    const ULONGLONG chunk = g_compareTuning->chunkSize;
+    std::map<std::pair<ULONGLONG, size_t>, std::vector<size_t>> keyGroups;
+    for (size_t first = 1; first < files.size(); first += g_compareTuning->maxBatch)
+    {
+        const size_t last = (std::min)(files.size(), first + g_compareTuning->maxBatch);
+        ULONGLONG pivotRead = 0;
+        for (size_t i = first; i < last; ++i)
+        {
+            const ULONGLONG mismatch = group.Mismatch(files[0], files[i]);
+            const ULONGLONG read = mismatch >= size ? size - start
+                : (std::min)(size - start, RoundUpToChunk(mismatch - start + 1, chunk));
+            bytes += read;
+            pivotRead = (std::max)(pivotRead, read);
+            if (mismatch < size)
+                keyGroups[{ mismatch, group.OwnerAt(files[i], mismatch) }].push_back(files[i]);
+        }
+        bytes += pivotRead;
     }
 
-    // For any right file that is still in the state list (i.e. no mismatch was found in the master part),
-    // check if it might have extra data.
-    for (auto& state : rightStates)
+    for (const auto& entry : keyGroups)
+        SimulatePivotPasses(group, entry.second, entry.first.first, size, bytes);
+}
+
+// Mean over a few random instances of the group.
+StrategyBytes EstimateStrategyBytes(size_t fileCount, ULONGLONG size, double copyRate,
+    const MismatchProfile& profile, BenchRandom& random)
+{
+    constexpr int INSTANCES = 4;
+    const ULONGLONG chunk = g_compareTuning->chunkSize;
+    StrategyBytes estimate;
+    estimate.hash = static_cast<double>(fileCount) * size;
+    for (int instance = 0; instance < INSTANCES; ++instance)
+    {
+        SimulatedGroup group(fileCount, size, copyRate, profile, random);
+        std::vector<size_t> files(fileCount);
+        for (size_t i = 0; i < fileCount; ++i)
+            files[i] = i;
+
+        double pivot = 0;
+        SimulatePivotPasses(group, files, 0, size, pivot);
+        estimate.pivot += pivot / INSTANCES;
+
+        // Read as strings of owners, the files in sorted order share their longest
+        // prefix with a neighbour; each is read past it.
+        std::sort(files.begin(), files.end(), [&group, size](size_t a, size_t b) {
+            const ULONGLONG mismatch = group.Mismatch(a, b);
+            return mismatch < size && group.OwnerAt(a, mismatch) < group.OwnerAt(b, mismatch);
+        });
+        for (size_t i = 0; i < fileCount; ++i)
+        {
+            ULONGLONG unique = 0;
+            if (i > 0)
+                unique = group.Mismatch(files[i - 1], files[i]);
+            if (i + 1 < fileCount)
+                unique = (std::max)(unique, group.Mismatch(files[i], files[i + 1]));
+            estimate.nway += static_cast<double>((std::min)(size, RoundUpToChunk(unique + 1, chunk))) / INSTANCES;
+        }
+    }
+    return estimate;
+}
+
+//------------------------------------------------------------------------------
+// MeasureNWayBytes()
+//   Reads a size group the n-way way and returns the bytes read: all files in
+//   lockstep, one chunk at a time, dropping each file once no other file has
+//   matched it so far.
+bool MeasureNWayBytes(const std::vector<FileRecord>& files, ULONGLONG& bytes)
+{
+    std::vector<std::unique_ptr<FileReader>> readers;
+    for (const FileRecord& file : files)
+    {
+        readers.push_back(g_fileSystem->OpenForRead(file.path));
+        if (!readers.back())
+            return false;
+    }
+
+    const ULONGLONG size = files[0].size;
+    const size_t chunk = g_compareTuning->chunkSize;
+    std::vector<char> buffers(files.size() * chunk);
+    std::vector<std::vector<size_t>> partitions(1);
+    for (size_t i = 0; i < files.size(); ++i)
+        partitions[0].push_back(i);
+
+    bytes = 0;
+    for (ULONGLONG offset = 0; offset < size && !partitions.empty(); offset += chunk)
     {
-        // Force state update.
-        state.stream.peek();
-        if (state.stream.eof()) {
-            // The file matches the master exactly.
-            duplicateGroup.push_back(state.filePath);
+        const std::streamsize length = static_cast<std::streamsize>((std::min)(static_cast<ULONGLONG>(chunk), size - offset));
+        std::vector<std::vector<size_t>> next;
+        for (std::vector<size_t>& partition : partitions)
+        {
+            for (size_t i : partition)
+            {
+                if (readers[i]->Read(&buffers[i * chunk], length) != length)
+                    return false;
+                bytes += static_cast<ULONGLONG>(length);
+            }
+            auto less = [&](size_t a, size_t b) {
+                return std::memcmp(&buffers[a * chunk], &buffers[b * chunk], static_cast<size_t>(length)) < 0;
+            };
+            std::sort(partition.begin(), partition.end(), less);
+            size_t begin = 0;
+            while (begin < partition.size())
+            {
+                size_t end = begin + 1;
+                while (end < partition.size() && !less(partition[begin], partition[end]))
+                    ++end;
+                if (end - begin > 1)
+                    next.emplace_back(partition.begin() + begin, partition.begin() + end);
+                begin = end;
+            }
         }
+        partitions = std::move(next);
     }
+    return true;
 }
 
-
 //------------------------------------------------------------------------------
-// GroupFilesByContentUsingMap()
-//    Group files (all of same size) by content using a hash map keyed by an
-//    int64_t comparison key produced against a chosen pivot.
-//    Duplicate groups (with two or more files) are recorded in duplicateGroups.
-void GroupFilesByContentUsingMap(const std::vector<std::wstring>& files,
-    std::vector<std::vector<std::wstring>>& duplicateGroups, std::streamsize totalBytesRead)
+// RunIoSimulation()
+//   Estimate for every size group the bytes each strategy would read, from the
+//   enumeration and the profile alone, and name the cheapest. With exact, also
+//   run the pivot and n-way reads on the files and print the estimates' error;
+//   hashing reads every byte, so its cost is known without reading. Groups of
+//   more than MAX_EXACT_FILES files are not measured, to stay within open-file
+//   limits.
+void RunIoSimulation(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups,
+    const MismatchProfile& profile, bool exact, std::wostream& out)
 {
-    if (files.size() < 2)
-        return;
+    constexpr size_t MAX_EXACT_FILES = 512;
+    auto totalBytesRead = []() {
+        uint64_t bytes = 0;
+        for (const PhaseCounters& counters : g_metrics->phases)
+            bytes += counters.bytesRead;
+        return bytes;
+    };
+    auto best = [](const StrategyBytes& bytes) {
+        if (bytes.pivot <= bytes.nway && bytes.pivot <= bytes.hash)
+            return L"pivot";
+        return bytes.nway <= bytes.hash ? L"nway" : L"hash";
+    };
 
-    std::vector<std::wstring> duplicateGroup;
+    const double copyRate = FitCopyRate(sizeGroups, profile);
+    const std::streamsize precision = out.precision(3);
+    const std::ios_base::fmtflags flags = out.setf(std::ios::fixed, std::ios::floatfield);
+    out << L"simulation version=1 pairs=" << profile.pairs << L" identical=" << profile.identical
+        << L" copy_rate=" << copyRate
+        << L" chunk=" << g_compareTuning->chunkSize << L" batch=" << g_compareTuning->maxBatch
+        << L" exact=" << (exact ? 1 : 0) << L'\n';
 
-    std::map<GroupKey, std::vector<std::wstring>> keyGroups;
-    // Use the first file as the pivot.
-    const std::wstring& pivot = files[0];
-    duplicateGroup.push_back(pivot); // the pivot is equal to itself.
-
-
-    // Limit batch size in the call to CompareFilesBufferedAdvanced.
-    constexpr size_t MAX_BATCH = 256;
-    auto rightBegin = std::next(files.begin());
-    auto rightEnd = files.end();
-    size_t totalRightFiles = std::distance(rightBegin, rightEnd);
-    size_t processed = 0;
-    while (processed < totalRightFiles)
+    BenchRandom random(1);
+    StrategyBytes estimated, measured, measuredEstimate;
+    for (const auto& entry : sizeGroups)
     {
-        // Calculate the iterators for the current batch.
-        auto batchBegin = rightBegin;
-        std::advance(batchBegin, processed);
-        size_t batchSize = (std::min)(totalRightFiles - processed, MAX_BATCH);
-        auto batchEnd = batchBegin;
-        std::advance(batchEnd, batchSize);
+        const std::vector<FileRecord>& files = entry.second;
+        if (files.size() < 2)
+            continue;
 
-        CompareFilesBufferedAdvanced(pivot, batchBegin, batchEnd, totalBytesRead, keyGroups, duplicateGroup);
-        processed += batchSize;
-    }
+        const StrategyBytes estimate = EstimateStrategyBytes(files.size(), entry.first, copyRate, profile, random);
+        estimated.pivot += estimate.pivot;
+        estimated.hash += estimate.hash;
+        estimated.nway += estimate.nway;
+        out << L"group size=" << entry.first << L" files=" << files.size()
+            << L" est_pivot_mb=" << estimate.pivot / 1048576.0 << L" est_nway_mb=" << estimate.nway / 1048576.0
+            << L" est_hash_mb=" << estimate.hash / 1048576.0 << L" best=" << best(estimate);
 
-    // Group with key 0 are duplicates of pivot.
-    if (duplicateGroup.size() > 1)
-        duplicateGroups.push_back(duplicateGroup);
+        if (exact && files.size() <= MAX_EXACT_FILES)
+        {
+            StrategyBytes actual;
+            actual.hash = estimate.hash;
+            const uint64_t bytesBefore = totalBytesRead();
+            std::vector<std::vector<FileRecord>> duplicateGroups;
+            GroupFilesByContentUsingMap(files, duplicateGroups, 0);
+            actual.pivot = static_cast<double>(totalBytesRead() - bytesBefore);
+            ULONGLONG nwayBytes = 0;
+            if (MeasureNWayBytes(files, nwayBytes))
+            {
+                actual.nway = static_cast<double>(nwayBytes);
+                measured.pivot += actual.pivot;
+                measured.hash += actual.hash;
+                measured.nway += actual.nway;
+                measuredEstimate.pivot += estimate.pivot;
+                measuredEstimate.hash += estimate.hash;
+                measuredEstimate.nway += estimate.nway;
+                out << L" pivot_mb=" << actual.pivot / 1048576.0 << L" nway_mb=" << actual.nway / 1048576.0
+                    << L" hash_mb=" << actual.hash / 1048576.0 << L" actual_best=" << best(actual);
+            }
+        }
+        out << L'\n';
+    }
 
-    // Process nonzero key groups recursively.
-    for (const auto& entry : keyGroups)
+    out << L"total est_pivot_mb=" << estimated.pivot / 1048576.0 << L" est_nway_mb=" << estimated.nway / 1048576.0
+        << L" est_hash_mb=" << estimated.hash / 1048576.0;
+    if (exact)
     {
-        //if (entry.first == 0)
-        //    continue;
-        if (entry.second.size() > 1)
-            GroupFilesByContentUsingMap(entry.second, duplicateGroups, entry.first.first);
+        auto error = [](double estimate, double actual) { return actual > 0 ? 100.0 * (estimate - actual) / actual : 0.0; };
+        out << L" pivot_mb=" << measured.pivot / 1048576.0 << L" nway_mb=" << measured.nway / 1048576.0
+            << L" hash_mb=" << measured.hash / 1048576.0
+            << L" pivot_error_pct=" << error(measuredEstimate.pivot, measured.pivot)
+            << L" nway_error_pct=" << error(measuredEstimate.nway, measured.nway);
     }
+    out << L'\n';
+    out.flush();
+    out.precision(precision);
+    out.flags(flags);
 }
 
 //------------------------------------------------------------------------------
-// ToLower()
-//    Converts a std::wstring to lower-case.
-std::wstring ToLower(const std::wstring& str)
-{
-    std::wstring lower = str;
-    std::transform(lower.begin(), lower.end(), lower.begin(), ::towlower);
-    return lower;
-}
-
-//------------------------------------------------------------------------------
-// HasExtension()
-//    Checks whether the file (by its full path) has an extension that matches (case-insensitive)
-//    the provided extension filter. The extension filter should include the dot (e.g. ".txt").
-//    Returns true if it matches or if extFilter is empty.
-bool HasExtension(const std::wstring& file, const std::wstring& extFilter)
+// DuplicateIndex
+//   The daemon's warm state: the size index of one root folder and the duplicate
+//   groups found in it. Each group has an id that stays valid until its size is
+//   regrouped. A rescan re-enumerates one subtree and regroups only the sizes
+//   whose files were removed or added.
+class DuplicateIndex
 {
-    if (extFilter.empty())
-        return true; // no filtering applied
+public:
+    // The root is kept in the form enumerated paths are built from, so that
+    // subtrees and paths from clients compare with them.
+    explicit DuplicateIndex(const ScanOptions& options) : m_options(options)
+    {
+        m_options.rootFolder = g_fileSystem->NormalizeRoot(options.rootFolder);
+    }
 
-    std::wstring lowerFile = ToLower(file);
-    std::wstring lowerFilter = ToLower(extFilter);
-    size_t pos = lowerFile.rfind(L'.');
-    if (pos == std::wstring::npos)
-        return false;
-    std::wstring fileExt = lowerFile.substr(pos);
-    return fileExt == lowerFilter;
-}
+    void Build()
+    {
+        m_sizeGroups.clear();
+        m_scanner.Enumerate(m_options, ScanCallbacks(), m_sizeGroups);
 
-//------------------------------------------------------------------------------
-// EnumerateFilesAndGroupBySize()
-//   Recursively enumerates all files under a given directory and, for each file
-//   that passes the optional extension filter, extracts its size from the
-//   WIN32_FIND_DATA and inserts the file path directly into a sizeGroups map.
-// Parameters:
-//   directory - The root directory to search.
-//   sizeGroups - Out parameter; a hash map where key is file size and value is a
-//                vector of file paths of that size.
-//   extFilter - Optional file extension filter (e.g., ".txt"). If empty, all files are included.
-void EnumerateFilesAndGroupBySize(const std::wstring& directory,
-    std::map<ULONGLONG, std::vector<std::wstring>>& sizeGroups,
-    const std::wstring& extFilter = L"")
-{
-    std::wstring searchPath = directory + L"\\*";
-    WIN32_FIND_DATA findData;
-    HANDLE hFind = FindFirstFile(searchPath.c_str(), &findData);
-    if (hFind == INVALID_HANDLE_VALUE)
-        return;
+        std::set<ULONGLONG> sizes;
+        for (const auto& entry : m_sizeGroups)
+            sizes.insert(entry.first);
+        Regroup(sizes);
+    }
 
-    do
+    // Replaces the files under subtree, which must lie under the root folder,
+    // with a fresh enumeration of it.
+    void Rescan(const std::wstring& subtree, std::wostream& out)
     {
-        // Exclude links. (They have the REPARSE_POINT flag)
-        if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
-            continue;
+        const std::wstring folder = g_fileSystem->NormalizeRoot(subtree);
+        const std::wstring lowerFolder = ToLower(folder);
+        if (!IsUnder(lowerFolder, ToLower(m_options.rootFolder)))
+        {
+            out << L"error: " << folder << L" is not under " << m_options.rootFolder << L'\n';
+            return;
+        }
 
-        std::wstring name = findData.cFileName;
-        if (name == L"." || name == L"..")
-            continue;
+        std::set<ULONGLONG> changed;
+        for (auto it = m_sizeGroups.begin(); it != m_sizeGroups.end();)
+        {
+            std::vector<FileRecord>& files = it->second;
+            const size_t before = files.size();
+            files.erase(std::remove_if(files.begin(), files.end(),
+                [&](const FileRecord& file) { return IsUnder(ToLower(file.path), lowerFolder); }), files.end());
+            if (files.size() != before)
+                changed.insert(it->first);
+            it = files.empty() ? m_sizeGroups.erase(it) : std::next(it);
+        }
 
-        std::wstring fullPath = directory + L"\\" + name;
-        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        ScanOptions options = m_options;
+        options.rootFolder = folder;
+        std::map<ULONGLONG, std::vector<FileRecord>> fresh;
+        m_scanner.Enumerate(options, ScanCallbacks(), fresh);
+        size_t files = 0;
+        for (auto& entry : fresh)
         {
-            // Recurse into the subdirectory.
-            EnumerateFilesAndGroupBySize(fullPath, sizeGroups, extFilter);
+            changed.insert(entry.first);
+            files += entry.second.size();
+            std::vector<FileRecord>& target = m_sizeGroups[entry.first];
+            std::move(entry.second.begin(), entry.second.end(), std::back_inserter(target));
         }
-        else
+
+        Regroup(changed);
+        out << L"rescanned files=" << files << L" sizes=" << changed.size() << L" groups=" << m_groups.size() << L'\n';
+    }
+
+    // Lists the groups of files of at least minSize bytes, in id order.
+    void ListGroups(ULONGLONG minSize, std::wostream& out) const
+    {
+        for (const auto& entry : m_groups)
         {
-            if (HasExtension(fullPath, extFilter))
-            {
-                // Compute file size directly from findData.
-                ULONGLONG size = (static_cast<ULONGLONG>(findData.nFileSizeHigh) << 32) |
-                    findData.nFileSizeLow;
+            const IndexedGroup& group = entry.second;
+            if (group.size < minSize)
+                continue;
+            out << L"group id=" << entry.first << L" size=" << group.size << L" files=" << group.files.size()
+                << L" gain=" << group.size * (group.files.size() - 1) << L'\n';
+            for (const auto& file : group.files)
+                out << L"  " << file.path << L'\n';
+        }
+    }
 
-                if (size < MIN_SIZE_TO_CONSIDER)
-                    continue;
+    void Lookup(const std::wstring& path, std::wostream& out) const
+    {
+        auto it = m_groupOfPath.find(ToLower(g_fileSystem->NormalizeRoot(path)));
+        if (it == m_groupOfPath.end())
+        {
+            out << L"not-duplicate\n";
+            return;
+        }
+        const IndexedGroup& group = m_groups.at(it->second);
+        out << L"duplicate group=" << it->second << L" size=" << group.size << L'\n';
+        for (const auto& file : group.files)
+            out << L"  " << file.path << L'\n';
+    }
 
-                // Insert the file path into the appropriate size bucket.
-                sizeGroups[size].push_back(fullPath);
-            }
+    // Deduplicates one group and drops it from the index: its files are no
+    // longer separate copies. Either way their records are re-read, since a
+    // linked file takes on the master's id and times.
+    void Deduplicate(uint64_t id, const DedupOptions& dedupOptions, std::wostream& out)
+    {
+        auto it = m_groups.find(id);
+        if (it == m_groups.end())
+        {
+            out << L"error: no group " << id << L'\n';
+            return;
         }
-    } while (FindNextFile(hFind, &findData) != 0);
+        const bool deduplicated = m_scanner.Deduplicate({ it->second.files }, dedupOptions, ScanCallbacks(), out);
+        Restat(it->second);
+        if (!deduplicated && it->second.files.size() >= 2)
+        {
+            out << L"error: group " << id << L" failed\n";
+            return;
+        }
+        std::vector<uint64_t>& ids = m_groupsOfSize[it->second.size];
+        ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+        Forget(it->second);
+        m_groups.erase(it);
+        if (deduplicated)
+            out << L"deduplicated group=" << id << L'\n';
+        else
+            out << L"error: group " << id << L" failed and is gone\n";
+    }
 
-    FindClose(hFind);
-}
+private:
+    struct IndexedGroup {
+        ULONGLONG size = 0;
+        std::vector<FileRecord> files;
+    };
 
-//------------------------------------------------------------------------------
-// GetFileUniqueIdAndLinkCount
-//   Opens a file and retrieves its unique identifier and link count using the
-//   BY_HANDLE_FILE_INFORMATION structure.
-// Parameters:
-//   filePath - the full file path
-//   uniqueId - (out) unique identifier (constructed from nFileIndexHigh/Low)
-//   numLinks - (out) number of hard links for the file
-// Returns:
-//   true on success, false on failure.
-bool GetFileUniqueIdAndLinkCount(const std::wstring& filePath,
-    ULONGLONG& uniqueId,
-    DWORD& numLinks)
-{
-    HANDLE hFile = CreateFileW(filePath.c_str(),
-        0,  // No need for read/write permission
-        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_FLAG_BACKUP_SEMANTICS,  // Needed for directories, not used here but safe
-        nullptr);
-    if (hFile == INVALID_HANDLE_VALUE)
+    // Whether lowerPath is lowerFolder or lies below it; both lower-case and
+    // normalized, so only a drive root ends in a separator.
+    static bool IsUnder(const std::wstring& lowerPath, const std::wstring& lowerFolder)
     {
-        std::wcerr << L"Failed to open file: " << filePath
-            << L", error: " << GetLastError() << std::endl;
-        return false;
+        return lowerPath.compare(0, lowerFolder.size(), lowerFolder) == 0
+            && (lowerPath.size() == lowerFolder.size() || lowerFolder.back() == L'\\'
+                || lowerPath[lowerFolder.size()] == L'\\');
     }
 
-    BY_HANDLE_FILE_INFORMATION fileInfo = { 0 };
-    if (!GetFileInformationByHandle(hFile, &fileInfo))
+    void Forget(const IndexedGroup& group)
     {
-        std::wcerr << L"Failed to get file information for: " << filePath
-            << L", error: " << GetLastError() << std::endl;
-        CloseHandle(hFile);
-        return false;
+        for (const auto& file : group.files)
+            m_groupOfPath.erase(ToLower(file.path));
     }
 
-    CloseHandle(hFile);
-    uniqueId = (static_cast<ULONGLONG>(fileInfo.nFileIndexHigh) << 32) | fileInfo.nFileIndexLow;
-    numLinks = fileInfo.nNumberOfLinks;
-    return true;
+    // Re-reads the records of the files of group, in the size index and in the
+    // group itself. A file that is gone or no longer of the group's size is
+    // dropped from both until a rescan finds it again.
+    void Restat(IndexedGroup& group)
+    {
+        auto entry = m_sizeGroups.find(group.size);
+        if (entry == m_sizeGroups.end())
+            return;
+
+        std::unordered_map<std::wstring, const FileRecord*> fresh;
+        for (const auto& file : group.files)
+            fresh[ToLower(file.path)] = nullptr;
+        std::vector<FileRecord>& files = entry->second;
+        files.erase(std::remove_if(files.begin(), files.end(), [&](FileRecord& file) {
+            if (fresh.find(ToLower(file.path)) == fresh.end())
+                return false;
+            return !g_fileSystem->QueryFileState(file.path, file) || file.size != group.size;
+        }), files.end());
+        for (const auto& file : files)
+        {
+            auto known = fresh.find(ToLower(file.path));
+            if (known != fresh.end())
+                known->second = &file;
+        }
+
+        std::vector<FileRecord> kept;
+        for (const auto& file : group.files)
+        {
+            const FileRecord* record = fresh[ToLower(file.path)];
+            if (record)
+                kept.push_back(*record);
+            else
+                m_groupOfPath.erase(ToLower(file.path));
+        }
+        group.files = std::move(kept);
+        if (files.empty())
+            m_sizeGroups.erase(entry);
+    }
+
+    // Drops the groups of the given sizes and groups their files anew.
+    void Regroup(const std::set<ULONGLONG>& sizes)
+    {
+        std::map<ULONGLONG, std::vector<FileRecord>> pending;
+        for (ULONGLONG size : sizes)
+        {
+            auto old = m_groupsOfSize.find(size);
+            if (old != m_groupsOfSize.end())
+            {
+                for (uint64_t id : old->second)
+                {
+                    Forget(m_groups[id]);
+                    m_groups.erase(id);
+                }
+                m_groupsOfSize.erase(old);
+            }
+
+            auto entry = m_sizeGroups.find(size);
+            if (entry != m_sizeGroups.end() && entry->second.size() >= 2)
+                pending.insert(*entry);
+        }
+
+        ScanCallbacks callbacks;
+        callbacks.onGroup = [&](ULONGLONG size, const std::vector<FileRecord>& files) {
+            const uint64_t id = m_nextId++;
+            for (const auto& file : files)
+                m_groupOfPath[ToLower(file.path)] = id;
+            m_groupsOfSize[size].push_back(id);
+            m_groups[id] = IndexedGroup{ size, files };
+        };
+        ScanSummary summary;
+        m_scanner.Group(pending, m_options, callbacks, summary);
+    }
+
+    ScanOptions m_options;
+    DuplicateScanner m_scanner;
+    std::map<ULONGLONG, std::vector<FileRecord>> m_sizeGroups;
+    std::map<uint64_t, IndexedGroup> m_groups;
+    std::map<ULONGLONG, std::vector<uint64_t>> m_groupsOfSize;
+    std::unordered_map<std::wstring, uint64_t> m_groupOfPath;
+    uint64_t m_nextId = 1;
+};
+
+//------------------------------------------------------------------------------
+// GetPipePath()
+//   Named pipe path of a daemon name given with --daemon or --query.
+std::wstring GetPipePath(const std::wstring& name)
+{
+    return L"\\\\.\\pipe\\" + name;
 }
 
 //------------------------------------------------------------------------------
-// DeduplicateGroup
-//   Given a vector of file paths that are known duplicates, this routine chooses the first
-//   file as the master copy and replaces the other duplicates with hard links to that master,
-//   provided they are not already hard links to the master.
-//   Returns true if the routine processed the group (errors are logged).
-bool DeduplicateGroup(const std::vector<std::wstring>& duplicateGroup)
+// RunDaemon()
+//   Builds a DuplicateIndex of options.rootFolder and answers requests on a
+//   local named pipe until told to stop. A client connects, writes one UTF-8
+//   request line as a pipe message, reads the UTF-8 reply message and closes:
+//     rescan <folder>        re-enumerate a subtree and regroup what changed
+//     groups [min-size]      the groups of files of at least min-size bytes
+//     is-duplicate <path>    the group holding path, if any
+//     dedup <id>             deduplicate one group
+//     stop                   shut the daemon down
+//   Requests are served one at a time, so none sees a half-updated index.
+//   Pipe I/O is overlapped and every wait on a client times out, so a client
+//   that connects and then stalls is dropped instead of blocking the rest.
+bool RunDaemon(const std::wstring& name, const ScanOptions& options, const DedupOptions& dedupOptions, std::wostream& log)
 {
-    if (duplicateGroup.size() < 2)
+    constexpr DWORD PIPE_BUFFER_SIZE = 64 * 1024;
+    constexpr size_t MAX_REQUEST_SIZE = 64 * 1024;
+    constexpr DWORD CLIENT_TIMEOUT_MS = 30000;
+
+    const std::wstring pipePath = GetPipePath(name);
+    HANDLE pipe = CreateNamedPipeW(pipePath.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, nullptr);
+    if (pipe == INVALID_HANDLE_VALUE)
     {
-        std::wcerr << L"No duplicates in group to deduplicate." << std::endl;
-        return true;
+        std::wcerr << L"Failed to create pipe " << pipePath << L" (error " << GetLastError() << L")." << std::endl;
+        return false;
     }
-
-    // Get the unique file id of the master file (first in group).
-    const std::wstring master = duplicateGroup[0];
-    ULONGLONG masterId = 0;
-    DWORD masterLinks = 0;
-    if (!GetFileUniqueIdAndLinkCount(master, masterId, masterLinks))
+    HANDLE event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!event)
     {
-        std::wcerr << L"Failed to get unique ID for master file: " << master << std::endl;
+        std::wcerr << L"Failed to create an event (error " << GetLastError() << L")." << std::endl;
+        CloseHandle(pipe);
         return false;
     }
-    std::wcout << L"Master file: " << master << std::endl;
 
-    // Process each duplicate file (skip the master).
-    for (size_t i = 1; i < duplicateGroup.size(); ++i)
+    // Finishes an overlapped call on the pipe that returned started, waiting at
+    // most timeout ms; a call still pending then is cancelled and fails with
+    // WAIT_TIMEOUT. A partial message read fails with ERROR_MORE_DATA.
+    auto finish = [&](BOOL started, OVERLAPPED& overlapped, DWORD timeout, DWORD& bytes)
     {
-        const std::wstring& dupFile = duplicateGroup[i];
+        bytes = 0;
+        if (!started && GetLastError() != ERROR_IO_PENDING && GetLastError() != ERROR_MORE_DATA)
+            return false;
+        if (WaitForSingleObject(event, timeout) != WAIT_OBJECT_0)
+        {
+            CancelIo(pipe);
+            GetOverlappedResult(pipe, &overlapped, &bytes, TRUE);
+            SetLastError(WAIT_TIMEOUT);
+            return false;
+        }
+        return GetOverlappedResult(pipe, &overlapped, &bytes, FALSE) != FALSE;
+    };
 
-        // Get the unique file id for this duplicate.
-        ULONGLONG dupId = 0;
-        DWORD dupLinks = 0;
-        if (!GetFileUniqueIdAndLinkCount(dupFile, dupId, dupLinks))
+    DuplicateIndex index(options);
+    const auto start = std::chrono::steady_clock::now();
+    index.Build();
+    log << L"Indexed " << options.rootFolder << L" in "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+        << L" s; serving " << pipePath << std::endl;
+
+    bool running = true;
+    while (running)
+    {
+        OVERLAPPED overlapped = {};
+        overlapped.hEvent = event;
+        DWORD bytes = 0;
+        if (!ConnectNamedPipe(pipe, &overlapped) && GetLastError() != ERROR_PIPE_CONNECTED
+            && !finish(FALSE, overlapped, INFINITE, bytes))
         {
-            std::wcerr << L"Failed to get unique ID for file: " << dupFile << std::endl;
-            continue;
+            std::wcerr << L"Failed to accept a client (error " << GetLastError() << L")." << std::endl;
+            break;
         }
 
-        // If this duplicate already shares the same unique id as the master,
-        // then it is already a hard link to the master. Skip it.
-        if (dupId == masterId)
+        // The request is the first line of one message.
+        std::string request;
+        char buffer[4096];
+        bool received = false;
+        while (!received && request.size() < MAX_REQUEST_SIZE)
+        {
+            overlapped = {};
+            overlapped.hEvent = event;
+            received = finish(ReadFile(pipe, buffer, sizeof(buffer), nullptr, &overlapped), overlapped, CLIENT_TIMEOUT_MS, bytes);
+            request.append(buffer, bytes);
+            if (!received && GetLastError() != ERROR_MORE_DATA)
+                break;
+        }
+        if (!received)
         {
-            std::wcout << L"Skipping file (already linked): " << dupFile << std::endl;
+            log << L"Dropped a client that sent no request (error " << GetLastError() << L")." << std::endl;
+            DisconnectNamedPipe(pipe);
             continue;
         }
+        request = request.substr(0, request.find('\n'));
+        if (!request.empty() && request.back() == '\r')
+            request.pop_back();
 
-        // Delete the duplicate file.
-        if (!DeleteFileW(dupFile.c_str()))
+        const std::wstring line = FromUtf8(request);
+        const size_t separator = line.find(L' ');
+        const std::wstring command = line.substr(0, separator);
+        const std::wstring argument = separator == std::wstring::npos ? std::wstring() : line.substr(separator + 1);
+
+        const auto requestStart = std::chrono::steady_clock::now();
+        std::wostringstream reply;
+        try
         {
-            DWORD delErr = GetLastError();
-            std::wcerr << L"Error deleting duplicate file: " << dupFile
-                << L". Error code: " << delErr << std::endl;
-            continue;
+            if (command == L"rescan" && !argument.empty())
+                index.Rescan(argument, reply);
+            else if (command == L"groups")
+                index.ListGroups(argument.empty() ? 0 : std::stoull(argument), reply);
+            else if (command == L"is-duplicate" && !argument.empty())
+                index.Lookup(argument, reply);
+            else if (command == L"dedup" && !argument.empty())
+                index.Deduplicate(std::stoull(argument), dedupOptions, reply);
+            else if (command == L"stop")
+            {
+                reply << L"stopping\n";
+                running = false;
+            }
+            else
+                reply << L"error: unknown request: " << line << L'\n';
         }
+        catch (const std::exception&)
+        {
+            reply << L"error: bad argument: " << argument << L'\n';
+        }
+        log << command << L" " << argument << L" ("
+            << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - requestStart).count()
+            << L" ms)" << std::endl;
 
-        // Create a hard link from the duplicate's path pointing to the master.
-        if (!CreateHardLinkW(dupFile.c_str(), master.c_str(), nullptr))
+        // The reply is one message. Disconnecting discards what the client has
+        // not read yet, so wait for it to close its end first.
+        const std::string message = ToUtf8(reply.str());
+        overlapped = {};
+        overlapped.hEvent = event;
+        if (finish(WriteFile(pipe, message.data(), static_cast<DWORD>(message.size()), nullptr, &overlapped), overlapped, CLIENT_TIMEOUT_MS, bytes)
+            && bytes == message.size())
         {
-            DWORD hlErr = GetLastError();
-            std::wcerr << L"Error creating hard link for: " << dupFile
-                << L" pointing to: " << master
-                << L". Error code: " << hlErr << std::endl;
-            continue;
+            overlapped = {};
+            overlapped.hEvent = event;
+            if (finish(ReadFile(pipe, buffer, 1, nullptr, &overlapped), overlapped, CLIENT_TIMEOUT_MS, bytes)
+                || GetLastError() != ERROR_BROKEN_PIPE)
+            {
+                log << L"Dropped a client that did not close (error " << GetLastError() << L")." << std::endl;
+            }
         }
         else
         {
-            std::wcout << L"Replaced duplicate " << dupFile << L" with hard link to " << master << std::endl;
+            log << L"Dropped a client that did not read its reply (error " << GetLastError() << L")." << std::endl;
         }
+        DisconnectNamedPipe(pipe);
     }
-    return true;
+
+    CloseHandle(event);
+    CloseHandle(pipe);
+    return !running;
+}
+
+//------------------------------------------------------------------------------
+// QueryDaemon()
+//   Sends one request to a running daemon and writes its reply to out.
+bool QueryDaemon(const std::wstring& name, const std::wstring& request, std::wostream& out)
+{
+    const std::wstring pipePath = GetPipePath(name);
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (;;)
+    {
+        pipe = CreateFileW(pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE || GetLastError() != ERROR_PIPE_BUSY)
+            break;
+        // The daemon is answering someone else.
+        if (!WaitNamedPipeW(pipePath.c_str(), 30000))
+            break;
+    }
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        std::wcerr << L"Failed to connect to " << pipePath << L" (error " << GetLastError() << L")." << std::endl;
+        return false;
+    }
+
+    // The request and the reply are one message each.
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    const std::string bytes = ToUtf8(request) + "\n";
+    DWORD written = 0;
+    bool ok = SetNamedPipeHandleState(pipe, &mode, nullptr, nullptr)
+        && WriteFile(pipe, bytes.data(), static_cast<DWORD>(bytes.size()), &written, nullptr)
+        && written == bytes.size();
+
+    std::string reply;
+    char buffer[4096];
+    while (ok)
+    {
+        DWORD bytesRead = 0;
+        const bool whole = ReadFile(pipe, buffer, sizeof(buffer), &bytesRead, nullptr) != FALSE;
+        reply.append(buffer, bytesRead);
+        if (whole)
+            break;
+        ok = GetLastError() == ERROR_MORE_DATA;
+    }
+    CloseHandle(pipe);
+
+    out << FromUtf8(reply);
+    out.flush();
+    return ok && reply.compare(0, 7, "error: ") != 0;
 }
 
+#ifndef HDF_LIBRARY
+
 //------------------------------------------------------------------------------
 // main()
 //    Entry point: enumerates files from a root folder and optionally filters by extension,
@@ -397,74 +7396,450 @@ bool DeduplicateGroup(const std::vector<std::wstring>& duplicateGroup)
 //    and outputs the duplicate file groups.
 int wmain(int argc, wchar_t* argv[])
 {
-    _setmode(_fileno(stdout), _O_U16TEXT);
+    // Options start with "--"; the rest are positional arguments.
+    std::vector<std::wstring> positional;
+    std::wstring cachePath;
+    bool trustCache = false;
+    std::wstring planPath;
+    std::wstring applyPath;
+    std::wstring outputFormat = L"human";
+    std::wstring outputPath;
+    DedupOptions dedupOptions;
+    bool printMetrics = false;
+    std::wstring metricsPath;
+    std::wstring tracePath;
+    std::wstring benchPath;
+    BenchConfig benchConfig;
+    std::unique_ptr<VirtualIoCost> virtualIo;
+    std::wstring sampleProfilePath;
+    uint64_t samplePairs = 1000;
+    std::wstring simulateProfilePath;
+    bool exactSimulation = false;
+    double estimateFraction = 0;
+    size_t estimateFiles = 16;
+    bool benchConfigValid = true;
+    bool numbersValid = true;
+    std::wstring microbenchPath;
+    MicrobenchConfig microbenchConfig;
+    std::wstring daemonName;
+    std::wstring queryName;
+    std::wstring buildIndexPath;
+    std::wstring lookupIndexPath;
+    bool addNew = false;
+    ScanOptions scanOptions;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring arg = argv[i];
+        // The value after an option's prefix; a malformed one invalidates the command line.
+        auto number = [&](size_t prefix) {
+            ULONGLONG value = 0;
+            numbersValid &= ParseNumber(arg.substr(prefix), value);
+            return value;
+        };
+        auto fraction = [&](size_t prefix) {
+            double value = 0;
+            numbersValid &= ParseNumber(arg.substr(prefix), value);
+            return value;
+        };
+        if (arg.compare(0, 8, L"--cache=") == 0)
+            cachePath = arg.substr(8);
+        else if (arg == L"--trust-cache")
+            trustCache = true;
+        else if (arg.compare(0, 7, L"--plan=") == 0)
+            planPath = arg.substr(7);
+        else if (arg.compare(0, 8, L"--apply=") == 0)
+            applyPath = arg.substr(8);
+        else if (arg.compare(0, 9, L"--format=") == 0)
+            outputFormat = arg.substr(9);
+        else if (arg.compare(0, 9, L"--output=") == 0)
+            outputPath = arg.substr(9);
+        else if (arg == L"--clone")
+            dedupOptions.backend = DedupBackend::CloneExtents;
+        else if (arg.compare(0, 16, L"--dedup-threads=") == 0)
+            dedupOptions.threads = static_cast<unsigned>(number(16));
+        else if (arg.compare(0, 14, L"--max-per-dir=") == 0)
+            dedupOptions.maxPerDirectory = (std::max)(1u, static_cast<unsigned>(number(14)));
+        else if (arg.compare(0, 17, L"--max-per-device=") == 0)
+            dedupOptions.maxPerDevice = (std::max)(1u, static_cast<unsigned>(number(17)));
+        else if (arg == L"--metrics")
+            printMetrics = true;
+        else if (arg.compare(0, 15, L"--metrics-file=") == 0)
+            metricsPath = arg.substr(15);
+        else if (arg.compare(0, 8, L"--trace=") == 0)
+            tracePath = arg.substr(8);
+        else if (arg.compare(0, 8, L"--bench=") == 0)
+            benchPath = arg.substr(8);
+        else if (arg.compare(0, 15, L"--bench-config=") == 0)
+            benchConfigValid &= ParseBenchConfig(arg.substr(15), benchConfig);
+        else if (arg == L"--vfs" || arg.compare(0, 6, L"--vfs=") == 0)
+        {
+            virtualIo = std::make_unique<VirtualIoCost>();
+            if (arg.size() > 6)
+                benchConfigValid &= ParseVirtualIoCost(arg.substr(6), *virtualIo);
+        }
+        else if (arg.compare(0, 13, L"--microbench=") == 0)
+            microbenchPath = arg.substr(13);
+        else if (arg.compare(0, 20, L"--microbench-config=") == 0)
+            benchConfigValid &= ParseMicrobenchConfig(arg.substr(20), microbenchConfig);
+        else if (arg.compare(0, 20, L"--sample-mismatches=") == 0)
+            sampleProfilePath = arg.substr(20);
+        else if (arg.compare(0, 15, L"--sample-pairs=") == 0)
+            samplePairs = number(15);
+        else if (arg.compare(0, 11, L"--simulate=") == 0)
+            simulateProfilePath = arg.substr(11);
+        else if (arg == L"--exact")
+            exactSimulation = true;
+        else if (arg.compare(0, 11, L"--estimate=") == 0)
+            estimateFraction = fraction(11);
+        else if (arg.compare(0, 17, L"--estimate-files=") == 0)
+            estimateFiles = static_cast<size_t>(number(17));
+        else if (arg.compare(0, 9, L"--daemon=") == 0)
+            daemonName = arg.substr(9);
+        else if (arg.compare(0, 8, L"--query=") == 0)
+            queryName = arg.substr(8);
+        else if (arg.compare(0, 10, L"--include=") == 0)
+            scanOptions.includeGlobs.push_back(arg.substr(10));
+        else if (arg.compare(0, 10, L"--exclude=") == 0)
+            scanOptions.excludeGlobs.push_back(arg.substr(10));
+        else if (arg.compare(0, 14, L"--exclude-dir=") == 0)
+            scanOptions.excludeDirectories.push_back(arg.substr(14));
+        else if (arg.compare(0, 11, L"--external=") == 0)
+            scanOptions.scratchFolder = arg.substr(11);
+        else if (arg.compare(0, 14, L"--time-budget=") == 0)
+            scanOptions.timeBudgetSeconds = number(14);
+        else if (arg.compare(0, 14, L"--read-budget=") == 0)
+            scanOptions.readBudget = number(14) * 1024 * 1024;
+        else if (arg.compare(0, 13, L"--checkpoint=") == 0)
+            scanOptions.checkpointPath = arg.substr(13);
+        else if (arg.compare(0, 16, L"--memory-budget=") == 0)
+            scanOptions.memoryBudget = (std::max)(size_t(1), static_cast<size_t>(number(16))) * 1024 * 1024;
+        else if (arg.compare(0, 11, L"--min-size=") == 0)
+            scanOptions.minSize = number(11);
+        else if (arg.compare(0, 11, L"--max-size=") == 0)
+            scanOptions.maxSize = number(11);
+        else if (arg.compare(0, 14, L"--build-index=") == 0)
+            buildIndexPath = arg.substr(14);
+        else if (arg.compare(0, 9, L"--lookup=") == 0)
+            lookupIndexPath = arg.substr(9);
+        else if (arg == L"--add-new")
+            addNew = true;
+        else if (arg.compare(0, 13, L"--chunk-size=") == 0)
+            g_compareTuning->chunkSize = (std::max)(size_t(1), static_cast<size_t>(number(13)));
+        else if (arg.compare(0, 12, L"--max-batch=") == 0)
+            g_compareTuning->maxBatch = (std::max)(size_t(1), static_cast<size_t>(number(12)));
+        else if (arg.compare(0, 19, L"--small-file-limit=") == 0)
+            g_compareTuning->smallFileLimit = number(19);
+        else
+            positional.push_back(arg);
+    }
 
-    if (argc < 2)
+    // Machine-readable output on standard output leaves it in binary mode; all
+    // human-readable messages then go to standard error.
+    const bool humanOutput = outputFormat == L"human";
+    const bool machineOnStdout = !humanOutput && outputPath.empty();
+    _setmode(_fileno(stdout), machineOnStdout ? _O_BINARY : _O_U16TEXT);
+    std::wostream& log = machineOnStdout ? std::wcerr : std::wcout;
+
+    if ((positional.empty() && applyPath.empty() && benchPath.empty() && microbenchPath.empty()) || (trustCache && cachePath.empty())
+        || !benchConfigValid || !numbersValid
+        || (!scanOptions.scratchFolder.empty() && (!sampleProfilePath.empty() || !simulateProfilePath.empty() || estimateFraction != 0 || !cachePath.empty()))
+        || estimateFraction < 0 || estimateFraction > 1
+        || (!planPath.empty() && !applyPath.empty())
+        || (!humanOutput && outputFormat != L"jsonl" && outputFormat != L"binary"))
     {
-        std::wcerr << L"Usage: " << argv[0] << L" <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"Usage: " << argv[0] << L" [--cache=<file> [--trust-cache]] [--plan=<file>]"
+            << L" [--format=human|jsonl|binary] [--output=<file>] [--clone]"
+            << L" [--dedup-threads=N] [--max-per-dir=N] [--max-per-device=N]"
+            << L" [--chunk-size=N] [--max-batch=N] [--small-file-limit=N]"
+            << L" [--include=<glob>]... [--exclude=<glob>]... [--exclude-dir=<glob>]... [--min-size=N] [--max-size=N]"
+            << L" [--external=<scratch_folder> [--memory-budget=MB]] [--checkpoint=<file>]"
+            << L" [--time-budget=SECONDS] [--read-budget=MB]"
+            << L" [--metrics] [--metrics-file=<file>] [--trace=<file>] <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --apply=<file> [--clone]"
+            << L" [--dedup-threads=N] [--max-per-dir=N] [--max-per-device=N]"
+            << L" [--metrics] [--metrics-file=<file>] [--trace=<file>]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --bench=<scratch_folder> [--bench-config=key=value,...]"
+            << L" [--vfs[=key=value,...]] [--clone] [--dedup-threads=N] [--max-per-dir=N] [--max-per-device=N]" << std::endl;
+        std::wcerr << L"         bench keys: seed, files, min-size, max-size, dup-ratio, contents-per-size,"
+            << L" mismatch=head|middle|tail, sparse-ratio, link-ratio, depth, fanout, runs" << std::endl;
+        std::wcerr << L"         vfs keys (in-memory tree): list-us, open-us, read-us, mbps, wait=0|1" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --microbench=<scratch_folder> [--microbench-config=key=v1:v2,...]" << std::endl;
+        std::wcerr << L"         microbench keys: seed, runs, size, rights, batch, chunk,"
+            << L" mismatch=head:middle:tail:uniform:none, kernel=buffered:hole-aware:hash" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --sample-mismatches=<profile> [--sample-pairs=N] <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --estimate=<fraction> [--estimate-files=N] <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --simulate=<profile> [--exact] [--chunk-size=N] [--max-batch=N]"
+            << L" <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --daemon=<name> [--cache=<file> [--trust-cache]] [--clone]"
+            << L" [--dedup-threads=N] <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --query=<name> rescan <folder> | groups [min_size]"
+            << L" | is-duplicate <path> | dedup <id> | stop" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --build-index=<file> [--cache=<file>] <root_folder> [extension_filter]" << std::endl;
+        std::wcerr << L"       " << argv[0] << L" --lookup=<index_file> [--add-new] <file>..." << std::endl;
+        std::wcerr << L"         extension_filter: one or more extensions, e.g. .jpg,.png;"
+            << L" the filter options apply to every mode that scans a folder" << std::endl;
+        std::wcerr << L"         --exclude-dir: a directory name such as .git or node_modules,"
+            << L" or a path glob such as C:\\Data\\*\\cache" << std::endl;
         std::wcerr << L"Example: " << argv[0] << L" C:\\MyFolder .txt" << std::endl;
         return 1;
     }
 
-    std::wstring rootFolder = argv[1];
-    std::wstring extFilter;
-    if (argc >= 3)
-    {
-        extFilter = argv[2];
-    }
+    if (!tracePath.empty())
+        g_tracer.Enable();
 
-    std::map<ULONGLONG, std::vector<std::wstring>> sizeGroups;
-    EnumerateFilesAndGroupBySize(rootFolder, sizeGroups, extFilter);
+    // Every exit after this point reports the metrics and the trace collected so far.
+    auto finish = [&](int exitCode) {
+        if (printMetrics)
+            PrintMetrics(g_processMetrics, std::wcerr);
+        if (!metricsPath.empty() && !WriteMetricsTextfile(g_processMetrics, metricsPath))
+            std::wcerr << L"Failed to write metrics: " << metricsPath << std::endl;
+        if (!tracePath.empty() && !g_tracer.Write(tracePath))
+            std::wcerr << L"Failed to write trace: " << tracePath << std::endl;
+        return exitCode;
+    };
 
-    std::vector<std::vector<std::wstring>> allDuplicateGroups;
+    // Generate a synthetic tree and time every phase on it.
+    if (!benchPath.empty())
+        return finish(RunBenchmark(benchPath, benchConfig, dedupOptions, virtualIo.get(), log) ? 0 : 1);
 
-    ULONGLONG gain = 0;
+    // Time the compare kernels across batch and chunk sizes.
+    if (!microbenchPath.empty())
+        return finish(RunMicrobenchmark(microbenchPath, microbenchConfig, log) ? 0 : 1);
 
-    // For each same-size group (excluding groups with only one file) group by content.
-    for (const auto& entry : sizeGroups)
+    // Send one request to a running daemon.
+    if (!queryName.empty())
     {
-        if (entry.second.size() < 2)
-            continue;
+        std::wstring request;
+        for (const auto& word : positional)
+            request += (request.empty() ? L"" : L" ") + word;
+        return finish(QueryDaemon(queryName, request, log) ? 0 : 1);
+    }
+
+    // Check incoming files against a corpus index written with --build-index.
+    if (!lookupIndexPath.empty())
+    {
+        DuplicateScanner scanner;
+        int exitCode = 0;
+        for (const auto& filePath : positional)
+        {
+            CorpusMatch match;
+            if (!scanner.FindInCorpus(lookupIndexPath, filePath, match))
+            {
+                std::wcerr << L"Failed to look up " << filePath << L" in " << lookupIndexPath << std::endl;
+                exitCode = 1;
+            }
+            else if (match.found)
+                log << L"Duplicate: " << filePath << L" = " << match.masterPath << std::endl;
+            else
+            {
+                log << L"New: " << filePath;
+                if (match.staleEntries > 0)
+                    log << L" (" << match.staleEntries << L" indexed files changed; rebuild the index)";
+                log << std::endl;
+                if (addNew && !scanner.AddToCorpus(lookupIndexPath, filePath))
+                {
+                    std::wcerr << L"Failed to add " << filePath << L" to " << lookupIndexPath << std::endl;
+                    exitCode = 1;
+                }
+            }
+        }
+        return finish(exitCode);
+    }
 
-        std::vector<std::vector<std::wstring>> duplicateGroups;
+    // Apply a plan written earlier with --plan: no scan, no content is read.
+    if (!applyPath.empty())
+    {
+        DuplicateScanner scanner;
+        bool applied = true;
+        if (!ReadDedupPlan(applyPath, scanOptions.memoryBudget, [&](const std::vector<std::vector<FileRecord>>& groups) {
+                applied = scanner.Deduplicate(groups, dedupOptions, ScanCallbacks(), log) && applied;
+            }))
+        {
+            std::wcerr << L"Failed to read dedup plan: " << applyPath << std::endl;
+            return finish(1);
+        }
+        return finish(applied ? 0 : 1);
+    }
 
-        GroupFilesByContentUsingMap(entry.second, duplicateGroups, 0);
+    scanOptions.rootFolder = positional[0];
+    if (positional.size() >= 2)
+    {
+        scanOptions.extensionFilter = positional[1];
+    }
+    scanOptions.cachePath = cachePath;
+    scanOptions.trustCache = trustCache;
+    scanOptions.tuning = *g_compareTuning;
 
-        // Output the duplicate groups.
-        for (const auto& group : duplicateGroups)
+    if (!buildIndexPath.empty())
+    {
+        DuplicateScanner scanner;
+        if (!scanner.BuildCorpusIndex(scanOptions, ScanCallbacks(), buildIndexPath))
         {
-            if (group.size() < 2)
-                continue;
+            std::wcerr << L"Failed to write corpus index: " << buildIndexPath << std::endl;
+            return finish(1);
+        }
+        return finish(0);
+    }
 
-            gain += entry.first * (group.size() - 1);
+    // Keep the index in memory and answer queries on a named pipe.
+    if (!daemonName.empty())
+        return finish(RunDaemon(daemonName, scanOptions, dedupOptions, log) ? 0 : 1);
 
-            allDuplicateGroups.push_back(group);
+    DuplicateScanner scanner;
+    // With --external the enumeration runs as part of the external scan below.
+    const bool external = !scanOptions.scratchFolder.empty();
+    std::map<ULONGLONG, std::vector<FileRecord>> sizeGroups;
+    if (!external && !scanner.Enumerate(scanOptions, ScanCallbacks(), sizeGroups))
+        return finish(1);
+    if (!external && !scanOptions.excludeDirectories.empty())
+        log << L"Pruned " << g_metrics->directoriesPruned << L" directories." << std::endl;
 
-            std::wcout << L"\nDuplicate Group #" << allDuplicateGroups.size() << L" size " << entry.first << L":\n";
-            for (const auto& file : group)
-                std::wcout << L"  " << file << std::endl;
+    // Sampling mismatches, simulating compare costs and estimating the gain end
+    // after the enumeration.
+    if (!sampleProfilePath.empty())
+    {
+        MismatchProfile profile;
+        SampleMismatchProfile(sizeGroups, samplePairs, profile);
+        if (!profile.Save(sampleProfilePath))
+        {
+            std::wcerr << L"Failed to write mismatch profile: " << sampleProfilePath << std::endl;
+            return finish(1);
+        }
+        log << L"Sampled " << profile.pairs << L" pairs, " << profile.identical << L" identical." << std::endl;
+        return finish(0);
+    }
+    if (!simulateProfilePath.empty())
+    {
+        MismatchProfile profile;
+        if (!profile.Load(simulateProfilePath))
+        {
+            std::wcerr << L"Failed to read mismatch profile: " << simulateProfilePath << std::endl;
+            return finish(1);
+        }
+        PhaseScope scope(Phase::Compare);
+        RunIoSimulation(sizeGroups, profile, exactSimulation, log);
+        return finish(0);
+    }
+    if (estimateFraction != 0)
+    {
+        GainEstimate estimate;
+        {
+            PhaseScope scope(Phase::Compare);
+            EstimateGain(sizeGroups, estimateFraction, estimateFiles, estimate);
+        }
+        if (estimate.exact)
+        {
+            log << L"Gain: " << static_cast<ULONGLONG>(estimate.found) << L" bytes of at most "
+                << estimate.potentialGain << L", by probe blocks." << std::endl;
+        }
+        else
+        {
+            log << L"Estimated gain: up to " << static_cast<ULONGLONG>(estimate.upper) << L" bytes (95% bound "
+                << static_cast<ULONGLONG>(estimate.upperBound) << L") of at most " << estimate.potentialGain
+                << L"; the sampled files alone show " << static_cast<ULONGLONG>(estimate.found) << L"." << std::endl;
         }
+        log << L"Sampled " << estimate.groupsRead << L" of " << estimate.sizeGroups << L" size groups in "
+            << estimate.draws << L" draws, reading " << estimate.bytesRead << L" of " << estimate.dataBytes
+            << L" bytes." << std::endl;
+        return finish(0);
     }
 
-    if (allDuplicateGroups.empty())
-        std::wcout << L"\nNo duplicate files found." << std::endl;
+    std::unique_ptr<GroupSink> sink;
+    if (outputFormat == L"jsonl")
+        sink = std::make_unique<JsonlGroupSink>(outputPath);
+    else if (outputFormat == L"binary")
+        sink = std::make_unique<BinaryGroupSink>(outputPath);
     else
-        std::wcout << L"\nGain: " << gain << L" bytes." << std::endl;
+        sink = std::make_unique<HumanGroupSink>(std::wcout);
 
-    //*
-    for (const auto& group : allDuplicateGroups)
+    // With --external the groups are not kept in memory either: they go
+    // straight to the plan file, or to a spill file in the scratch folder that
+    // dedup reads back a batch at a time.
+    std::vector<std::vector<FileRecord>> allDuplicateGroups;
+    std::unique_ptr<PlanWriter> groupStream;
+    std::wstring spillPath;
+    if (external)
     {
-        std::wcout << L"*";
-        if (!DeduplicateGroup(group))
-        {
-            std::wcerr << L"\nFailed to deduplicate group:\n";
-            for (const auto& file : group)
-                std::wcerr << L"  " << file << std::endl;
+        if (planPath.empty())
+            spillPath = scanOptions.scratchFolder + L"\\hdf-groups-" + std::to_wstring(GetCurrentProcessId()) + L".tmp";
+        groupStream = std::make_unique<PlanWriter>(planPath.empty() ? spillPath : planPath);
+    }
+    auto removeSpill = [&]() {
+        if (!spillPath.empty())
+            DeleteFileW(spillPath.c_str());
+    };
+
+    // Output each duplicate group as soon as it is confirmed.
+    size_t groupNumber = 0;
+    ScanCallbacks callbacks;
+    callbacks.onGroup = [&](ULONGLONG size, const std::vector<FileRecord>& group) {
+        if (groupStream)
+            groupStream->Write(group);
+        else
+            allDuplicateGroups.push_back(group);
+        sink->WriteGroup(++groupNumber, size, group);
+    };
+    ScanSummary summary;
+    if (!external)
+        scanner.Group(sizeGroups, scanOptions, callbacks, summary);
+    else if (!scanner.Scan(scanOptions, callbacks, summary))
+    {
+        sink->Flush();
+        groupStream->Close();
+        removeSpill();
+        std::wcerr << L"External scan failed in " << scanOptions.scratchFolder << std::endl;
+        return finish(1);
+    }
+    if (groupStream && !groupStream->Close())
+    {
+        removeSpill();
+        std::wcerr << L"Failed to write duplicate groups to " << (planPath.empty() ? spillPath : planPath) << std::endl;
+        return finish(1);
+    }
+
+    sink->WriteSummary(summary);
+    if (!sink->Flush())
+        std::wcerr << L"Failed to write output." << std::endl;
+    if (summary.unexploredSizeGroups != 0)
+    {
+        log << L"Budget spent: " << summary.gain << L" bytes of gain found, "
+            << summary.unexploredSizeGroups << L" size groups left unexplored with up to "
+            << summary.unexploredGain << L" bytes more." << std::endl;
+    }
 
-            return 1;
+    // With --plan, only record what would be linked.
+    if (!planPath.empty())
+    {
+        if (!external && !WriteDedupPlan(planPath, allDuplicateGroups))
+        {
+            std::wcerr << L"Failed to write dedup plan: " << planPath << std::endl;
+            return finish(1);
         }
+        scanner.Finish();
+        return finish(0);
+    }
+
+    //*
+    if (external)
+    {
+        bool deduplicated = true;
+        const bool read = ReadDedupPlan(spillPath, scanOptions.memoryBudget, [&](const std::vector<std::vector<FileRecord>>& groups) {
+            deduplicated = scanner.Deduplicate(groups, dedupOptions, ScanCallbacks(), log) && deduplicated;
+        });
+        removeSpill();
+        if (!read)
+            std::wcerr << L"Failed to read back duplicate groups from " << spillPath << std::endl;
+        if (!read || !deduplicated)
+            return finish(1);
     }
+    else if (!scanner.Deduplicate(allDuplicateGroups, dedupOptions, ScanCallbacks(), log))
+        return finish(1);
     //*/
 
-    return 0;
+    // A checkpoint is kept until dedup has gone through, so that a run stopped
+    // during it resumes without reading the groups again.
+    scanner.Finish();
+    return finish(0);
 }
+
+#endif // HDF_LIBRARY
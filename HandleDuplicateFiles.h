@@ -0,0 +1,245 @@
+#pragma once
+
+//------------------------------------------------------------------------------
+// HandleDuplicateFiles.h
+//   In-process interface to the duplicate finder: enumerate a folder, group its
+//   files by content and deduplicate the groups, with progress and result
+//   callbacks and cancellation. Build HandleDuplicateFiles.cpp with HDF_LIBRARY
+//   defined to leave out the console entry point.
+
+#include <windows.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// FileRecord
+//   Per-file metadata captured once during enumeration and carried through
+//   grouping and deduplication, so that later stages need not reopen files for it.
+struct FileRecord {
+    std::wstring path;          // The file's full path.
+    ULONGLONG fileId = 0;       // File index on its volume.
+    DWORD volumeSerial = 0;     // Serial number of the volume holding the file.
+    ULONGLONG size = 0;
+    ULONGLONG lastWriteTime = 0;
+    DWORD attributes = 0;
+    DWORD linkCount = 0;        // Names of the file when it was last queried; 0 if unknown.
+};
+
+//------------------------------------------------------------------------------
+// CompareTuning
+//   Bytes read per file and call while comparing, and the most right files
+//   compared against one pivot at a time. Set with --chunk-size and
+//   --max-batch; --microbench measures the alternatives. Files up to
+//   smallFileLimit bytes (--small-file-limit) are instead read whole and
+//   grouped in memory.
+struct CompareTuning {
+    size_t chunkSize = 4096;
+    size_t maxBatch = 256;
+    ULONGLONG smallFileLimit = 256 * 1024;
+};
+
+//------------------------------------------------------------------------------
+// DedupBackend
+//   How DeduplicateGroup() replaces a duplicate:
+//     HardLink   - delete the duplicate and hard-link its path to the master;
+//     CloneExtents - make the duplicate share the master's extents (ReFS block
+//                  cloning); files stay independent, with their own metadata.
+//                  Falls back to HardLink where the volume does not support it.
+enum class DedupBackend {
+    HardLink,
+    CloneExtents
+};
+
+//------------------------------------------------------------------------------
+// DedupOptions
+//   Backend and concurrency of the dedup phase: worker threads, and how many
+//   groups touching one directory or one device may be in flight at a time.
+struct DedupOptions {
+    DedupBackend backend = DedupBackend::HardLink;
+    unsigned threads = 1;
+    unsigned maxPerDirectory = 1;
+    unsigned maxPerDevice = 4;
+};
+
+// Files smaller than this are left out unless ScanOptions::minSize says otherwise.
+constexpr ULONGLONG MIN_SIZE_TO_CONSIDER = 16 * 1024;
+
+//------------------------------------------------------------------------------
+// ScanOptions
+//   What DuplicateScanner enumerates and how it compares. Globs use '*' and
+//   '?' and are case-insensitive; excluded directories are never opened.
+struct ScanOptions {
+    std::wstring rootFolder;
+    std::wstring extensionFilter;   // E.g. ".txt" or ".jpg,.png"; empty for all files.
+    std::vector<std::wstring> includeGlobs;     // If any, a file must match one.
+    std::vector<std::wstring> excludeGlobs;     // A file must match none.
+    std::vector<std::wstring> excludeDirectories;   // Names, or full paths if they contain a separator.
+    ULONGLONG minSize = MIN_SIZE_TO_CONSIDER;
+    ULONGLONG maxSize = ~0ULL;
+    std::wstring cachePath;         // Fingerprint cache; empty for none.
+    bool trustCache = false;        // Take equal content hashes as duplicates unverified.
+    CompareTuning tuning;
+
+    // If set, Scan() keeps at most memoryBudget bytes of file records in memory
+    // (plus the largest size group): the rest goes to sorted run files here.
+    // The fingerprint cache is held in memory whole, so cachePath must be empty.
+    std::wstring scratchFolder;
+    size_t memoryBudget = 256 * 1024 * 1024;
+
+    // If set, a journal of the scan's progress: listed directories (with a
+    // scratch folder, the run files and the directories left to list instead),
+    // decided size groups and deduplicated groups. A scan that stopped part way
+    // resumes from it instead of starting over, as long as the root and filters
+    // are the same; one that finished, and whose groups DuplicateScanner::Finish()
+    // reports deduplicated or written, starts the journal over.
+    std::wstring checkpointPath;
+
+    // Limits on the compare stage; 0 for none. Once either is spent, the size
+    // groups not yet compared are left out and counted in ScanSummary. Checked
+    // between size groups, so the last group compared may overrun them.
+    uint64_t timeBudgetSeconds = 0;
+    ULONGLONG readBudget = 0;       // Bytes read while comparing.
+};
+
+//------------------------------------------------------------------------------
+// ScanProgress
+//   Reported by every stage as it goes. Enumerate counts files considered and
+//   has no total; Compare counts size groups, Dedup duplicate groups.
+enum class ScanStage {
+    Enumerate,
+    Compare,
+    Dedup
+};
+
+struct ScanProgress {
+    ScanStage stage = ScanStage::Enumerate;
+    uint64_t done = 0;
+    uint64_t total = 0;
+};
+
+//------------------------------------------------------------------------------
+// ScanCallbacks
+//   All are optional. onProgress and onError are called from the dedup worker
+//   threads during Deduplicate(), one call at a time; everything else calls
+//   back on the caller's thread.
+struct ScanCallbacks {
+    std::function<void(const ScanProgress& progress)> onProgress;
+
+    // Problems that do not stop the call, such as a file that cannot be read or
+    // a cache that cannot be saved, one message each; without it they go to
+    // std::wcerr.
+    std::function<void(const std::wstring& message)> onError;
+
+    // Each duplicate group as soon as it is confirmed, with its files' size.
+    std::function<void(ULONGLONG size, const std::vector<FileRecord>& group)> onGroup;
+};
+
+//------------------------------------------------------------------------------
+// ScanSummary
+//   Totals over the groups delivered by one Group() or Scan() call, and over
+//   the size groups a budget left out. The unexplored gain is an upper bound:
+//   what those groups would free if all their files were duplicates.
+struct ScanSummary {
+    uint64_t groups = 0;
+    ULONGLONG gain = 0;         // Bytes freed by keeping one file per group.
+    uint64_t unexploredSizeGroups = 0;
+    ULONGLONG unexploredGain = 0;
+};
+
+//------------------------------------------------------------------------------
+// CorpusMatch
+//   Answer of DuplicateScanner::FindInCorpus().
+struct CorpusMatch {
+    bool found = false;
+    std::wstring masterPath;    // The indexed file with the same content.
+    size_t staleEntries = 0;    // Candidates skipped for having changed since indexing.
+};
+
+//------------------------------------------------------------------------------
+// DuplicateScanner
+//   Runs the stages in-process. The fingerprint cache stays loaded between
+//   calls and is only reloaded when ScanOptions::cachePath changes, so repeated
+//   scans of the same tree skip re-reading it. Calls on one scanner must not
+//   overlap; Cancel() may come from any thread. Each scanner has its own
+//   metrics, and its calls compare with the tuning of the options they are
+//   given, so scanners on different threads do not affect each other.
+class DuplicateScanner
+{
+public:
+    DuplicateScanner();
+    ~DuplicateScanner();
+
+    DuplicateScanner(const DuplicateScanner&) = delete;
+    DuplicateScanner& operator=(const DuplicateScanner&) = delete;
+
+    // Adds the files under options.rootFolder to sizeGroups, keyed by size.
+    // Returns false if cancelled or options.checkpointPath cannot be resumed.
+    bool Enumerate(const ScanOptions& options, const ScanCallbacks& callbacks,
+        std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups);
+
+    // Groups each same-size group by content, delivering duplicate groups to
+    // callbacks.onGroup as they are confirmed. The size groups that could free
+    // the most (size times files beyond the first) go first, so that a budget
+    // in options leaves out the least valuable. Returns false if cancelled or
+    // options.checkpointPath cannot be resumed; a spent budget is no failure.
+    bool Group(const std::map<ULONGLONG, std::vector<FileRecord>>& sizeGroups, const ScanOptions& options,
+        const ScanCallbacks& callbacks, ScanSummary& summary);
+
+    // Enumerate() followed by Group(), or with options.scratchFolder set, both
+    // through an external sort by size; size groups then go largest size first.
+    bool Scan(const ScanOptions& options, const ScanCallbacks& callbacks, ScanSummary& summary);
+
+    // Replaces the duplicates of each group by its first file; messages go to
+    // log. Groups the last scan's checkpoint records as done are skipped, and
+    // those done now are recorded. Returns false if a group failed or the call
+    // was cancelled.
+    bool Deduplicate(const std::vector<std::vector<FileRecord>>& groups, const DedupOptions& options,
+        const ScanCallbacks& callbacks, std::wostream& log);
+
+    // Records in the checkpoint that the last scan went through and its groups
+    // were deduplicated or written elsewhere, so that the next scan starts over,
+    // and deletes the run files an external scan kept until then. Does nothing
+    // without a checkpoint, or if the scan stopped short.
+    void Finish();
+
+    // Scans options.rootFolder and writes a corpus index of it to indexPath: one
+    // representative file per distinct content, with its sample hashes.
+    // Returns false if cancelled or the index could not be written.
+    bool BuildCorpusIndex(const ScanOptions& options, const ScanCallbacks& callbacks, const std::wstring& indexPath);
+
+    // Looks filePath up in the corpus index at indexPath, which stays loaded
+    // for later calls with the same path. Reads the file's sample blocks and
+    // compares it byte for byte only with representatives whose samples match.
+    // Files below the scan's minimum size are never found. Representatives
+    // changed since they were indexed are skipped and counted in match. Returns
+    // false if the index or the file could not be read.
+    bool FindInCorpus(const std::wstring& indexPath, const std::wstring& filePath, CorpusMatch& match);
+
+    // Appends filePath to the corpus index at indexPath as the representative
+    // of its content; meant for files FindInCorpus() did not find. Returns
+    // false if the index or the file could not be read, or the index written.
+    bool AddToCorpus(const std::wstring& indexPath, const std::wstring& filePath);
+
+    // Stops the running call at its next check: between directories, size
+    // groups or dedup groups. Has no effect while no call is running.
+    void Cancel();
+
+    // Whether the last call was stopped by Cancel().
+    bool Cancelled() const;
+
+    // The metrics of this scanner's calls so far, as a readable summary or in
+    // the Prometheus text format (as --metrics and --metrics-file do).
+    void PrintMetrics(std::wostream& out) const;
+    bool WriteMetricsTextfile(const std::wstring& path) const;
+
+private:
+    struct State;
+    std::unique_ptr<State> m_state;
+};